@@ -0,0 +1,368 @@
+//=====================================================================
+//
+// bench.cpp - kcp 吞吐与延迟基准
+//
+// 说明：
+// 在虚拟时钟下跑一组参数矩阵（模式 x 窗口 x mtu x 丢包率 x rtt），
+// 每个组合做一次单向批量传输，输出吞吐、有效吞吐、延迟分位数、
+// 重传比例和每 MB 消耗的 CPU 时间，每一行都带有 git 版本号，
+// 便于在不同提交之间比较。不需要交互，适合放进自动化任务。
+//
+// 用法：
+// kcp_bench [csv|json] [mode=0,1,2,3] [wnd=32,128,512] [mtu=576,1400]
+//           [loss=0,2,10] [rtt=20,100] [rate=0] [jitter=0] [rto=0]
+//           [bytes=4194304] [seed=1]
+//
+// 列表参数用逗号分隔；rate 为单向带宽（字节/ms），0 表示不限；
+// jitter 让 rtt 在 [rtt, rtt + jitter] 内均匀变化；
+// rto 为 ikcp_rtomode 的 IKCP_RTO_* 组合，百分位固定为 95。
+// spurious 列为事后发现多余的重传占全部重传的比例。
+//
+//=====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "test.h"
+#include "ikcp.c"
+
+#ifdef KCP_HAVE_GIT_REV_H
+#include "kcp_git_rev.h"
+#endif
+#ifndef KCP_GIT_REV
+#define KCP_GIT_REV "unknown"
+#endif
+
+
+// 参数矩阵
+struct BenchMatrix
+{
+	std::vector<int> modes;
+	std::vector<int> wnds;
+	std::vector<int> mtus;
+	std::vector<int> losts;
+	std::vector<int> rtts;
+	int rate;
+	int jitter;
+	int rto;
+	int bytes;
+	IUINT64 seed;
+};
+
+// 一次传输的参数
+struct BenchConfig
+{
+	int mode;			// 0: default, 1: normal, 2: fast, 3: fast+fec
+	int wnd;
+	int mtu;
+	int lostrate;		// 往返丢包率百分比
+	int rtt;
+	int rate;
+	int jitter;			// rtt 的波动范围 (ms)
+	int rto;			// ikcp_rtomode 的参数
+	int bytes;			// 传输的应用数据总量
+	IUINT64 seed;
+};
+
+// 一次传输的结果
+struct BenchResult
+{
+	bool complete;		// 是否在时间上限内传完
+	IUINT32 elapsed;	// 虚拟时间 (ms)
+	double throughput;	// 发送端输出的下层字节 (KB/s)，含包头、重传和校验包
+	double goodput;		// 接收端交付的应用数据 (KB/s)
+	IUINT32 p50;		// 消息延迟分位数 (ms)
+	IUINT32 p99;
+	IUINT32 p999;
+	double retrans;		// 重传的数据段 / 发送的数据段
+	double spurious;	// 多余的重传 / 重传
+	double cpu;			// 每 MB 应用数据消耗的 CPU 时间 (ms)
+};
+
+static const char *mode_names[4] = { "default", "normal", "fast", "fast+fec" };
+
+// 消息大小和虚拟时间上限
+static const int BENCH_MSG = 1000;
+static const IUINT32 BENCH_LIMIT = 600000;
+
+struct BenchPeer
+{
+	LatencySimulator *vnet;
+	int id;
+	IINT64 bytes;		// 输出的下层字节数
+};
+
+static int bench_output(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+	BenchPeer *peer = (BenchPeer*)user;
+	peer->bytes += len;
+	peer->vnet->send(peer->id, buf, len);
+	return 0;
+}
+
+static void bench_setup(ikcpcb *kcp, const BenchConfig &cfg)
+{
+	ikcp_wndsize(kcp, cfg.wnd, cfg.wnd);
+	ikcp_setmtu(kcp, cfg.mtu);
+	if (cfg.mode == 0) {
+		ikcp_nodelay(kcp, 0, 10, 0, 0);
+	}	else if (cfg.mode == 1) {
+		ikcp_nodelay(kcp, 0, 10, 0, 1);
+	}	else {
+		ikcp_nodelay(kcp, 2, 10, 2, 1);
+		kcp->rx_minrto = 10;
+		if (cfg.mode == 3) {
+			ikcp_fec(kcp, IKCP_FEC_RS, 10, 3);
+		}
+	}
+	ikcp_rtomode(kcp, cfg.rto, 95);
+}
+
+static inline void bench_next(IUINT32 current, IUINT32 ts, IUINT32 *next)
+{
+	if ((IINT32)(ts - *next) < 0) *next = ts;
+	if ((IINT32)(*next - current) <= 0) *next = current + 1;
+}
+
+static IUINT32 percentile(const std::vector<IUINT32> &sorted, int permille)
+{
+	if (sorted.empty()) return 0;
+	size_t index = sorted.size() * permille / 1000;
+	if (index >= sorted.size()) index = sorted.size() - 1;
+	return sorted[index];
+}
+
+// 端点 0 向端点 1 批量发送 cfg.bytes 字节，每条消息带上发送时刻
+BenchResult bench(const BenchConfig &cfg)
+{
+	IUINT32 current = 0;
+	LatencySimulator vnet(cfg.lostrate, cfg.rtt, cfg.rtt + cfg.jitter, 100000,
+		cfg.seed);
+	vnet.setclock(&current);
+	if (cfg.rate > 0) {
+		LinkProfile profile(cfg.lostrate / 2, cfg.rtt / 2,
+			(cfg.rtt + cfg.jitter) / 2);
+		profile.rate = cfg.rate;
+		profile.burst = cfg.mtu * 4;
+		profile.queue = cfg.rate * 100;
+		vnet.setprofile(0, profile);
+		vnet.setprofile(1, profile);
+	}
+
+	BenchPeer p1 = { &vnet, 0, 0 };
+	BenchPeer p2 = { &vnet, 1, 0 };
+	ikcpcb *kcp1 = ikcp_create(0x11223344, &p1);
+	ikcpcb *kcp2 = ikcp_create(0x11223344, &p2);
+	kcp1->output = bench_output;
+	kcp2->output = bench_output;
+	bench_setup(kcp1, cfg);
+	bench_setup(kcp2, cfg);
+
+	int count = (cfg.bytes + BENCH_MSG - 1) / BENCH_MSG;
+	int sent = 0;
+	int received = 0;
+	IINT64 delivered = 0;
+	std::vector<IUINT32> latency;
+	latency.reserve(count);
+	char buffer[BENCH_MSG + 2000];
+	int hr;
+
+	memset(buffer, 0, sizeof(buffer));
+	clock_t cpu = clock();
+
+	while (received < count && current < BENCH_LIMIT) {
+		while ((hr = vnet.recv(1, buffer, sizeof(buffer))) >= 0) {
+			ikcp_input(kcp2, buffer, hr);
+		}
+		while ((hr = vnet.recv(0, buffer, sizeof(buffer))) >= 0) {
+			ikcp_input(kcp1, buffer, hr);
+		}
+
+		while ((hr = ikcp_recv(kcp2, buffer, sizeof(buffer))) >= 0) {
+			IUINT32 ts = *(IUINT32*)(buffer + 4);
+			latency.push_back(current - ts);
+			delivered += hr;
+			received++;
+		}
+
+		// 发送队列保持在两倍窗口左右
+		while (sent < count && ikcp_waitsnd(kcp1) < cfg.wnd * 2) {
+			((IUINT32*)buffer)[0] = sent++;
+			((IUINT32*)buffer)[1] = current;
+			ikcp_send(kcp1, buffer, BENCH_MSG);
+		}
+
+		ikcp_update(kcp1, current);
+		ikcp_update(kcp2, current);
+
+		IUINT32 ts, wake = current + kcp1->interval;
+		bench_next(current, ikcp_check(kcp1, current), &wake);
+		bench_next(current, ikcp_check(kcp2, current), &wake);
+		if (vnet.next_delivery(0, &ts)) bench_next(current, ts, &wake);
+		if (vnet.next_delivery(1, &ts)) bench_next(current, ts, &wake);
+		current = wake;
+	}
+
+	cpu = clock() - cpu;
+
+	ikcpstats stats;
+	ikcp_get_stats(kcp1, &stats);
+
+	std::sort(latency.begin(), latency.end());
+
+	BenchResult result;
+	IUINT32 elapsed = (current > 0)? current : 1;
+	result.complete = (received == count);
+	result.elapsed = current;
+	result.throughput = (double)p1.bytes / elapsed * 1000.0 / 1024.0;
+	result.goodput = (double)delivered / elapsed * 1000.0 / 1024.0;
+	result.p50 = percentile(latency, 500);
+	result.p99 = percentile(latency, 990);
+	result.p999 = percentile(latency, 999);
+	IUINT64 retrans = stats.retrans_rto + stats.retrans_fast +
+		stats.retrans_rack + stats.retrans_tlp;
+	result.retrans = (stats.out_segs > 0)?
+		(double)retrans / stats.out_segs : 0;
+	result.spurious = (retrans > 0)? (double)stats.spurious / retrans : 0;
+	result.cpu = (delivered > 0)? (double)cpu * 1000.0 / CLOCKS_PER_SEC /
+		(delivered / 1048576.0) : 0;
+
+	ikcp_release(kcp1);
+	ikcp_release(kcp2);
+	return result;
+}
+
+// 解析逗号分隔的整数列表
+static std::vector<int> parse_list(const char *text)
+{
+	std::vector<int> values;
+	for (const char *p = text; *p; ) {
+		values.push_back(atoi(p));
+		while (*p && *p != ',') p++;
+		if (*p == ',') p++;
+	}
+	return values;
+}
+
+static void default_matrix(BenchMatrix &m)
+{
+	static const int modes[] = { 0, 1, 2, 3 };
+	static const int wnds[] = { 32, 128, 512 };
+	static const int mtus[] = { 576, 1400 };
+	static const int losts[] = { 0, 2, 10 };
+	static const int rtts[] = { 20, 100 };
+	m.modes.assign(modes, modes + 4);
+	m.wnds.assign(wnds, wnds + 3);
+	m.mtus.assign(mtus, mtus + 2);
+	m.losts.assign(losts, losts + 3);
+	m.rtts.assign(rtts, rtts + 2);
+	m.rate = 0;
+	m.jitter = 0;
+	m.rto = 0;
+	m.bytes = 4 << 20;
+	m.seed = 1;
+}
+
+static bool parse_arg(BenchMatrix &m, const char *arg)
+{
+	const char *value = strchr(arg, '=');
+	if (value == NULL) return false;
+	size_t n = value - arg;
+	value++;
+	if (n == 4 && strncmp(arg, "mode", n) == 0) {
+		m.modes = parse_list(value);
+		for (size_t i = 0; i < m.modes.size(); i++) {
+			if (m.modes[i] < 0 || m.modes[i] > 3) return false;
+		}
+	}
+	else if (n == 3 && strncmp(arg, "wnd", n) == 0) m.wnds = parse_list(value);
+	else if (n == 3 && strncmp(arg, "mtu", n) == 0) m.mtus = parse_list(value);
+	else if (n == 4 && strncmp(arg, "loss", n) == 0) m.losts = parse_list(value);
+	else if (n == 3 && strncmp(arg, "rtt", n) == 0) m.rtts = parse_list(value);
+	else if (n == 4 && strncmp(arg, "rate", n) == 0) m.rate = atoi(value);
+	else if (n == 6 && strncmp(arg, "jitter", n) == 0) m.jitter = atoi(value);
+	else if (n == 3 && strncmp(arg, "rto", n) == 0) m.rto = atoi(value);
+	else if (n == 5 && strncmp(arg, "bytes", n) == 0) m.bytes = atoi(value);
+	else if (n == 4 && strncmp(arg, "seed", n) == 0) m.seed = (IUINT64)atoi(value);
+	else return false;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	BenchMatrix m;
+	bool json = false;
+	default_matrix(m);
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "json") == 0) json = true;
+		else if (strcmp(argv[i], "csv") == 0) json = false;
+		else if (!parse_arg(m, argv[i])) {
+			fprintf(stderr, "usage: %s [csv|json] [mode=0,1,2,3] [wnd=..] "
+				"[mtu=..] [loss=..] [rtt=..] [rate=0] [jitter=0] [rto=0] "
+				"[bytes=N] [seed=N]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (m.bytes < BENCH_MSG) m.bytes = BENCH_MSG;
+	if (m.jitter < 0) m.jitter = 0;
+
+	if (json) printf("[\n");
+	else printf("rev,mode,wnd,mtu,loss,rtt,rate,jitter,rto,bytes,complete,elapsed_ms,"
+		"throughput_kbs,goodput_kbs,p50_ms,p99_ms,p999_ms,retrans,spurious,"
+		"cpu_ms_per_mb\n");
+
+	int total = 0;
+	for (size_t a = 0; a < m.modes.size(); a++)
+	for (size_t b = 0; b < m.wnds.size(); b++)
+	for (size_t c = 0; c < m.mtus.size(); c++)
+	for (size_t d = 0; d < m.losts.size(); d++)
+	for (size_t e = 0; e < m.rtts.size(); e++) {
+		BenchConfig cfg;
+		cfg.mode = m.modes[a];
+		cfg.wnd = m.wnds[b];
+		cfg.mtu = m.mtus[c];
+		cfg.lostrate = m.losts[d];
+		cfg.rtt = m.rtts[e];
+		cfg.rate = m.rate;
+		cfg.jitter = m.jitter;
+		cfg.rto = m.rto;
+		cfg.bytes = m.bytes;
+		cfg.seed = m.seed;
+		BenchResult r = bench(cfg);
+		if (json) {
+			printf("%s  {\"rev\": \"%s\", \"mode\": \"%s\", \"wnd\": %d, "
+				"\"mtu\": %d, \"loss\": %d, \"rtt\": %d, \"rate\": %d, "
+				"\"jitter\": %d, \"rto\": %d, \"bytes\": %d, \"complete\": %s, "
+				"\"elapsed_ms\": %u, "
+				"\"throughput_kbs\": %.1f, \"goodput_kbs\": %.1f, "
+				"\"p50_ms\": %u, \"p99_ms\": %u, \"p999_ms\": %u, "
+				"\"retrans\": %.4f, \"spurious\": %.4f, "
+				"\"cpu_ms_per_mb\": %.3f}",
+				(total > 0)? ",\n" : "", KCP_GIT_REV, mode_names[cfg.mode],
+				cfg.wnd, cfg.mtu, cfg.lostrate, cfg.rtt, cfg.rate, cfg.jitter,
+				cfg.rto, cfg.bytes, r.complete? "true" : "false", (unsigned)r.elapsed,
+				r.throughput, r.goodput, (unsigned)r.p50, (unsigned)r.p99,
+				(unsigned)r.p999, r.retrans, r.spurious, r.cpu);
+		}	else {
+			printf("%s,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%u,%.1f,%.1f,%u,%u,%u,"
+				"%.4f,%.4f,%.3f\n",
+				KCP_GIT_REV, mode_names[cfg.mode], cfg.wnd, cfg.mtu,
+				cfg.lostrate, cfg.rtt, cfg.rate, cfg.jitter, cfg.rto, cfg.bytes,
+				r.complete? 1 : 0, (unsigned)r.elapsed, r.throughput,
+				r.goodput, (unsigned)r.p50, (unsigned)r.p99, (unsigned)r.p999,
+				r.retrans, r.spurious, r.cpu);
+		}
+		fflush(stdout);
+		total++;
+	}
+
+	if (json) printf("\n]\n");
+	return 0;
+}
+
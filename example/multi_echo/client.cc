@@ -1,5 +1,9 @@
 // echo_client.cpp
-// 用法: ./echo_client <server_ip> <server_port> [conv]
+// 用法: ./echo_client <server_ip> <server_port> [conv] [cookie]
+// 说明: 带 cookie 参数时先完成 handshake.h 中的 cookie 握手，对应 server 的 cookie 模式
+//       Ctrl-D 时 ikcp_close，收完回显、server 也关闭后退出，最多等 5 秒
+//       输入 /rebind 换一个本地端口，模拟 NAT 重新绑定，配合 server 的 migrate 模式，
+//       迁移要带回 ACCEPT 中的会话令牌，需要 cookie 握手；conv 即连接 ID，默认随机生成
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
@@ -10,12 +14,15 @@
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <random>
 #include <string>
 
 extern "C" {
 #include "../../ikcp.h"
 }
 
+#include "handshake.h"
+
 static uint32_t now_ms()
 {
 	using namespace std::chrono;
@@ -37,15 +44,51 @@ static int kcp_output(const char *b, int l, ikcpcb *, void *u)
 	return sendto(c->sock, b, l, 0, (sockaddr *)&c->peer, c->peer_len);
 }
 
+// HELLO -> COOKIE -> CONNECT -> ACCEPT，每 500ms 重发当前一步，最多等 10 秒
+// 成功时 token 为 ACCEPT 下发的会话令牌
+static bool handshake(const Ctx &c, uint32_t conv, uint64_t &token)
+{
+	uint8_t hello[HS_HELLO_SIZE], connect[HS_COOKIE_SIZE], in[2048];
+	memset(hello, 0, sizeof(hello));
+	hs_put32(hello, conv);
+	hello[4] = HS_HELLO;
+	const uint8_t *pkt = hello;
+	int len = sizeof(hello);
+	uint32_t start = now_ms(), next = start;
+
+	while (now_ms() - start < 10000) {
+		if ((int32_t)(now_ms() - next) >= 0) {
+			sendto(c.sock, pkt, len, 0, (const sockaddr *)&c.peer, c.peer_len);
+			next = now_ms() + 500;
+		}
+		int n = recvfrom(c.sock, in, sizeof(in), 0, nullptr, nullptr);
+		if (n <= 0) {
+			usleep(1000);
+			continue;
+		}
+		if (!hs_is_handshake(in, n) || hs_get32(in) != conv)
+			continue;
+		if (in[4] == HS_COOKIE && n >= HS_COOKIE_SIZE) {
+			len = hs_encode_cookie(connect, HS_CONNECT, conv, hs_get32(in + 5), hs_get64(in + 9));
+			pkt = connect;
+			next = now_ms();
+		} else if (in[4] == HS_ACCEPT && n >= HS_ACCEPT_SIZE) {
+			token = hs_get64(in + 5);
+			return true;
+		}
+	}
+	return false;
+}
+
 int main(int argc, char **argv)
 {
 	if (argc < 3) {
-		std::cerr << "Usage: " << argv[0] << " <ip> <port> [conv]\n";
+		std::cerr << "Usage: " << argv[0] << " <ip> <port> [conv] [cookie]\n";
 		return 1;
 	}
 	std::string ip = argv[1];
 	int port = std::stoi(argv[2]);
-	uint32_t conv = (argc >= 4) ? (uint32_t)std::stoul(argv[3]) : 0x11223344;
+	uint32_t conv = (argc >= 4) ? (uint32_t)std::stoul(argv[3]) : std::random_device()();
 
 	int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock < 0) {
@@ -63,6 +106,15 @@ int main(int argc, char **argv)
 	std::memcpy(&ctx.peer, &a, sizeof(a));
 	ctx.peer_len = sizeof(a);
 
+	uint64_t token = 0; // 会话令牌，没有握手时为 0，server 不会接受迁移
+	if (argc >= 5 && std::string(argv[4]) == "cookie") {
+		if (!handshake(ctx, conv, token)) {
+			std::cerr << "handshake timeout\n";
+			return 1;
+		}
+		std::cout << "handshake done\n";
+	}
+
 	ikcpcb *kcp = ikcp_create(conv, &ctx);
 	kcp->output = kcp_output;
 	ikcp_nodelay(kcp, 1, 10, 2, 0);
@@ -78,12 +130,25 @@ int main(int argc, char **argv)
 	char udp[2048], app[4096];
 
 	std::cout << "Type then Enter, Ctrl-D to quit\n";
-	while (true) {
+	bool closing = false;
+	uint32_t close_ms = 0; // 调用 ikcp_close 的时间
+	while (!(ikcp_closestate(kcp) & IKCP_CLOSE_DONE)) {
 		// UDP -> KCP
 		for (;;) {
-			int n = recvfrom(sock, udp, sizeof(udp), 0, nullptr, nullptr);
+			int n = recvfrom(ctx.sock, udp, sizeof(udp), 0, nullptr, nullptr);
 			if (n <= 0)
 				break;
+			if (hs_is_handshake((const uint8_t *)udp, n)) {
+				// server 验证新地址: 原样带回 ts 和 mac，再附上会话令牌
+				auto *in = (const uint8_t *)udp;
+				uint8_t out[HS_PATH_RESPONSE_SIZE];
+				if (in[4] == HS_PATH_CHALLENGE && n >= HS_COOKIE_SIZE && hs_get32(in) == conv) {
+					hs_encode_cookie(out, HS_PATH_RESPONSE, conv, hs_get32(in + 5), hs_get64(in + 9));
+					hs_put64(out + HS_COOKIE_SIZE, token);
+					sendto(ctx.sock, out, HS_PATH_RESPONSE_SIZE, 0, (const sockaddr *)&ctx.peer, ctx.peer_len);
+				}
+				continue;
+			}
 			ikcp_input(kcp, udp, n);
 		}
 		// KCP -> APP
@@ -95,13 +160,29 @@ int main(int argc, char **argv)
 		}
 		// STDIN -> KCP
 		char buf[1024];
-		ssize_t r = read(STDIN_FILENO, buf, sizeof(buf));
-		if (r > 0)
+		ssize_t r = closing ? -1 : read(STDIN_FILENO, buf, sizeof(buf));
+		if (r > 0 && std::string(buf, r).rfind("/rebind", 0) == 0) {
+			// 换一个新的 socket，server 看到的就是新的地址端口
+			int fresh = ::socket(AF_INET, SOCK_DGRAM, 0);
+			if (fresh >= 0) {
+				set_nonblock(fresh);
+				close(ctx.sock);
+				ctx.sock = fresh;
+				std::cout << "rebound to a new local port\n";
+			}
+		} else if (r > 0) {
 			ikcp_send(kcp, buf, (int)r);
-		else if (r == 0)
-			break;
+		} else if (r == 0) {
+			ikcp_close(kcp, -1);
+			closing = true;
+			close_ms = now_ms();
+		}
 
 		uint32_t now = now_ms();
+		if (closing && now - close_ms > 5000) {
+			std::cerr << "close timeout\n";
+			break;
+		}
 		if (now >= next) {
 			ikcp_update(kcp, now);
 			next = ikcp_check(kcp, now);
@@ -109,6 +190,6 @@ int main(int argc, char **argv)
 		usleep(1000);
 	}
 	ikcp_release(kcp);
-	close(sock);
+	close(ctx.sock);
 	return 0;
 }
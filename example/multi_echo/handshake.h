@@ -0,0 +1,152 @@
+// handshake.h
+// 说明: multi_echo 的无状态 cookie 握手，server 只在对端证明能收到回包之后才创建会话
+//
+// 报文（小端），type 与 KCP 头的 cmd 在同一偏移，KCP 的 cmd 从 81 开始，不会混淆:
+//   HELLO   conv(4) type(1)=1 padding      总长 HS_HELLO_SIZE，不小于 COOKIE，不会被用来放大流量
+//   COOKIE  conv(4) type(1)=2 ts(4) mac(8)  mac = SipHash-2-4(key, conv|type|ts|对端地址)
+//   CONNECT conv(4) type(1)=3 ts(4) mac(8)  原样带回 COOKIE 中的 ts 和 mac
+//   ACCEPT  conv(4) type(1)=4 token(8)      会话已建立，之后就是普通的 KCP 报文；token 是会话令牌
+//   PATH_CHALLENGE conv(4) type(1)=5 ts(4) mac(8)  已有会话的 conv 从新地址发来窗口内的报文时发给新地址
+//   PATH_RESPONSE  conv(4) type(1)=6 ts(4) mac(8) token(8)
+//                  从新地址带回 ts、mac 和 ACCEPT 中的 token，server 随后把会话迁到新地址
+//
+// server 不为 HELLO 保存任何状态，校验 CONNECT 只需要算一次 SipHash。
+// mac 里有签发它的 type，COOKIE 不能冒充 PATH_CHALLENGE，反之亦然。PATH_CHALLENGE
+// 只证明对端能在新地址收到回包，token 才证明它就是原来会话的对端。
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <cstring>
+
+enum {
+	HS_HELLO = 1,
+	HS_COOKIE = 2,
+	HS_CONNECT = 3,
+	HS_ACCEPT = 4,
+	HS_PATH_CHALLENGE = 5,
+	HS_PATH_RESPONSE = 6,
+};
+
+static const int HS_HELLO_SIZE = 64;
+static const int HS_COOKIE_SIZE = 17;
+static const int HS_ACCEPT_SIZE = 13;
+static const int HS_PATH_RESPONSE_SIZE = 25;
+
+static inline bool hs_is_handshake(const uint8_t *buf, int n)
+{
+	return n >= 5 && buf[4] >= HS_HELLO && buf[4] <= HS_PATH_RESPONSE;
+}
+
+static inline void hs_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t hs_get32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t hs_get64(const uint8_t *p)
+{
+	return (uint64_t)hs_get32(p) | ((uint64_t)hs_get32(p + 4) << 32);
+}
+
+static inline void hs_put64(uint8_t *p, uint64_t v)
+{
+	hs_put32(p, (uint32_t)v);
+	hs_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+// ---- SipHash-2-4 ----
+static inline uint64_t hs_rotl(uint64_t x, int b)
+{
+	return (x << b) | (x >> (64 - b));
+}
+
+#define HS_SIPROUND                                              \
+	do {                                                         \
+		v0 += v1; v1 = hs_rotl(v1, 13); v1 ^= v0; v0 = hs_rotl(v0, 32); \
+		v2 += v3; v3 = hs_rotl(v3, 16); v3 ^= v2;                \
+		v0 += v3; v3 = hs_rotl(v3, 21); v3 ^= v0;                \
+		v2 += v1; v1 = hs_rotl(v1, 17); v1 ^= v2; v2 = hs_rotl(v2, 32); \
+	} while (0)
+
+static inline uint64_t hs_siphash(const uint8_t key[16], const uint8_t *in, size_t len)
+{
+	uint64_t k0 = hs_get64(key), k1 = hs_get64(key + 8);
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t b = (uint64_t)len << 56;
+	size_t left = len & 7;
+	const uint8_t *end = in + len - left;
+
+	for (; in != end; in += 8) {
+		uint64_t m = hs_get64(in);
+		v3 ^= m;
+		HS_SIPROUND;
+		HS_SIPROUND;
+		v0 ^= m;
+	}
+	for (size_t i = 0; i < left; i++) {
+		b |= (uint64_t)in[i] << (8 * i);
+	}
+	v3 ^= b;
+	HS_SIPROUND;
+	HS_SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	HS_SIPROUND;
+	HS_SIPROUND;
+	HS_SIPROUND;
+	HS_SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef HS_SIPROUND
+
+// cookie 绑定 conv、报文类型、签发时间和对端的地址端口
+static inline uint64_t hs_cookie_mac(const uint8_t key[16], int type, uint32_t conv, uint32_t ts,
+									 const sockaddr_storage &peer)
+{
+	uint8_t msg[4 + 1 + 4 + 2 + 16 + 2];
+	size_t len = 0;
+	hs_put32(msg, conv);
+	msg[4] = (uint8_t)type;
+	hs_put32(msg + 5, ts);
+	len = 9;
+	msg[len++] = (uint8_t)peer.ss_family;
+	msg[len++] = (uint8_t)(peer.ss_family >> 8);
+	if (peer.ss_family == AF_INET) {
+		auto *a = (const sockaddr_in *)&peer;
+		memcpy(msg + len, &a->sin_addr, 4);
+		len += 4;
+		memcpy(msg + len, &a->sin_port, 2);
+		len += 2;
+	} else if (peer.ss_family == AF_INET6) {
+		auto *a = (const sockaddr_in6 *)&peer;
+		memcpy(msg + len, &a->sin6_addr, 16);
+		len += 16;
+		memcpy(msg + len, &a->sin6_port, 2);
+		len += 2;
+	}
+	return hs_siphash(key, msg, len);
+}
+
+// COOKIE / CONNECT / PATH_CHALLENGE / PATH_RESPONSE 共用的格式
+static inline int hs_encode_cookie(uint8_t *buf, int type, uint32_t conv, uint32_t ts, uint64_t mac)
+{
+	hs_put32(buf, conv);
+	buf[4] = (uint8_t)type;
+	hs_put32(buf + 5, ts);
+	hs_put64(buf + 9, mac);
+	return HS_COOKIE_SIZE;
+}
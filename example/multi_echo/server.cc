@@ -1,6 +1,11 @@
 // kcp_echo_server_epoll.cpp
-// 用法: ./kcp_echo_server_epoll <listen_port>
+// 用法: ./kcp_echo_server_epoll <listen_port> [cookie] [migrate]
 // 说明: 多客户端（基于 UDP 的 (conv, 对端地址) 会话），epoll + timerfd 定时驱动 KCP
+//       带 cookie 参数时只为完成 cookie 握手的对端创建会话，见 handshake.h
+//       客户端关闭（FIN）后回显完剩余数据也关闭，关闭完成的会话立即释放，不等 gc_idle_ms
+//       带 migrate 参数时 conv 即连接 ID，客户端换了地址（NAT 重新绑定）经 PATH_CHALLENGE
+//       验证新地址、并带回 ACCEPT 中的会话令牌后沿用原来的会话，窗口和 RTT 都不丢；
+//       令牌只能经 cookie 握手下发，所以 migrate 同时打开 cookie
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
@@ -16,7 +21,9 @@
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <random>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -24,6 +31,8 @@ extern "C" {
 #include "../../ikcp.h"
 }
 
+#include "handshake.h"
+
 using namespace std;
 
 // ---- 时间 & 工具 ----
@@ -69,6 +78,8 @@ struct Session {
 	socklen_t peer_len = 0;
 	uint32_t next_update_ms = 0;
 	uint64_t last_active_ms = 0;
+	uint32_t challenge_ms = 0; // 上一次向新地址发 PATH_CHALLENGE 的时间
+	uint64_t token = 0; // ACCEPT 下发的会话令牌，迁移时对端要带回
 	int udp_fd = -1;
 
 	static int kcp_output(const char *buf, int len, ikcpcb *kcp, void *user)
@@ -79,10 +90,39 @@ struct Session {
 	}
 };
 
-// key: conv + '|' + addr:port
-static string make_key(uint32_t conv, const sockaddr_storage &peer)
+// key: conv + 对端地址端口，定长、不分配内存，查表只需一次哈希
+struct SessionKey {
+	uint32_t conv;
+	uint16_t family;
+	uint16_t port;
+	uint8_t addr[16];
+
+	bool operator==(const SessionKey &o) const { return memcmp(this, &o, sizeof(o)) == 0; }
+};
+
+struct SessionKeyHash {
+	size_t operator()(const SessionKey &k) const
+	{
+		return std::hash<std::string_view>()(std::string_view((const char *)&k, sizeof(k)));
+	}
+};
+
+static SessionKey make_key(uint32_t conv, const sockaddr_storage &peer)
 {
-	return to_string(conv) + "|" + addr_to_string(peer);
+	SessionKey k;
+	memset(&k, 0, sizeof(k));
+	k.conv = conv;
+	k.family = peer.ss_family;
+	if (peer.ss_family == AF_INET) {
+		auto *a = (const sockaddr_in *)&peer;
+		k.port = a->sin_port;
+		memcpy(k.addr, &a->sin_addr, 4);
+	} else if (peer.ss_family == AF_INET6) {
+		auto *a = (const sockaddr_in6 *)&peer;
+		k.port = a->sin6_port;
+		memcpy(k.addr, &a->sin6_addr, 16);
+	}
+	return k;
 }
 
 // ---- 服务器 ----
@@ -92,11 +132,20 @@ struct Server {
 	int tfd = -1;
 	uint16_t port = 0;
 
-	unordered_map<string, Session *> sessions;
+	unordered_map<SessionKey, Session *, SessionKeyHash> sessions;
+	unordered_map<uint32_t, Session *> by_conv; // migrate 模式下按 conv 找会话，一个 conv 只有一个会话
 
 	// 参数
 	int interval_ms = 10; // KCP 驱动粒度
 	int gc_idle_ms = 120000; // 无活动会话回收阈值（120s）
+	bool require_cookie = false; // 只为完成 cookie 握手的对端创建会话
+	uint32_t cookie_life_ms = 30000; // cookie 的有效期
+	uint8_t cookie_key[16]; // 进程启动时随机生成，重启后旧 cookie 全部失效
+	uint64_t dropped = 0; // 没有会话也没有握手而丢弃的数据包
+	bool migrate = false; // conv 作为连接 ID，会话可以迁到验证过的新地址
+	uint32_t challenge_gap_ms = 100; // 同一会话两次 PATH_CHALLENGE 的最小间隔
+	uint64_t migrations = 0; // 迁移成功的次数
+	uint64_t token_seq = 0; // 生成会话令牌的计数
 
 	~Server()
 	{
@@ -116,6 +165,11 @@ struct Server {
 	{
 		port = listen_port;
 
+		std::random_device rd;
+		for (int i = 0; i < 16; i += 4) {
+			hs_put32(cookie_key + i, rd());
+		}
+
 		// UDP
 		udp_fd = ::socket(AF_INET, SOCK_DGRAM, 0);
 		if (udp_fd < 0) {
@@ -177,9 +231,15 @@ struct Server {
 		return true;
 	}
 
+	Session *find(uint32_t conv, const sockaddr_storage &peer)
+	{
+		auto it = sessions.find(make_key(conv, peer));
+		return it != sessions.end() ? it->second : nullptr;
+	}
+
 	Session *get_or_create(uint32_t conv, const sockaddr_storage &peer, socklen_t peer_len)
 	{
-		string key = make_key(conv, peer);
+		SessionKey key = make_key(conv, peer);
 		auto it = sessions.find(key);
 		if (it != sessions.end())
 			return it->second;
@@ -198,26 +258,141 @@ struct Server {
 
 		s->next_update_ms = now_ms();
 		sessions.emplace(key, s);
+		if (migrate)
+			by_conv[conv] = s;
 
 		std::cout << "[new] conv=" << conv << " peer=" << addr_to_string(peer)
 				  << " total=" << sessions.size() << "\n";
 		return s;
 	}
 
+	// 会话令牌: 以 cookie_key 对 conv|HS_ACCEPT|序号 做 SipHash，不可预测也不会和 cookie 的 mac 混用
+	uint64_t new_token(uint32_t conv)
+	{
+		uint8_t msg[4 + 1 + 8];
+		hs_put32(msg, conv);
+		msg[4] = HS_ACCEPT;
+		hs_put64(msg + 5, ++token_seq);
+		return hs_siphash(cookie_key, msg, sizeof(msg));
+	}
+
+	// COOKIE 和 PATH_CHALLENGE 带回来的 ts/mac 是否有效，由 type 签发，且属于发来它的地址
+	bool cookie_valid(const uint8_t *buf, int n, int type, const sockaddr_storage &peer)
+	{
+		if (n < HS_COOKIE_SIZE)
+			return false;
+		uint32_t conv = read_le32(buf);
+		uint32_t now = now_ms();
+		uint32_t ts = hs_get32(buf + 5);
+		if ((int32_t)(now - ts) < 0 || now - ts > cookie_life_ms)
+			return false;
+		return hs_get64(buf + 9) == hs_cookie_mac(cookie_key, type, conv, ts, peer);
+	}
+
+	// 新地址发来的 KCP 报文是否落在会话当前的窗口里: una 在 [snd_una, snd_nxt] 之间，
+	// 数据段的 sn 离 rcv_nxt 不超过一个接收窗口。只知道 conv 的第三方猜不中，不会触发验证
+	static bool in_window(const Session *s, const uint8_t *buf)
+	{
+		const ikcpcb *kcp = s->kcp;
+		uint8_t cmd = buf[4];
+		uint32_t sn = read_le32(buf + 12);
+		uint32_t una = read_le32(buf + 16);
+		if ((int32_t)(una - kcp->snd_una) < 0 || (int32_t)(kcp->snd_nxt - una) < 0)
+			return false;
+		if (cmd == 81) { // IKCP_CMD_PUSH
+			int32_t d = (int32_t)(sn - kcp->rcv_nxt);
+			if (d >= (int32_t)kcp->rcv_wnd || d < -(int32_t)kcp->rcv_wnd)
+				return false;
+		}
+		return true;
+	}
+
+	// 已有会话的 conv 出现在新地址: 只向新地址发验证，不保存状态，回包比触发它的 KCP 报文小
+	void send_challenge(Session *s, const sockaddr_storage &peer, socklen_t peer_len)
+	{
+		uint32_t conv = s->kcp->conv;
+		uint32_t now = now_ms();
+		uint8_t out[HS_COOKIE_SIZE];
+		if (now - s->challenge_ms < challenge_gap_ms)
+			return;
+		s->challenge_ms = now;
+		int len = hs_encode_cookie(out, HS_PATH_CHALLENGE, conv, now,
+								   hs_cookie_mac(cookie_key, HS_PATH_CHALLENGE, conv, now, peer));
+		sendto(udp_fd, out, len, 0, (const sockaddr *)&peer, peer_len);
+	}
+
+	// 新地址已经验证，会话连同 ikcpcb 整个换到新地址下
+	void migrate_session(Session *s, const sockaddr_storage &peer, socklen_t peer_len)
+	{
+		uint32_t conv = s->kcp->conv;
+		std::cout << "[migrate] conv=" << conv << " " << addr_to_string(s->peer)
+				  << " -> " << addr_to_string(peer) << "\n";
+		sessions.erase(make_key(conv, s->peer));
+		s->peer = peer;
+		s->peer_len = peer_len;
+		s->last_active_ms = now_ms();
+		sessions.emplace(make_key(conv, peer), s);
+		migrations++;
+	}
+
+	// HELLO 回 cookie，不保存状态；CONNECT 校验 cookie 后才创建会话
+	// PATH_RESPONSE 的 mac 和会话令牌都校验通过后把 conv 的会话迁到发来它的地址
+	void handle_handshake(const uint8_t *buf, int n, const sockaddr_storage &peer, socklen_t peer_len)
+	{
+		uint32_t conv = read_le32(buf);
+		uint32_t now = now_ms();
+		uint8_t out[HS_COOKIE_SIZE]; // 不小于 HS_ACCEPT_SIZE
+
+		if (buf[4] == HS_HELLO) {
+			// 回包不大于请求，伪造源地址的 HELLO 不能放大流量
+			if (n < HS_HELLO_SIZE)
+				return;
+			int len = hs_encode_cookie(out, HS_COOKIE, conv, now, hs_cookie_mac(cookie_key, HS_COOKIE, conv, now, peer));
+			sendto(udp_fd, out, len, 0, (const sockaddr *)&peer, peer_len);
+		} else if (buf[4] == HS_CONNECT) {
+			if (!cookie_valid(buf, n, HS_COOKIE, peer))
+				return;
+			// migrate 模式下 conv 已被别的地址占用，不回 ACCEPT，客户端应换一个 conv
+			if (migrate && by_conv.count(conv) && find(conv, peer) == nullptr)
+				return;
+			// 重复的 CONNECT（ACCEPT 丢失）只再回一次 ACCEPT
+			Session *s = get_or_create(conv, peer, peer_len);
+			s->last_active_ms = now;
+			if (s->token == 0)
+				s->token = new_token(conv);
+			hs_put32(out, conv);
+			out[4] = HS_ACCEPT;
+			hs_put64(out + 5, s->token);
+			sendto(udp_fd, out, HS_ACCEPT_SIZE, 0, (const sockaddr *)&peer, peer_len);
+		} else if (buf[4] == HS_PATH_RESPONSE && migrate) {
+			if (n < HS_PATH_RESPONSE_SIZE || !cookie_valid(buf, n, HS_PATH_CHALLENGE, peer))
+				return;
+			auto it = by_conv.find(conv);
+			if (it != by_conv.end() && find(conv, peer) == nullptr &&
+				it->second->token != 0 && hs_get64(buf + 17) == it->second->token)
+				migrate_session(it->second, peer, peer_len);
+		}
+	}
+
+	// 已经完成关闭握手的会话立即释放，其余的空闲 gc_idle_ms 后回收
 	void destroy_idle_sessions()
 	{
 		uint64_t now = now_ms();
-		vector<string> rm;
+		vector<SessionKey> rm;
 		rm.reserve(8);
 		for (auto &kv : sessions) {
 			Session *s = kv.second;
-			if (now - s->last_active_ms > (uint64_t)gc_idle_ms) {
+			if ((ikcp_closestate(s->kcp) & IKCP_CLOSE_DONE) ||
+				now - s->last_active_ms > (uint64_t)gc_idle_ms) {
 				rm.push_back(kv.first);
 			}
 		}
 		for (auto &key : rm) {
 			Session *s = sessions[key];
-			std::cout << "[gc] close conv=" << s->kcp->conv << " peer=" << addr_to_string(s->peer) << "\n";
+			const char *why = (ikcp_closestate(s->kcp) & IKCP_CLOSE_DONE) ? "[closed]" : "[gc] close";
+			std::cout << why << " conv=" << s->kcp->conv << " peer=" << addr_to_string(s->peer) << "\n";
+			if (migrate)
+				by_conv.erase(s->kcp->conv);
 			ikcp_release(s->kcp);
 			delete s;
 			sessions.erase(key);
@@ -238,13 +413,34 @@ struct Server {
 				perror("recvfrom");
 				break;
 			}
+			if (hs_is_handshake(buf, n)) {
+				handle_handshake(buf, n, peer, peer_len);
+				continue;
+			}
 			if (n < 24) {
 				// KCP 头都不完整，忽略
 				continue;
 			}
 
 			uint32_t conv = read_le32(buf); // 小端
-			Session *s = get_or_create(conv, peer, peer_len);
+			Session *s = find(conv, peer);
+			if (s == nullptr && migrate) {
+				auto it = by_conv.find(conv);
+				if (it != by_conv.end()) {
+					// 已有会话换了地址: 验证通过之前不处理新地址的报文，丢掉的由 KCP 重传
+					if (in_window(it->second, buf))
+						send_challenge(it->second, peer, peer_len);
+					dropped++;
+					continue;
+				}
+			}
+			if (s == nullptr && !require_cookie)
+				s = get_or_create(conv, peer, peer_len);
+			if (s == nullptr) {
+				// 没有握手的对端，只查一次表就丢弃，不分配任何东西
+				dropped++;
+				continue;
+			}
 			s->last_active_ms = now_ms();
 
 			// 喂给 KCP
@@ -254,6 +450,11 @@ struct Server {
 			char app[4096];
 			for (;;) {
 				int m = ikcp_recv(s->kcp, app, sizeof(app));
+				if (m == -4) {
+					// 对端关闭且数据已读完: 回显排在 FIN 之前发完，再等对端确认
+					ikcp_close(s->kcp, -1);
+					break;
+				}
 				if (m < 0)
 					break;
 				// 业务处理：回显
@@ -308,12 +509,18 @@ struct Server {
 int main(int argc, char *argv[])
 {
 	if (argc < 2) {
-		std::cerr << "Usage: " << argv[0] << " <listen_port>\n";
+		std::cerr << "Usage: " << argv[0] << " <listen_port> [cookie] [migrate]\n";
 		return 1;
 	}
 	uint16_t port = (uint16_t)std::stoi(argv[1]);
 
 	Server s;
+	for (int i = 2; i < argc; i++) {
+		if (string(argv[i]) == "cookie")
+			s.require_cookie = true;
+		else if (string(argv[i]) == "migrate")
+			s.migrate = s.require_cookie = true;
+	}
 	if (!s.init(port))
 		return 1;
 	s.run();
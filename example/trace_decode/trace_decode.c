@@ -0,0 +1,83 @@
+// trace_decode.c
+// 用法: ./trace_decode <trace_file>
+// 说明: 解码 ikcp_trace_read 导出的二进制跟踪记录(每条 20 字节, 小端),
+//       按 ikcp_log 的格式逐行打印
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../ikcp.h"
+
+static IUINT32 read_le32(const unsigned char *p)
+{
+	return (IUINT32)p[0] | ((IUINT32)p[1] << 8) | ((IUINT32)p[2] << 16) | ((IUINT32)p[3] << 24);
+}
+
+static void print_record(IUINT32 ts, IUINT32 event, const IUINT32 *arg)
+{
+	printf("%10lu ", (unsigned long)ts);
+	switch (event) {
+	case IKCP_LOG_OUTPUT:
+		printf("[RO] %lu bytes\n", (unsigned long)arg[0]);
+		break;
+	case IKCP_LOG_INPUT:
+		printf("[RI] %lu bytes\n", (unsigned long)arg[0]);
+		break;
+	case IKCP_LOG_SEND:
+		printf("send %lu bytes queue=%lu\n", (unsigned long)arg[0], (unsigned long)arg[1]);
+		break;
+	case IKCP_LOG_RECV:
+		printf("recv sn=%lu len=%lu frg=%lu\n", (unsigned long)arg[0],
+			   (unsigned long)arg[1], (unsigned long)arg[2]);
+		break;
+	case IKCP_LOG_IN_DATA:
+		printf("input psh: sn=%lu ts=%lu len=%lu\n", (unsigned long)arg[0],
+			   (unsigned long)arg[1], (unsigned long)arg[2]);
+		break;
+	case IKCP_LOG_IN_ACK:
+		printf("input ack: sn=%lu rtt=%ld rto=%ld\n", (unsigned long)arg[0],
+			   (long)(IINT32)arg[1], (long)(IINT32)arg[2]);
+		break;
+	case IKCP_LOG_IN_PROBE:
+		printf("input probe\n");
+		break;
+	case IKCP_LOG_IN_WINS:
+		printf("input wins: %lu\n", (unsigned long)arg[0]);
+		break;
+	case IKCP_LOG_OUT_DATA:
+		printf("output psh: sn=%lu xmit=%lu rto=%lu\n", (unsigned long)arg[0],
+			   (unsigned long)arg[1], (unsigned long)arg[2]);
+		break;
+	default:
+		printf("event=%lu %lu %lu %lu\n", (unsigned long)event, (unsigned long)arg[0],
+			   (unsigned long)arg[1], (unsigned long)arg[2]);
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char rec[IKCP_TRACE_SIZE];
+	unsigned long count = 0;
+	FILE *fp;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <trace_file>\n", argv[0]);
+		return 1;
+	}
+	fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	while (fread(rec, 1, sizeof(rec), fp) == sizeof(rec)) {
+		IUINT32 arg[3];
+		arg[0] = read_le32(rec + 8);
+		arg[1] = read_le32(rec + 12);
+		arg[2] = read_le32(rec + 16);
+		print_record(read_le32(rec + 0), read_le32(rec + 4), arg);
+		count++;
+	}
+	fclose(fp);
+	fprintf(stderr, "%lu records\n", count);
+	return 0;
+}
@@ -0,0 +1,24 @@
+# 由 kcp_git_rev 目标在每次编译时执行: cmake -DGIT_EXECUTABLE=.. -DSOURCE_DIR=.. -DOUTPUT=.. -P git_rev.cmake
+# 把当前的 git 版本号写入 OUTPUT；内容没有变化时不改写，避免无谓的重新编译
+set(rev "unknown")
+if(GIT_EXECUTABLE)
+    execute_process(
+        COMMAND "${GIT_EXECUTABLE}" rev-parse --short HEAD
+        WORKING_DIRECTORY "${SOURCE_DIR}"
+        OUTPUT_VARIABLE git_rev
+        OUTPUT_STRIP_TRAILING_WHITESPACE
+        ERROR_QUIET
+    )
+    if(git_rev)
+        set(rev "${git_rev}")
+    endif()
+endif()
+
+set(content "#define KCP_GIT_REV \"${rev}\"\n")
+set(old "")
+if(EXISTS "${OUTPUT}")
+    file(READ "${OUTPUT}" old)
+endif()
+if(NOT content STREQUAL old)
+    file(WRITE "${OUTPUT}" "${content}")
+endif()
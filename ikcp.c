@@ -17,6 +17,19 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+// GF(256) 乘加的 SIMD 版本: gcc/clang 在 x86 上总是编译, 运行时按 cpuid 选择;
+// 其他编译器(如 MSVC /arch:AVX2)只在编译选项已经打开指令集时使用
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define IKCP_GF_SIMD 1
+#define IKCP_GF_DISPATCH 1
+#define IKCP_GF_TARGET(x) __attribute__((target(x)))
+#elif defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#define IKCP_GF_SIMD 1
+#define IKCP_GF_TARGET(x)
+#endif
+
 
 //=====================================================================
 // KCP BASIC
@@ -33,12 +46,29 @@ const IUINT32 IKCP_RTO_DEF = 200; // KCP 使用的默认 RTO
 const IUINT32 IKCP_RTO_MAX = 60000; // 最大 RTO
 // KCP采用RTO指数回退机制(类似TCP), 当RTO增长到超过60秒时则认为是 deadlink
 
+const IUINT32 IKCP_MINRTT_WIN = 10000; // 最小 rtt 的有效期, 超过后用新的采样替换
+
 const IUINT32 IKCP_CMD_PUSH = 81; // cmd: push data
 const IUINT32 IKCP_CMD_ACK = 82; // cmd: ack
 const IUINT32 IKCP_CMD_WASK = 83; // cmd: window probe (ask)
 const IUINT32 IKCP_CMD_WINS = 84; // cmd: window size (tell)
+const IUINT32 IKCP_CMD_FEC = 85; // cmd: fec shard, 只出现在 FEC 头中
+const IUINT32 IKCP_CMD_SKIP = 86; // cmd: abandoned data, 长度为 0, 保留原 frg
+const IUINT32 IKCP_CMD_PROBE = 87; // cmd: path mtu probe, 数据为填充, 不占用 sn
+const IUINT32 IKCP_CMD_PROBEACK = 88; // cmd: probe ack, sn 为收到的探测包大小
+const IUINT32 IKCP_CMD_PART = 89; // cmd: 超过当前 mtu 的数据段的一片, 数据前为 total(2) psize(2) index(2)
 const IUINT32 IKCP_ASK_SEND = 1; // need to send IKCP_CMD_WASK
 const IUINT32 IKCP_ASK_TELL = 2; // need to send IKCP_CMD_WINS
+const IUINT32 IKCP_OPT_TRIES = 8; // 对端没有回应时最多发送的协商次数, 之后按对端不支持处理
+const IUINT32 IKCP_OPT_LEN = 7; // 协商的 WINS 数据: 协商进度(1) 大消息上限(4) 流数(1) 缩放位数(1)
+// 协商进度, 前四位原样发给对端
+const IUINT32 IKCP_OPT_GOT = 1; // 已经收到对端的参数
+const IUINT32 IKCP_OPT_KNOWN = 2; // 对端已知道本端的参数, 本端按缩放通告窗口
+const IUINT32 IKCP_OPT_DECODE = 4; // 对端在按缩放通告窗口, 收到的 wnd 要左移
+const IUINT32 IKCP_OPT_PEER = 8; // 对端已经按缩放解码本端的窗口
+const IUINT32 IKCP_OPT_DONE = 1 | 2 | 8; // 本端的协商已完成
+const IUINT32 IKCP_OPT_REPLY = 16; // 对端的协商未完成, 下次 flush 回复一次
+const IUINT32 IKCP_WSCALE_MAX = 14; // 窗口缩放位数上限, 16 位的 wnd 最多表示 2^30 个段
 
 const IUINT32 IKCP_WND_SND = 32; // 发送窗口大小 (一次能发的segment个数)
 // 如果该值过大, 会导致占用内存过多和重传开销变高
@@ -57,14 +87,38 @@ const IUINT32 IKCP_ACK_FAST = 3; // 超过多少次无序 ACK 就触发快重传
 const IUINT32 IKCP_INTERVAL = 100; // KCP 的默认 update 间隔(心跳)
 // 100ms在大多数场景表现良好, 过低会增加CPU负载; 需要满足RTT的更新精度, 开启nodelay时会降到10–30ms
 
+const IUINT32 IKCP_INTERVAL_MIN_US = 100; // update 间隔下限(微秒), 毫秒时基下为 1ms
+const IUINT32 IKCP_INTERVAL_LIMIT = 5000; // update 间隔上限(毫秒)
+
 const IUINT32 IKCP_OVERHEAD = 24; // kcp 协议头大小(bytes)
 
+const IUINT32 IKCP_FEC_OVERHEAD = 14; // FEC 头大小(bytes), 含 2 字节分片长度
+
+const IUINT32 IKCP_STREAM_OVERHEAD = 6; // 附加流数据段的流头大小(bytes)
+
+const IUINT32 IKCP_PART_OVERHEAD = 6; // 分片发送的片头大小(bytes)
+const IUINT32 IKCP_PART_LIMIT = 64; // 同时重组的数据段个数上限, 超过后丢弃最早的
+
 const IUINT32 IKCP_DEADLINK = 20; // 同一包重传20次，认为链路已断开
 
 const IUINT32 IKCP_THRESH_INIT = 2; // 初始慢启动阈值
 const IUINT32 IKCP_THRESH_MIN = 2; // 最小阈值
 // 拥塞控制参数, 相比 TCP 从 1 开始的速度会更快一些
 
+const IUINT32 IKCP_TUNE_IDLE = 10000; // 自动调整的窗口连续空闲这么久后缩回下限
+
+const IUINT32 IKCP_PMTU_PROBES = 3; // 同一大小连续这么多个探测没有回应, 认为通不过
+const IUINT32 IKCP_PMTU_ACCURACY = 16; // 上下限相差小于它时结束搜索
+const IUINT32 IKCP_PMTU_RAISE = 600000; // 搜索结束 10 分钟后再尝试更大的 MTU
+const IUINT32 IKCP_PMTU_BLACKHOLE = 5; // 超过下限的段超时重传这么多次, 认为路径 MTU 变小了
+// 路径 MTU 探测的状态
+const IUINT32 IKCP_PMTU_SEARCH = 1; // 下次 flush 发出探测
+const IUINT32 IKCP_PMTU_PROBING = 2; // 探测在途, 等待回应直到 ts_pmtu
+const IUINT32 IKCP_PMTU_WAIT = 3; // 搜索结束或刚退回下限, 到 ts_pmtu 再搜索
+
+const IUINT32 IKCP_CLOSE_LINGER = 2000; // 默认的关闭逗留时间(毫秒)
+const IUINT32 IKCP_CLOSE_FIN = 16; // 内部关闭状态: FIN 已经进入 snd_buf, sn 为 fin_sn
+
 const IUINT32 IKCP_PROBE_INIT = 7000; // 首次窗口探测间隔 7 秒
 const IUINT32 IKCP_PROBE_LIMIT = 120000; // 窗口探测上限 120 秒
 // 作用1: 由于UDP无连接, 为了判断对端是否"在线", KCP 使用窗口探测作为保底机制, 周期性向对端发送 WASK 消息进行探测
@@ -72,6 +126,13 @@ const IUINT32 IKCP_PROBE_LIMIT = 120000; // 窗口探测上限 120 秒
 
 const IUINT32 IKCP_FASTACK_LIMIT = 5; // 乱序ACK计数上限, 用于快速确认机制
 
+const IUINT32 IKCP_FRG_MSGHEAD = 255; // 大消息的首段, 数据前 4 字节为消息总长度
+const IUINT32 IKCP_FRG_MSGBODY = 254; // 大消息的后续分段
+const IUINT32 IKCP_FRG_COALESCED = 253; // 合并段, 数据为若干条 [varint 长度][消息]
+const IUINT32 IKCP_FRG_STREAM = 252; // 附加流的数据段, 数据前为 sid(1) frg(1) sseq(4)
+const IUINT32 IKCP_FRG_FIN = 251; // 关闭段, 长度为 0, 占用最后一个 sn, 对端之后不再发送数据
+// 普通分片的 frg < IKCP_WND_RCV, 不会与这些值冲突
+
 //---------------------------------------------------------------------
 // encode / decode
 //---------------------------------------------------------------------
@@ -146,6 +207,40 @@ static inline const char *ikcp_decode32u(const char *p, IUINT32 *l)
 	return p;
 }
 
+/* encode unsigned varint (7 bits per byte, lsb first) */
+static inline char *ikcp_encode_varint(char *p, IUINT32 v)
+{
+	while (v >= 0x80) {
+		*(unsigned char *)p++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*(unsigned char *)p++ = (unsigned char)v;
+	return p;
+}
+
+/* decode unsigned varint, returns NULL if it runs past 'end' */
+static inline const char *ikcp_decode_varint(const char *p, const char *end, IUINT32 *v)
+{
+	IUINT32 value = 0;
+	int shift;
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		unsigned char c = *(const unsigned char *)p++;
+		value |= (IUINT32)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			*v = value;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static inline int ikcp_varint_size(IUINT32 v)
+{
+	int n = 1;
+	for (; v >= 0x80; v >>= 7) n++;
+	return n;
+}
+
 static inline IUINT32 _imin_(IUINT32 a, IUINT32 b)
 {
 	return a <= b ? a : b;
@@ -167,6 +262,21 @@ static inline long _itimediff(IUINT32 later, IUINT32 earlier)
 	return ((IINT32)(later - earlier));
 }
 
+// 把毫秒换算成当前时基的时钟单位
+static inline IUINT32 _ims(const ikcpcb *kcp, IUINT32 ms)
+{
+	return ms * kcp->tick;
+}
+
+// 把 update 间隔限制在 [IKCP_INTERVAL_MIN_US, IKCP_INTERVAL_LIMIT] 内
+static inline IUINT32 ikcp_bound_interval(const ikcpcb *kcp, int interval)
+{
+	IUINT32 lower = _imax_(IKCP_INTERVAL_MIN_US * kcp->tick / 1000, 1);
+	if (interval < (int)lower)
+		return lower;
+	return _imin_((IUINT32)interval, _ims(kcp, IKCP_INTERVAL_LIMIT));
+}
+
 //---------------------------------------------------------------------
 // manage segment
 //---------------------------------------------------------------------
@@ -200,6 +310,16 @@ void ikcp_allocator(void *(*new_malloc)(size_t), void (*new_free)(void *))
 	ikcp_free_hook = new_free;
 }
 
+// 自动调整窗口的全局预算和已经计入的字节数
+static IINT64 ikcp_tune_budget = 0;
+static IINT64 ikcp_tune_used = 0;
+
+static void ikcp_tune_charge(ikcpcb *kcp, IINT64 bytes)
+{
+	ikcp_tune_used += bytes - kcp->tune_bytes;
+	kcp->tune_bytes = bytes;
+}
+
 // allocate a new kcp segment
 static IKCPSEG *ikcp_segment_new(ikcpcb *kcp, int size)
 {
@@ -212,6 +332,18 @@ static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
 	ikcp_free(seg);
 }
 
+// received segments are counted in rcv_held while the receive side keeps them
+static void ikcp_rcv_hold(ikcpcb *kcp, const IKCPSEG *seg)
+{
+	kcp->rcv_held += sizeof(IKCPSEG) + seg->len;
+}
+
+static void ikcp_rcv_delete(ikcpcb *kcp, IKCPSEG *seg)
+{
+	kcp->rcv_held -= sizeof(IKCPSEG) + seg->len;
+	ikcp_segment_delete(kcp, seg);
+}
+
 // write log
 void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...)
 {
@@ -225,22 +357,564 @@ void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...)
 	kcp->writelog(buffer, kcp, kcp->user);
 }
 
-// check log mask
+// check log mask, compile with IKCP_NO_LOG to drop every check
+#ifndef IKCP_NO_LOG
 static int ikcp_canlog(const ikcpcb *kcp, int mask)
 {
-	return ((mask & kcp->logmask) == 0 || kcp->writelog == NULL) ? 0 : 1;
+	if ((mask & kcp->logmask) == 0)
+		return 0;
+	return (kcp->writelog == NULL && kcp->trace == NULL) ? 0 : 1;
+}
+#else
+#define ikcp_canlog(kcp, mask) 0
+#endif
+
+// append a binary trace record
+static void ikcp_trace_push(ikcpcb *kcp, int event, IUINT32 a, IUINT32 b, IUINT32 c)
+{
+	struct IKCPTRACE *rec;
+	if (kcp->trace == NULL)
+		return;
+	rec = &kcp->trace[kcp->trace_wpos & kcp->trace_mask];
+	rec->ts = kcp->current;
+	rec->event = (IUINT32)event;
+	rec->arg[0] = a;
+	rec->arg[1] = b;
+	rec->arg[2] = c;
+	kcp->trace_wpos++;
+}
+
+//---------------------------------------------------------------------
+// forward error correction
+// 每 datashards 个输出数据包之后追加 parityshards 个校验包, 接收端在
+// 数据包进入 ikcp_input 之前恢复丢失的数据包. 每个包前附加 FEC 头:
+// conv(4) cmd(1) index(1) k(1) m(1) group(4) size(2), 校验包覆盖
+// size(2) + 数据部分, 按组内最长的数据包补零对齐.
+//---------------------------------------------------------------------
+#define IKCP_FEC_GROUPS 8 // 接收端同时缓存的分组数
+
+struct IKCPFEC_GROUP {
+	IUINT32 group; // 分组号
+	int used; // 是否已使用
+	int done; // 已完整收到或已恢复
+	int k; // 组内数据包个数, 收到校验包之前为 0
+	int ndata; // 已收到的数据包个数
+	int nparity; // 已收到的校验包个数
+	int length; // 校验包的 size(2) + 数据部分长度
+	unsigned char *present; // 每个分片是否已收到
+	unsigned char *shards; // (datashards + parityshards) * shardsize
+};
+
+// 接收端正在重组的分片数据段, 片按 index 定位, 片长度固定为 psize
+struct IKCPPART {
+	struct IQUEUEHEAD node;
+	IUINT32 sn;
+	IUINT32 total; // 数据段的长度
+	IUINT32 psize; // 每片的数据长度, 最后一片可以更短
+	IUINT32 missing; // 还没有收到的片数
+	unsigned char *present; // 每片是否已收到
+	char data[1]; // total 字节的数据, 之后是 present
+};
+
+// GF(256) 乘加的 SIMD 内核, 见 ikcp_gf_select
+typedef int (*ikcp_gf_kernel)(unsigned char *dst, const unsigned char *src,
+	const unsigned char *lo, const unsigned char *hi, int len);
+
+struct IKCPFEC {
+	int mode; // IKCP_FEC_XOR / IKCP_FEC_RS
+	ikcp_gf_kernel kernel; // 本机可用的乘加内核, NULL 表示查表
+	int datashards; // 每组数据包个数
+	int parityshards; // 每组校验包个数
+	int shardsize; // 单个分片缓冲区大小: mtu - IKCP_FEC_OVERHEAD + 2
+	// 发送端
+	IUINT32 snd_group; // 当前分组号
+	int snd_index; // 当前分组已发出的数据包个数
+	int snd_length; // 当前分组最长的分片长度
+	IUINT32 snd_ts; // 当前分组第一个数据包的发送时间
+	unsigned char *parity; // 增量计算中的校验分片 parityshards * shardsize
+	char *packet; // 输出缓冲区
+	// 接收端
+	struct IKCPFEC_GROUP groups[IKCP_FEC_GROUPS];
+};
+
+// GF(2^8) 的指数表和对数表, 本原多项式 x^8 + x^4 + x^3 + x^2 + 1 (0x11d),
+// exp 重复一遍省去乘法中的取模, log[0] 不使用
+static const unsigned char ikcp_gf_exp[512] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
+	0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
+	0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
+	0x46, 0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1,
+	0x5f, 0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0,
+	0xfd, 0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2,
+	0xd9, 0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce,
+	0x81, 0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc,
+	0x85, 0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54,
+	0xa8, 0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73,
+	0xe6, 0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff,
+	0xe3, 0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41,
+	0x82, 0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6,
+	0x51, 0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09,
+	0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
+	0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+	0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
+	0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x9d,
+	0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
+	0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1, 0x5f,
+	0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0, 0xfd,
+	0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2, 0xd9,
+	0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce, 0x81,
+	0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc, 0x85,
+	0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54, 0xa8,
+	0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73, 0xe6,
+	0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff, 0xe3,
+	0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41, 0x82,
+	0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6, 0x51,
+	0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09, 0x12,
+	0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16, 0x2c,
+	0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01, 0x02,
+};
+
+static const unsigned char ikcp_gf_log[256] = {
+	0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6, 0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
+	0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81, 0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x08, 0x4c, 0x71,
+	0x05, 0x8a, 0x65, 0x2f, 0xe1, 0x24, 0x0f, 0x21, 0x35, 0x93, 0x8e, 0xda, 0xf0, 0x12, 0x82, 0x45,
+	0x1d, 0xb5, 0xc2, 0x7d, 0x6a, 0x27, 0xf9, 0xb9, 0xc9, 0x9a, 0x09, 0x78, 0x4d, 0xe4, 0x72, 0xa6,
+	0x06, 0xbf, 0x8b, 0x62, 0x66, 0xdd, 0x30, 0xfd, 0xe2, 0x98, 0x25, 0xb3, 0x10, 0x91, 0x22, 0x88,
+	0x36, 0xd0, 0x94, 0xce, 0x8f, 0x96, 0xdb, 0xbd, 0xf1, 0xd2, 0x13, 0x5c, 0x83, 0x38, 0x46, 0x40,
+	0x1e, 0x42, 0xb6, 0xa3, 0xc3, 0x48, 0x7e, 0x6e, 0x6b, 0x3a, 0x28, 0x54, 0xfa, 0x85, 0xba, 0x3d,
+	0xca, 0x5e, 0x9b, 0x9f, 0x0a, 0x15, 0x79, 0x2b, 0x4e, 0xd4, 0xe5, 0xac, 0x73, 0xf3, 0xa7, 0x57,
+	0x07, 0x70, 0xc0, 0xf7, 0x8c, 0x80, 0x63, 0x0d, 0x67, 0x4a, 0xde, 0xed, 0x31, 0xc5, 0xfe, 0x18,
+	0xe3, 0xa5, 0x99, 0x77, 0x26, 0xb8, 0xb4, 0x7c, 0x11, 0x44, 0x92, 0xd9, 0x23, 0x20, 0x89, 0x2e,
+	0x37, 0x3f, 0xd1, 0x5b, 0x95, 0xbc, 0xcf, 0xcd, 0x90, 0x87, 0x97, 0xb2, 0xdc, 0xfc, 0xbe, 0x61,
+	0xf2, 0x56, 0xd3, 0xab, 0x14, 0x2a, 0x5d, 0x9e, 0x84, 0x3c, 0x39, 0x53, 0x47, 0x6d, 0x41, 0xa2,
+	0x1f, 0x2d, 0x43, 0xd8, 0xb7, 0x7b, 0xa4, 0x76, 0xc4, 0x17, 0x49, 0xec, 0x7f, 0x0c, 0x6f, 0xf6,
+	0x6c, 0xa1, 0x3b, 0x52, 0x29, 0x9d, 0x55, 0xaa, 0xfb, 0x60, 0x86, 0xb1, 0xbb, 0xcc, 0x3e, 0x5a,
+	0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51, 0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
+	0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8, 0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf,
+};
+
+static inline unsigned char ikcp_gf_mul(unsigned char a, unsigned char b)
+{
+	if (a == 0 || b == 0)
+		return 0;
+	return ikcp_gf_exp[ikcp_gf_log[a] + ikcp_gf_log[b]];
+}
+
+static inline unsigned char ikcp_gf_inv(unsigned char a)
+{
+	return ikcp_gf_exp[255 - ikcp_gf_log[a]];
+}
+
+// 编码矩阵系数: 校验行 i, 数据列 j, Cauchy 矩阵 1 / (x_i + y_j),
+// 任意方阵子式可逆, 分组提前结束(k < datashards)时同样可以解码
+static inline unsigned char ikcp_fec_coef(const struct IKCPFEC *fec, int i, int j)
+{
+	if (fec->mode == IKCP_FEC_XOR)
+		return 1;
+	return ikcp_gf_inv((unsigned char)((255 - i) ^ j));
+}
+
+// SIMD 内核: 按高低 4 位拆表, 用 pshufb 一次查 16/32 个字节, 返回处理完的字节数
+#if defined(IKCP_GF_SIMD)
+IKCP_GF_TARGET("ssse3")
+static int ikcp_gf_kernel_ssse3(unsigned char *dst, const unsigned char *src,
+	const unsigned char *lo, const unsigned char *hi, int len)
+{
+	__m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+	__m128i thi = _mm_loadu_si128((const __m128i *)hi);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	int i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask));
+		__m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+		d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+		_mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+	return i;
+}
+#endif
+
+#if defined(IKCP_GF_DISPATCH) || defined(__AVX2__)
+IKCP_GF_TARGET("avx2")
+static int ikcp_gf_kernel_avx2(unsigned char *dst, const unsigned char *src,
+	const unsigned char *lo, const unsigned char *hi, int len)
+{
+	__m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+	__m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+	__m256i mask = _mm256_set1_epi8(0x0f);
+	int i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask));
+		__m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+		d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+		_mm256_storeu_si256((__m256i *)(dst + i), d);
+	}
+	return i;
+}
+#endif
+
+// 选出本机可用的最快内核, 没有时返回 NULL 走查表
+static ikcp_gf_kernel ikcp_gf_select(void)
+{
+#if defined(IKCP_GF_DISPATCH)
+	if (__builtin_cpu_supports("avx2"))
+		return ikcp_gf_kernel_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return ikcp_gf_kernel_ssse3;
+	return NULL;
+#elif defined(__AVX2__)
+	return ikcp_gf_kernel_avx2;
+#elif defined(IKCP_GF_SIMD)
+	return ikcp_gf_kernel_ssse3;
+#else
+	return NULL;
+#endif
+}
+
+// dst ^= c * src
+static void ikcp_gf_muladd(ikcp_gf_kernel kernel, unsigned char *dst,
+	const unsigned char *src, unsigned char c, int len)
+{
+	int i = 0;
+	if (c == 0)
+		return;
+	if (c == 1) {
+		for (; i + 8 <= len; i += 8) {
+			IUINT64 a, b;
+			memcpy(&a, dst + i, 8);
+			memcpy(&b, src + i, 8);
+			a ^= b;
+			memcpy(dst + i, &a, 8);
+		}
+	}	else if (kernel != NULL && len >= 16) {
+		unsigned char lo[16], hi[16];
+		int n;
+		for (n = 0; n < 16; n++) {
+			lo[n] = ikcp_gf_mul(c, (unsigned char)n);
+			hi[n] = ikcp_gf_mul(c, (unsigned char)(n << 4));
+		}
+		i = kernel(dst, src, lo, hi, len);
+	}
+	if (len - i >= 64) {
+		unsigned char row[256];
+		int n;
+		for (n = 0; n < 256; n++)
+			row[n] = ikcp_gf_mul(c, (unsigned char)n);
+		for (; i < len; i++)
+			dst[i] ^= row[src[i]];
+	}
+	for (; i < len; i++) {
+		dst[i] ^= ikcp_gf_mul(c, src[i]);
+	}
+}
+
+static void ikcp_fec_free(struct IKCPFEC *fec)
+{
+	int i;
+	if (fec == NULL)
+		return;
+	for (i = 0; i < IKCP_FEC_GROUPS; i++) {
+		if (fec->groups[i].shards)
+			ikcp_free(fec->groups[i].shards);
+		if (fec->groups[i].present)
+			ikcp_free(fec->groups[i].present);
+	}
+	if (fec->parity)
+		ikcp_free(fec->parity);
+	if (fec->packet)
+		ikcp_free(fec->packet);
+	ikcp_free(fec);
+}
+
+static struct IKCPFEC *ikcp_fec_new(int mode, int datashards, int parityshards, int mtu)
+{
+	struct IKCPFEC *fec;
+	int i, total = datashards + parityshards;
+	fec = (struct IKCPFEC *)ikcp_malloc(sizeof(struct IKCPFEC));
+	if (fec == NULL)
+		return NULL;
+	memset(fec, 0, sizeof(struct IKCPFEC));
+	fec->mode = mode;
+	fec->kernel = ikcp_gf_select();
+	fec->datashards = datashards;
+	fec->parityshards = parityshards;
+	fec->shardsize = mtu - (int)IKCP_FEC_OVERHEAD + 2;
+	fec->parity = (unsigned char *)ikcp_malloc(parityshards * fec->shardsize);
+	fec->packet = (char *)ikcp_malloc(mtu);
+	if (fec->parity == NULL || fec->packet == NULL) {
+		ikcp_fec_free(fec);
+		return NULL;
+	}
+	memset(fec->parity, 0, parityshards * fec->shardsize);
+	for (i = 0; i < IKCP_FEC_GROUPS; i++) {
+		struct IKCPFEC_GROUP *g = &fec->groups[i];
+		g->shards = (unsigned char *)ikcp_malloc(total * fec->shardsize);
+		g->present = (unsigned char *)ikcp_malloc(total);
+		if (g->shards == NULL || g->present == NULL) {
+			ikcp_fec_free(fec);
+			return NULL;
+		}
+	}
+	return fec;
+}
+
+// 写 FEC 头并输出一个分片, 'shard' 为 size(2) + 数据
+static int ikcp_fec_emit(ikcpcb *kcp, int index, int k, const void *shard, int length)
+{
+	struct IKCPFEC *fec = kcp->fec;
+	char *ptr = fec->packet;
+	ptr = ikcp_encode32u(ptr, kcp->conv);
+	ptr = ikcp_encode8u(ptr, (unsigned char)IKCP_CMD_FEC);
+	ptr = ikcp_encode8u(ptr, (unsigned char)index);
+	ptr = ikcp_encode8u(ptr, (unsigned char)k);
+	ptr = ikcp_encode8u(ptr, (unsigned char)fec->parityshards);
+	ptr = ikcp_encode32u(ptr, fec->snd_group);
+	// 数据分片已经就地写在 packet 中
+	if (ptr != (const char *)shard) {
+		memcpy(ptr, shard, length);
+	}
+	kcp->stats.out_pkts++;
+	return kcp->output(fec->packet, (int)IKCP_FEC_OVERHEAD - 2 + length, kcp, kcp->user);
+}
+
+// 结束当前分组: 输出全部校验包
+static void ikcp_fec_close_group(ikcpcb *kcp)
+{
+	struct IKCPFEC *fec = kcp->fec;
+	int i;
+	if (fec->snd_index == 0)
+		return;
+	for (i = 0; i < fec->parityshards; i++) {
+		unsigned char *parity = fec->parity + i * fec->shardsize;
+		ikcp_fec_emit(kcp, fec->datashards + i, fec->snd_index, parity, fec->snd_length);
+	}
+	memset(fec->parity, 0, fec->parityshards * fec->shardsize);
+	fec->snd_group++;
+	fec->snd_index = 0;
+	fec->snd_length = 0;
+}
+
+// 输出一个数据包, 同时把它累加进校验分片
+static int ikcp_fec_output(ikcpcb *kcp, const char *data, int size)
+{
+	struct IKCPFEC *fec = kcp->fec;
+	unsigned char *shard = (unsigned char *)fec->packet + IKCP_FEC_OVERHEAD - 2;
+	int i, hr, length = size + 2;
+	if (fec->snd_index == 0)
+		fec->snd_ts = kcp->current;
+	ikcp_encode16u((char *)shard, (unsigned short)size);
+	memcpy(shard + 2, data, size);
+	for (i = 0; i < fec->parityshards; i++) {
+		unsigned char *parity = fec->parity + i * fec->shardsize;
+		ikcp_gf_muladd(fec->kernel, parity, shard, ikcp_fec_coef(fec, i, fec->snd_index), length);
+	}
+	if (length > fec->snd_length)
+		fec->snd_length = length;
+	hr = ikcp_fec_emit(kcp, fec->snd_index, fec->datashards, shard, length);
+	if (++fec->snd_index >= fec->datashards)
+		ikcp_fec_close_group(kcp);
+	return hr;
+}
+
+// 求解 GF(2^8) 上的 n 阶方阵的逆, 原地进行, 失败返回 -1
+static int ikcp_gf_invert(unsigned char *m, unsigned char *inv, int n)
+{
+	int i, j, r;
+	memset(inv, 0, n * n);
+	for (i = 0; i < n; i++)
+		inv[i * n + i] = 1;
+	for (i = 0; i < n; i++) {
+		unsigned char pivot;
+		for (r = i; r < n && m[r * n + i] == 0; r++)
+			;
+		if (r == n)
+			return -1;
+		if (r != i) {
+			for (j = 0; j < n; j++) {
+				unsigned char t = m[i * n + j];
+				m[i * n + j] = m[r * n + j];
+				m[r * n + j] = t;
+				t = inv[i * n + j];
+				inv[i * n + j] = inv[r * n + j];
+				inv[r * n + j] = t;
+			}
+		}
+		pivot = ikcp_gf_inv(m[i * n + i]);
+		for (j = 0; j < n; j++) {
+			m[i * n + j] = ikcp_gf_mul(m[i * n + j], pivot);
+			inv[i * n + j] = ikcp_gf_mul(inv[i * n + j], pivot);
+		}
+		for (r = 0; r < n; r++) {
+			unsigned char f = m[r * n + i];
+			if (r == i || f == 0)
+				continue;
+			for (j = 0; j < n; j++) {
+				m[r * n + j] ^= ikcp_gf_mul(f, m[i * n + j]);
+				inv[r * n + j] ^= ikcp_gf_mul(f, inv[i * n + j]);
+			}
+		}
+	}
+	return 0;
+}
+
+static int ikcp_input_segs(ikcpcb *kcp, const char *data, long size);
+
+// 尝试恢复分组中丢失的数据包并送入 ikcp_input
+static void ikcp_fec_recover(ikcpcb *kcp, struct IKCPFEC_GROUP *g)
+{
+	struct IKCPFEC *fec = kcp->fec;
+	unsigned char matrix[IKCP_FEC_MAX * IKCP_FEC_MAX];
+	unsigned char inverse[IKCP_FEC_MAX * IKCP_FEC_MAX];
+	int missing[IKCP_FEC_MAX], rows[IKCP_FEC_MAX];
+	int nmissing = 0, nrows = 0;
+	int i, j, size = fec->shardsize;
+
+	if (g->done || g->k == 0)
+		return;
+	if (g->ndata >= g->k) {
+		g->done = 1;
+		return;
+	}
+	if (g->ndata + g->nparity < g->k)
+		return;
+
+	// 无论能否解出, 校验分片都会在下面被改写, 分组不再参与恢复
+	g->done = 1;
+
+	for (j = 0; j < g->k; j++) {
+		if (!g->present[j])
+			missing[nmissing++] = j;
+	}
+	for (i = 0; i < fec->parityshards && nrows < nmissing; i++) {
+		if (g->present[fec->datashards + i])
+			rows[nrows++] = i;
+	}
+
+	// 从选中的校验分片中消去已收到的数据分片
+	for (i = 0; i < nrows; i++) {
+		unsigned char *parity = g->shards + (fec->datashards + rows[i]) * size;
+		for (j = 0; j < g->k; j++) {
+			if (g->present[j])
+				ikcp_gf_muladd(fec->kernel, parity, g->shards + j * size, ikcp_fec_coef(fec, rows[i], j), g->length);
+		}
+		for (j = 0; j < nmissing; j++) {
+			matrix[i * nmissing + j] = ikcp_fec_coef(fec, rows[i], missing[j]);
+		}
+	}
+	if (ikcp_gf_invert(matrix, inverse, nmissing) != 0)
+		return;
+
+	for (j = 0; j < nmissing; j++) {
+		unsigned char *shard = g->shards + missing[j] * size;
+		unsigned short length;
+		memset(shard, 0, g->length);
+		for (i = 0; i < nrows; i++) {
+			unsigned char *parity = g->shards + (fec->datashards + rows[i]) * size;
+			ikcp_gf_muladd(fec->kernel, shard, parity, inverse[j * nmissing + i], g->length);
+		}
+		g->present[missing[j]] = 1;
+		ikcp_decode16u((const char *)shard, &length);
+		if ((int)length + 2 <= g->length) {
+			ikcp_input_segs(kcp, (const char *)shard + 2, length);
+		}
+	}
+}
+
+// 解析 FEC 头, 数据包立即送入 ikcp_input, 校验包用于恢复
+static int ikcp_fec_input(ikcpcb *kcp, const char *data, long size)
+{
+	struct IKCPFEC *fec = kcp->fec;
+	struct IKCPFEC_GROUP *g;
+	const char *ptr = data;
+	IUINT32 conv, group;
+	unsigned char cmd, index, k, m;
+	unsigned short length;
+	int hr = 0, isdata;
+
+	if (size < (long)IKCP_FEC_OVERHEAD)
+		return -1;
+	ptr = ikcp_decode32u(ptr, &conv);
+	ptr = ikcp_decode8u(ptr, &cmd);
+	if (conv != kcp->conv)
+		return -1;
+	if (cmd != IKCP_CMD_FEC)
+		return ikcp_input_segs(kcp, data, size);
+	ptr = ikcp_decode8u(ptr, &index);
+	ptr = ikcp_decode8u(ptr, &k);
+	ptr = ikcp_decode8u(ptr, &m);
+	ptr = ikcp_decode32u(ptr, &group);
+	ikcp_decode16u(ptr, &length);
+	size -= IKCP_FEC_OVERHEAD - 2;
+
+	if (index >= fec->datashards + fec->parityshards || size > fec->shardsize ||
+		m != fec->parityshards)
+		return -3;
+	isdata = (index < fec->datashards) ? 1 : 0;
+	if (isdata && (long)length + 2 > size)
+		return -2;
+	if (!isdata && (k == 0 || k > fec->datashards))
+		return -3;
+
+	g = &fec->groups[group % IKCP_FEC_GROUPS];
+	if (g->used == 0 || _itimediff(group, g->group) > 0) {
+		g->group = group;
+		g->used = 1;
+		g->done = 0;
+		g->k = 0;
+		g->ndata = 0;
+		g->nparity = 0;
+		g->length = 0;
+		memset(g->present, 0, fec->datashards + fec->parityshards);
+	} else if (g->group != group) {
+		// 过期分组, 只把数据包交给 kcp
+		return isdata ? ikcp_input_segs(kcp, ptr + 2, length) : 0;
+	}
+
+	if (g->present[index])
+		return 0;
+
+	if (isdata) {
+		hr = ikcp_input_segs(kcp, ptr + 2, length);
+		if (g->done)
+			return hr;
+		g->ndata++;
+	} else {
+		if (g->done)
+			return 0;
+		g->k = k;
+		g->nparity++;
+		if ((int)size > g->length)
+			g->length = (int)size;
+	}
+
+	g->present[index] = 1;
+	memcpy(g->shards + index * fec->shardsize, ptr, size);
+	if (size < fec->shardsize)
+		memset(g->shards + index * fec->shardsize + size, 0, fec->shardsize - size);
+
+	ikcp_fec_recover(kcp, g);
+	return hr;
 }
 
+
 // output segment
 static int ikcp_output(ikcpcb *kcp, const void *data, int size)
 {
 	assert(kcp);
 	assert(kcp->output);
 	if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
+		ikcp_trace_push(kcp, IKCP_LOG_OUTPUT, size, 0, 0);
 		ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
 	}
 	if (size == 0)
 		return 0;
+	if (kcp->fec)
+		return ikcp_fec_output(kcp, (const char *)data, size);
+	kcp->stats.out_pkts++;
 	return kcp->output((const char *)data, size, kcp, kcp->user);
 }
 
@@ -260,11 +934,156 @@ void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
 }
 
 
+//---------------------------------------------------------------------
+// priority classes
+//---------------------------------------------------------------------
+static inline struct IQUEUEHEAD *ikcp_snd_queue(ikcpcb *kcp, int prio)
+{
+	return (prio == IKCP_PRIO_DEFAULT) ? &kcp->snd_queue : &kcp->snd_prio[prio];
+}
+
+// append a new segment to the send queue of class 'prio'
+static inline void ikcp_snd_push(ikcpcb *kcp, int prio, IKCPSEG *seg)
+{
+	seg->cmd = IKCP_CMD_PUSH;
+	seg->prio = (IUINT32)prio;
+	seg->xmit = 0;
+	seg->ttl = 0;
+	seg->maxxmit = 0;
+	iqueue_add_tail(&seg->node, ikcp_snd_queue(kcp, prio));
+	kcp->nsnd_que++;
+	kcp->nsnd_prio[prio]++;
+}
+
+
+//---------------------------------------------------------------------
+// multiple streams
+// 流 0 即原有的 ikcp_send/ikcp_recv. 附加流的数据段 frg 为 IKCP_FRG_STREAM,
+// 数据前附加 sid(1) frg(1) sseq(4), 与流 0 共享 sn 和拥塞窗口. 接收端在
+// 数据段进入 rcv_buf 时就把数据交给所属的流按 sseq 独立排序和重组,
+// rcv_buf 中只留下一个零长度的占位段, 用来去重和推进 rcv_nxt.
+//---------------------------------------------------------------------
+struct IKCPSTREAM {
+	IUINT32 snd_nxt; // 下一个发送的流内序号
+	IUINT32 rcv_nxt; // 下一个交付到 rcv_queue 的流内序号
+	IUINT32 nrcv_buf; // rcv_buf 的长度
+	IUINT32 nrcv_que; // rcv_queue 的长度
+	struct IQUEUEHEAD rcv_buf; // 乱序到达的段, 按流内序号排序
+	struct IQUEUEHEAD rcv_queue; // 可以读取的段
+};
+
+static void ikcp_stream_free(ikcpcb *kcp, struct IKCPSTREAM *st)
+{
+	IKCPSEG *seg;
+	while (!iqueue_is_empty(&st->rcv_buf)) {
+		seg = iqueue_entry(st->rcv_buf.next, IKCPSEG, node);
+		iqueue_del(&seg->node);
+		ikcp_rcv_delete(kcp, seg);
+	}
+	while (!iqueue_is_empty(&st->rcv_queue)) {
+		seg = iqueue_entry(st->rcv_queue.next, IKCPSEG, node);
+		iqueue_del(&seg->node);
+		ikcp_rcv_delete(kcp, seg);
+	}
+	kcp->nrcv_stream -= st->nrcv_buf + st->nrcv_que;
+	ikcp_free(st);
+}
+
+static struct IKCPSTREAM *ikcp_stream_get(ikcpcb *kcp, int sid)
+{
+	struct IKCPSTREAM *st;
+	if (sid < 1 || sid > (int)kcp->nstreams)
+		return NULL;
+	st = kcp->streams[sid];
+	if (st == NULL) {
+		st = (struct IKCPSTREAM *)ikcp_malloc(sizeof(struct IKCPSTREAM));
+		if (st == NULL)
+			return NULL;
+		st->snd_nxt = 0;
+		st->rcv_nxt = 0;
+		st->nrcv_buf = 0;
+		st->nrcv_que = 0;
+		iqueue_init(&st->rcv_buf);
+		iqueue_init(&st->rcv_queue);
+		kcp->streams[sid] = st;
+	}
+	return st;
+}
+
+// hand an accepted IKCP_FRG_STREAM segment over to its stream, returns
+// below zero (and leaves the segment to the caller) if there is no such
+// stream or it can not be allocated
+static int ikcp_stream_input(ikcpcb *kcp, IKCPSEG *newseg)
+{
+	struct IQUEUEHEAD *p, *prev;
+	struct IKCPSTREAM *st = NULL;
+	IUINT8 sid = 0, frg = 0;
+	IUINT32 sseq = 0;
+	const char *ptr = newseg->data;
+	int repeat = 0;
+
+	if (newseg->len >= IKCP_STREAM_OVERHEAD) {
+		ptr = ikcp_decode8u(ptr, &sid);
+		ptr = ikcp_decode8u(ptr, &frg);
+		ptr = ikcp_decode32u(ptr, &sseq);
+		st = ikcp_stream_get(kcp, sid);
+	}
+
+	if (st == NULL)
+		return -1;
+
+	if (_itimediff(sseq, st->rcv_nxt) < 0) {
+		ikcp_segment_delete(kcp, newseg);
+		return 0;
+	}
+
+	newseg->len -= IKCP_STREAM_OVERHEAD;
+	memmove(newseg->data, ptr, newseg->len);
+	newseg->frg = frg;
+	newseg->sn = sseq;
+
+	for (p = st->rcv_buf.prev; p != &st->rcv_buf; p = prev) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		prev = p->prev;
+		if (seg->sn == sseq) {
+			repeat = 1;
+			break;
+		}
+		if (_itimediff(sseq, seg->sn) > 0) {
+			break;
+		}
+	}
+
+	if (repeat) {
+		ikcp_segment_delete(kcp, newseg);
+		return 0;
+	}
+
+	iqueue_add(&newseg->node, p);
+	ikcp_rcv_hold(kcp, newseg);
+	st->nrcv_buf++;
+	kcp->nrcv_stream++;
+
+	while (!iqueue_is_empty(&st->rcv_buf)) {
+		IKCPSEG *seg = iqueue_entry(st->rcv_buf.next, IKCPSEG, node);
+		if (seg->sn != st->rcv_nxt)
+			break;
+		iqueue_del(&seg->node);
+		st->nrcv_buf--;
+		iqueue_add_tail(&seg->node, &st->rcv_queue);
+		st->nrcv_que++;
+		st->rcv_nxt++;
+	}
+	return 0;
+}
+
+
 //---------------------------------------------------------------------
 // create a new kcpcb
 //---------------------------------------------------------------------
 ikcpcb *ikcp_create(IUINT32 conv, void *user)
 {
+	int i;
 	ikcpcb *kcp = (ikcpcb *)ikcp_malloc(sizeof(struct IKCPCB));
 	if (kcp == NULL)
 		return NULL;
@@ -284,8 +1103,27 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user)
 	kcp->incr = 0;
 	kcp->probe = 0;
 	kcp->mtu = IKCP_MTU_DEF;
+	kcp->reserved = 0;
 	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
 	kcp->stream = 0;
+	kcp->maxmsg = 0;
+	kcp->rcv_msg = NULL;
+	kcp->rcv_msglen = 0;
+	kcp->rcv_msgcap = 0;
+	kcp->rmt_maxmsg = 0;
+	kcp->opt_state = 0;
+	kcp->opt_tries = 0;
+	kcp->ts_opt = 0;
+	kcp->coalesce = 0;
+	kcp->cork = 0;
+	kcp->cork_delay = 0;
+	kcp->rcv_offset = 0;
+	kcp->rcv_skip = 0;
+	kcp->npartial = 0;
+	kcp->streams = NULL;
+	kcp->nstreams = 0;
+	kcp->rmt_nstreams = 0;
+	kcp->nrcv_stream = 0;
 
 	kcp->buffer = (char *)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
 	if (kcp->buffer == NULL) {
@@ -294,6 +1132,14 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user)
 	}
 
 	iqueue_init(&kcp->snd_queue);
+	for (i = 0; i < IKCP_PRIO_COUNT; i++) {
+		iqueue_init(&kcp->snd_prio[i]);
+		kcp->nsnd_prio[i] = 0;
+		kcp->snd_weight[i] = 0;
+	}
+	kcp->snd_rr = 0;
+	kcp->snd_credit = 0;
+	kcp->snd_lock = 0;
 	iqueue_init(&kcp->rcv_queue);
 	iqueue_init(&kcp->snd_buf);
 	iqueue_init(&kcp->rcv_buf);
@@ -310,6 +1156,7 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user)
 	kcp->rx_rto = IKCP_RTO_DEF;
 	kcp->rx_minrto = IKCP_RTO_MIN;
 	kcp->current = 0;
+	kcp->tick = IKCP_TIME_MS;
 	kcp->interval = IKCP_INTERVAL;
 	kcp->ts_flush = IKCP_INTERVAL;
 	kcp->nodelay = 0;
@@ -318,11 +1165,65 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user)
 	kcp->ssthresh = IKCP_THRESH_INIT;
 	kcp->fastresend = 0;
 	kcp->fastlimit = IKCP_FASTACK_LIMIT;
+	kcp->recovery = 0;
+	kcp->rack_ts = 0;
+	kcp->rack_sn = 0;
+	kcp->rack_rtt = 0;
+	kcp->tlp_out = 0;
+	kcp->undo_cwnd = 0;
+	kcp->undo_ssthresh = 0;
+	kcp->undo_incr = 0;
+	kcp->undo_sn = 0;
+	kcp->undo_valid = 0;
+	kcp->rtomode = 0;
+	kcp->rto_pct = 95;
+	kcp->minrtt = 0;
+	kcp->ts_minrtt = 0;
+	kcp->rtt_recent = NULL;
+	kcp->rtt_count = 0;
+	kcp->ack_nodelay = 0;
+	kcp->flushing = 0;
+	kcp->wscale = 0;
+	kcp->rmt_wscale = 0;
+	kcp->rcv_bytes = 0;
+	kcp->rcv_held = 0;
+	kcp->tune_max = 0;
+	kcp->tune_snd_min = 0;
+	kcp->tune_rcv_min = 0;
+	kcp->ts_tune = 0;
+	kcp->tune_una = 0;
+	kcp->tune_rcv = 0;
+	kcp->tune_limited = 0;
+	kcp->ts_active = 0;
+	kcp->tune_bytes = 0;
+	kcp->pmtu_state = 0;
+	kcp->pmtu_base = 0;
+	kcp->pmtu_max = 0;
+	kcp->pmtu_lo = 0;
+	kcp->pmtu_hi = 0;
+	kcp->pmtu_probe = 0;
+	kcp->pmtu_fails = 0;
+	kcp->ts_pmtu = 0;
+	kcp->pmtu_echo = 0;
+	kcp->pmtu_echo_ts = 0;
+	iqueue_init(&kcp->rcv_part);
+	kcp->nrcv_part = 0;
+	kcp->close_state = 0;
+	kcp->close_full = 0;
+	kcp->close_linger = 0;
+	kcp->fin_sn = 0;
+	kcp->ts_close = 0;
 	kcp->nocwnd = 0;
 	kcp->xmit = 0;
 	kcp->dead_link = IKCP_DEADLINK;
 	kcp->output = NULL;
 	kcp->writelog = NULL;
+	kcp->fec = NULL;
+	kcp->trace = NULL;
+	kcp->trace_mask = 0;
+	kcp->trace_wpos = 0;
+	kcp->trace_rpos = 0;
+	memset(&kcp->stats, 0, sizeof(kcp->stats));
 
 	return kcp;
 }
@@ -333,6 +1234,7 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user)
 //---------------------------------------------------------------------
 void ikcp_release(ikcpcb *kcp)
 {
+	int i;
 	assert(kcp);
 	if (kcp) {
 		IKCPSEG *seg;
@@ -346,10 +1248,13 @@ void ikcp_release(ikcpcb *kcp)
 			iqueue_del(&seg->node);
 			ikcp_segment_delete(kcp, seg);
 		}
-		while (!iqueue_is_empty(&kcp->snd_queue)) {
-			seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
+		for (i = 0; i < IKCP_PRIO_COUNT; i++) {
+			struct IQUEUEHEAD *queue = ikcp_snd_queue(kcp, i);
+			while (!iqueue_is_empty(queue)) {
+				seg = iqueue_entry(queue->next, IKCPSEG, node);
+				iqueue_del(&seg->node);
+				ikcp_segment_delete(kcp, seg);
+			}
 		}
 		while (!iqueue_is_empty(&kcp->rcv_queue)) {
 			seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
@@ -362,6 +1267,26 @@ void ikcp_release(ikcpcb *kcp)
 		if (kcp->acklist) {
 			ikcp_free(kcp->acklist);
 		}
+		if (kcp->trace) {
+			ikcp_free(kcp->trace);
+		}
+		if (kcp->fec) {
+			ikcp_fec_free(kcp->fec);
+		}
+		if (kcp->rcv_msg) {
+			ikcp_segment_delete(kcp, kcp->rcv_msg);
+		}
+		if (kcp->rtt_recent) {
+			ikcp_free(kcp->rtt_recent);
+		}
+		ikcp_streams(kcp, 0);
+		ikcp_tune_charge(kcp, 0);
+		while (!iqueue_is_empty(&kcp->rcv_part)) {
+			struct IKCPPART *part = iqueue_entry(kcp->rcv_part.next,
+				struct IKCPPART, node);
+			iqueue_del(&part->node);
+			ikcp_free(part);
+		}
 
 		kcp->nrcv_buf = 0;
 		kcp->nsnd_buf = 0;
@@ -385,25 +1310,256 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
 }
 
 
-//---------------------------------------------------------------------
-// user/upper level recv: returns size, returns below zero for EAGAIN
-//---------------------------------------------------------------------
-int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
+// drop the large message being reassembled
+static void ikcp_drop_msg(ikcpcb *kcp)
 {
-	struct IQUEUEHEAD *p;
-	int ispeek = (len < 0) ? 1 : 0;
-	int peeksize;
-	int recover = 0;
-	IKCPSEG *seg;
-	assert(kcp);
+	kcp->rcv_held -= sizeof(IKCPSEG) + kcp->rcv_msgcap;
+	ikcp_segment_delete(kcp, kcp->rcv_msg);
+	kcp->rcv_msg = NULL;
+}
 
-	if (iqueue_is_empty(&kcp->rcv_queue))
+// make room for 'need' bytes in kcp->rcv_msg, at most the total length
+static int ikcp_grow_msg(ikcpcb *kcp, IUINT32 need)
+{
+	IKCPSEG *msg = kcp->rcv_msg;
+	IKCPSEG *seg;
+	IUINT32 cap;
+	if (need <= kcp->rcv_msgcap)
+		return 0;
+	// 按倍数增长, 复制的总量和消息长度成正比
+	cap = _imin_(_imax_(need, kcp->rcv_msgcap * 2), kcp->rcv_msglen);
+	seg = ikcp_segment_new(kcp, cap);
+	if (seg == NULL)
 		return -1;
+	*seg = *msg;
+	memcpy(seg->data, msg->data, msg->len);
+	kcp->rcv_held += cap - kcp->rcv_msgcap;
+	kcp->rcv_msgcap = cap;
+	ikcp_segment_delete(kcp, msg);
+	kcp->rcv_msg = seg;
+	return 0;
+}
 
-	if (len < 0)
-		len = -len;
+//---------------------------------------------------------------------
+// append an in-order large message segment to kcp->rcv_msg, the
+// segment itself is always consumed
+//---------------------------------------------------------------------
+static void ikcp_merge_msg(ikcpcb *kcp, IKCPSEG *seg)
+{
+	const char *data = seg->data;
+	IUINT32 len = seg->len;
+
+	if (seg->frg == IKCP_FRG_MSGHEAD) {
+		IUINT32 total = 0;
+		if (kcp->rcv_msg) {
+			// 上一条消息没有收完就出现了新的首段, 丢弃旧的
+			ikcp_drop_msg(kcp);
+		}
+		if (len >= 4) {
+			data = ikcp_decode32u(data, &total);
+			len -= 4;
+		}
+		// 缓冲区随数据到达增长, 不按首段声明的总长度预先分配
+		if (total > 0 && total <= kcp->maxmsg && len <= total) {
+			kcp->rcv_msg = ikcp_segment_new(kcp, len);
+		}
+		if (kcp->rcv_msg) {
+			*kcp->rcv_msg = *seg;
+			kcp->rcv_msg->frg = 0;
+			kcp->rcv_msg->len = 0;
+			kcp->rcv_msgcap = len;
+			kcp->rcv_msglen = total;
+			kcp->rcv_held += sizeof(IKCPSEG) + len;
+		}
+	}
+
+	if (kcp->rcv_msg) {
+		IKCPSEG *msg = kcp->rcv_msg;
+		if (msg->len + len > kcp->rcv_msglen ||
+			ikcp_grow_msg(kcp, msg->len + len) != 0) {
+			ikcp_drop_msg(kcp);
+		}	else {
+			msg = kcp->rcv_msg;
+			memcpy(msg->data + msg->len, data, len);
+			msg->len += len;
+			if (msg->len == kcp->rcv_msglen) {
+				iqueue_add_tail(&msg->node, &kcp->rcv_queue);
+				kcp->nrcv_que++;
+				kcp->rcv_msg = NULL;
+			}
+		}
+	}
+
+	ikcp_rcv_delete(kcp, seg);
+}
+
+
+//---------------------------------------------------------------------
+// validate the framing of a coalesced segment once, before it reaches
+// rcv_queue, so ikcp_peeksize/ikcp_recv can trust it
+//---------------------------------------------------------------------
+static int ikcp_check_coalesced(const IKCPSEG *seg)
+{
+	const char *ptr = seg->data;
+	const char *end = seg->data + seg->len;
+	if (seg->len == 0)
+		return -1;
+	while (ptr < end) {
+		IUINT32 len;
+		ptr = ikcp_decode_varint(ptr, end, &len);
+		if (ptr == NULL || len > (IUINT32)(end - ptr))
+			return -1;
+		ptr += len;
+	}
+	return 0;
+}
+
+
+//---------------------------------------------------------------------
+// the peer's FIN arrived (again). if ours went out before, the ack of the
+// peer's FIN is only in the ack list, linger to repeat it for resent FINs;
+// otherwise the una of our FIN covers it.
+//---------------------------------------------------------------------
+static void ikcp_close_peer(ikcpcb *kcp)
+{
+	kcp->close_state |= IKCP_CLOSE_PEER;
+	if ((kcp->close_state & IKCP_CLOSE_FIN) &&
+		!(kcp->close_state & IKCP_CLOSE_DONE)) {
+		kcp->ts_close = kcp->current + kcp->close_linger;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// drop the fragments of an unfinished message at the tail of rcv_queue
+//---------------------------------------------------------------------
+static void ikcp_drop_partial(ikcpcb *kcp)
+{
+	while (!iqueue_is_empty(&kcp->rcv_queue)) {
+		IKCPSEG *seg = iqueue_entry(kcp->rcv_queue.prev, IKCPSEG, node);
+		if (seg->frg == 0 || seg->frg >= IKCP_FRG_STREAM)
+			break;
+		iqueue_del(&seg->node);
+		ikcp_rcv_delete(kcp, seg);
+		kcp->nrcv_que--;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// move available data from rcv_buf -> rcv_queue
+//---------------------------------------------------------------------
+static void ikcp_move_rcv(ikcpcb *kcp)
+{
+	while (!iqueue_is_empty(&kcp->rcv_buf)) {
+		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
+		if (seg->sn == kcp->rcv_nxt && seg->frg == IKCP_FRG_STREAM) {
+			// 附加流的占位段, 数据已经交给所属的流
+			iqueue_del(&seg->node);
+			kcp->nrcv_buf--;
+			kcp->rcv_nxt++;
+			ikcp_rcv_delete(kcp, seg);
+			continue;
+		}
+		if (seg->sn == kcp->rcv_nxt && seg->cmd == IKCP_CMD_PUSH &&
+			seg->frg == IKCP_FRG_FIN) {
+			// 对端的 FIN, 之前的数据都已经交付, 之后不会再有数据
+			iqueue_del(&seg->node);
+			kcp->nrcv_buf--;
+			kcp->rcv_nxt++;
+			ikcp_close_peer(kcp);
+			ikcp_rcv_delete(kcp, seg);
+			continue;
+		}
+		if (seg->sn == kcp->rcv_nxt &&
+			(seg->cmd == IKCP_CMD_SKIP || kcp->rcv_skip > 0)) {
+			// 对端放弃的消息: 丢弃已经收到的分片, 后续还有 frg 个分片
+			iqueue_del(&seg->node);
+			kcp->nrcv_buf--;
+			kcp->rcv_nxt++;
+			if (kcp->rcv_skip == 0) {
+				ikcp_drop_partial(kcp);
+			}
+			kcp->rcv_skip = (seg->frg < IKCP_FRG_STREAM) ? seg->frg : 0;
+			kcp->stats.in_skips++;
+			ikcp_rcv_delete(kcp, seg);
+			continue;
+		}
+		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
+			iqueue_del(&seg->node);
+			kcp->nrcv_buf--;
+			kcp->rcv_nxt++;
+			if (seg->frg >= IKCP_FRG_MSGBODY) {
+				// 关闭大消息模式后仍在途的分段由 ikcp_merge_msg 丢弃
+				ikcp_merge_msg(kcp, seg);
+				continue;
+			}
+			if (seg->frg == IKCP_FRG_COALESCED && ikcp_check_coalesced(seg) != 0) {
+				ikcp_rcv_delete(kcp, seg);
+				continue;
+			}
+			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+			kcp->nrcv_que++;
+		} else {
+			break;
+		}
+	}
+}
 
-	peeksize = ikcp_peeksize(kcp);
+
+//---------------------------------------------------------------------
+// free receive window in segments, limited by rcv_bytes if set
+//---------------------------------------------------------------------
+static IUINT32 ikcp_wnd_unused(const ikcpcb *kcp)
+{
+	IUINT32 used = kcp->nrcv_que + kcp->nrcv_stream;
+	IUINT32 wnd = 0;
+	if (used < kcp->rcv_wnd) {
+		wnd = kcp->rcv_wnd - used;
+	}
+	if (kcp->rcv_bytes > 0 && wnd > 0) {
+		// 新到的段按满 mss 计, 已经收到的按实际大小计
+		IUINT32 room = 0;
+		if (kcp->rcv_held < kcp->rcv_bytes) {
+			room = (kcp->rcv_bytes - kcp->rcv_held) / (sizeof(IKCPSEG) + kcp->mss);
+		}
+		wnd = _imin_(wnd, room);
+	}
+	return wnd;
+}
+
+// the wnd field of the header: 16 bits, in units of 2^wscale segments
+// once the peer agreed to scaling. rounded down like TCP, a window below
+// one unit is advertised as 0 and left to the zero window probe
+static IUINT32 ikcp_wnd_adv(const ikcpcb *kcp)
+{
+	IUINT32 wnd = ikcp_wnd_unused(kcp);
+	if (kcp->opt_state & IKCP_OPT_KNOWN) {
+		wnd >>= kcp->wscale;
+	}
+	return _imin_(wnd, 0xffff);
+}
+
+
+//---------------------------------------------------------------------
+// user/upper level recv: returns size, returns below zero for EAGAIN
+//---------------------------------------------------------------------
+int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
+{
+	struct IQUEUEHEAD *p;
+	int ispeek = (len < 0) ? 1 : 0;
+	int peeksize;
+	int recover = 0;
+	IKCPSEG *seg;
+	assert(kcp);
+
+	if (iqueue_is_empty(&kcp->rcv_queue))
+		return (kcp->close_state & IKCP_CLOSE_PEER) ? -4 : -1;
+
+	if (len < 0)
+		len = -len;
+
+	peeksize = ikcp_peeksize(kcp);
 
 	if (peeksize < 0)
 		return -2;
@@ -411,55 +1567,81 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 	if (peeksize > len)
 		return -3;
 
-	if (kcp->nrcv_que >= kcp->rcv_wnd)
+	if (ikcp_wnd_adv(kcp) == 0)
 		recover = 1;
 
-	// merge fragment
-	for (len = 0, p = kcp->rcv_queue.next; p != &kcp->rcv_queue;) {
-		int fragment;
-		seg = iqueue_entry(p, IKCPSEG, node);
-		p = p->next;
+	seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
 
+	if (seg->frg == IKCP_FRG_COALESCED) {
+		// one message out of a coalesced segment
+		const char *ptr = seg->data + kcp->rcv_offset;
+		IUINT32 size = 0;
+		ptr = ikcp_decode_varint(ptr, seg->data + seg->len, &size);
+		if (ptr == NULL) {
+			// ikcp_check_coalesced 已经检查过, 不应该发生: 丢弃整个段
+			iqueue_del(&seg->node);
+			ikcp_rcv_delete(kcp, seg);
+			kcp->nrcv_que--;
+			kcp->rcv_offset = 0;
+			return -2;
+		}
 		if (buffer) {
-			memcpy(buffer, seg->data, seg->len);
-			buffer += seg->len;
+			memcpy(buffer, ptr, size);
 		}
-
-		len += seg->len;
-		fragment = seg->frg;
+		len = (int)size;
 
 		if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+			ikcp_trace_push(kcp, IKCP_LOG_RECV, seg->sn, size, seg->frg);
 			ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", (unsigned long)seg->sn);
 		}
 
 		if (ispeek == 0) {
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nrcv_que--;
+			kcp->rcv_offset = (IUINT32)(ptr + size - seg->data);
+			if (kcp->rcv_offset >= seg->len) {
+				iqueue_del(&seg->node);
+				ikcp_rcv_delete(kcp, seg);
+				kcp->nrcv_que--;
+				kcp->rcv_offset = 0;
+			}
 		}
+	}	else {
+		// merge fragment
+		for (len = 0, p = kcp->rcv_queue.next; p != &kcp->rcv_queue;) {
+			int fragment;
+			seg = iqueue_entry(p, IKCPSEG, node);
+			p = p->next;
+
+			if (buffer) {
+				memcpy(buffer, seg->data, seg->len);
+				buffer += seg->len;
+			}
 
-		if (fragment == 0)
-			break;
+			len += seg->len;
+			fragment = seg->frg;
+
+			if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+				ikcp_trace_push(kcp, IKCP_LOG_RECV, seg->sn, seg->len, seg->frg);
+				ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", (unsigned long)seg->sn);
+			}
+
+			if (ispeek == 0) {
+				iqueue_del(&seg->node);
+				ikcp_rcv_delete(kcp, seg);
+				kcp->nrcv_que--;
+			}
+
+			if (fragment == 0)
+				break;
+		}
 	}
 
 	assert(len == peeksize);
 
 	// move available data from rcv_buf -> rcv_queue
-	while (!iqueue_is_empty(&kcp->rcv_buf)) {
-		seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		} else {
-			break;
-		}
-	}
+	ikcp_move_rcv(kcp);
 
 	// fast recover
-	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+	if (recover && ikcp_wnd_adv(kcp) > 0) {
 		// ready to send back IKCP_CMD_WINS in ikcp_flush
 		// tell remote my window size
 		kcp->probe |= IKCP_ASK_TELL;
@@ -484,6 +1666,11 @@ int ikcp_peeksize(const ikcpcb *kcp)
 		return -1;
 
 	seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+	if (seg->frg == IKCP_FRG_COALESCED) {
+		IUINT32 size = 0;
+		ikcp_decode_varint(seg->data + kcp->rcv_offset, seg->data + seg->len, &size);
+		return (int)size;
+	}
 	if (seg->frg == 0)
 		return seg->len;
 
@@ -501,44 +1688,183 @@ int ikcp_peeksize(const ikcpcb *kcp)
 }
 
 
+//---------------------------------------------------------------------
+// large message: a head segment with the 4-byte total length followed
+// by body segments, queued all at once or not at all
+//---------------------------------------------------------------------
+static int ikcp_send_msg(ikcpcb *kcp, int prio, const char *buffer, int len)
+{
+	struct IQUEUEHEAD queue;
+	IUINT32 count = 0;
+	int remain = len + 4;
+	int sent = 0;
+
+	if ((IUINT32)len > kcp->maxmsg)
+		return -2;
+
+	iqueue_init(&queue);
+
+	while (remain > 0) {
+		int size = remain > (int)kcp->mss ? (int)kcp->mss : remain;
+		IKCPSEG *seg = ikcp_segment_new(kcp, size);
+		char *ptr;
+		if (seg == NULL) {
+			while (!iqueue_is_empty(&queue)) {
+				seg = iqueue_entry(queue.next, IKCPSEG, node);
+				iqueue_del(&seg->node);
+				ikcp_segment_delete(kcp, seg);
+			}
+			return -2;
+		}
+		ptr = seg->data;
+		seg->len = size;
+		seg->cap = size;
+		seg->frg = (count == 0) ? IKCP_FRG_MSGHEAD : IKCP_FRG_MSGBODY;
+		seg->cmd = IKCP_CMD_PUSH;
+		seg->prio = (IUINT32)prio;
+		seg->xmit = 0;
+		seg->ttl = 0;
+		seg->maxxmit = 0;
+		if (count == 0) {
+			ptr = ikcp_encode32u(ptr, (IUINT32)len);
+			size -= 4;
+		}
+		if (buffer) {
+			memcpy(ptr, buffer + sent, size);
+		}
+		iqueue_add_tail(&seg->node, &queue);
+		remain -= seg->len;
+		sent += size;
+		count++;
+	}
+
+	iqueue_splice(&queue, ikcp_snd_queue(kcp, prio)->prev);
+	kcp->nsnd_que += count;
+	kcp->nsnd_prio[prio] += count;
+
+	return sent;
+}
+
+
+//---------------------------------------------------------------------
+// the tail segment of a send queue if it is held back by ikcp_cork,
+// a coalesced segment keeps its creation time in ts until ikcp_flush
+//---------------------------------------------------------------------
+static const IKCPSEG *ikcp_corked(const ikcpcb *kcp, const struct IQUEUEHEAD *queue)
+{
+	const IKCPSEG *seg;
+	if (kcp->cork == 0 || iqueue_is_empty(queue))
+		return NULL;
+	seg = iqueue_entry(queue->prev, const IKCPSEG, node);
+	if (seg->frg != IKCP_FRG_COALESCED || seg->len >= _imin_(seg->cap, kcp->mss))
+		return NULL;
+	if (kcp->cork_delay > 0 &&
+		_itimediff(kcp->current, seg->ts) >= (IINT32)kcp->cork_delay)
+		return NULL;
+	return seg;
+}
+
+// a corked segment must leave by ts + cork_delay, pull the next flush
+// forward so ikcp_update/ikcp_check honour the bound
+static void ikcp_cork_arm(ikcpcb *kcp, const struct IQUEUEHEAD *queue)
+{
+	const IKCPSEG *seg = ikcp_corked(kcp, queue);
+	if (kcp->updated && kcp->cork_delay > 0 && seg != NULL) {
+		IUINT32 deadline = seg->ts + kcp->cork_delay;
+		if (_itimediff(deadline, kcp->ts_flush) < 0) {
+			kcp->ts_flush = deadline;
+		}
+	}
+}
+
+
+//---------------------------------------------------------------------
+// coalescing: append [varint len][data] to the tail segment of snd_queue
+// if it is a coalesced segment with enough room, or start a new one
+//---------------------------------------------------------------------
+static int ikcp_send_coalesced(ikcpcb *kcp, int prio, const char *buffer, int len)
+{
+	struct IQUEUEHEAD *queue = ikcp_snd_queue(kcp, prio);
+	int need = ikcp_varint_size((IUINT32)len) + len;
+	IKCPSEG *seg = NULL;
+	char *ptr;
+
+	if (!iqueue_is_empty(queue)) {
+		seg = iqueue_entry(queue->prev, IKCPSEG, node);
+		if (seg->frg != IKCP_FRG_COALESCED ||
+			seg->len + need > _imin_(seg->cap, kcp->mss)) {
+			seg = NULL;
+		}
+	}
+
+	if (seg == NULL) {
+		seg = ikcp_segment_new(kcp, kcp->mss);
+		if (seg == NULL) {
+			return -2;
+		}
+		seg->len = 0;
+		seg->cap = kcp->mss;
+		seg->frg = IKCP_FRG_COALESCED;
+		seg->ts = kcp->current;
+		ikcp_snd_push(kcp, prio, seg);
+		ikcp_cork_arm(kcp, queue);
+	}
+
+	ptr = ikcp_encode_varint(seg->data + seg->len, (IUINT32)len);
+	if (buffer && len > 0) {
+		memcpy(ptr, buffer, len);
+	}
+	seg->len += need;
+
+	return len;
+}
+
+
 //---------------------------------------------------------------------
 // user/upper level send, returns below zero for error
 //---------------------------------------------------------------------
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 {
+	return ikcp_send_prio(kcp, IKCP_PRIO_DEFAULT, buffer, len);
+}
+
+int ikcp_send_prio(ikcpcb *kcp, int prio, const char *buffer, int len)
+{
+	struct IQUEUEHEAD *queue;
 	assert(kcp->mss > 0);
-	if (len < 0) {
+	if (len < 0 || prio < 0 || prio >= IKCP_PRIO_COUNT) {
 		return -1;
 	}
+	if (kcp->close_state & IKCP_CLOSE_SENT) {
+		return -4;
+	}
+	queue = ikcp_snd_queue(kcp, prio);
 
 	IKCPSEG *seg;
 	int count; // 需要分片(IKCPSEG)的数量
 	int sent = 0; // 已经发送的字节数
 
+	if (ikcp_canlog(kcp, IKCP_LOG_SEND)) {
+		ikcp_trace_push(kcp, IKCP_LOG_SEND, (IUINT32)len, kcp->nsnd_que, 0);
+		ikcp_log(kcp, IKCP_LOG_SEND, "send %d bytes", len);
+	}
+
 	// append to previous segment in streaming mode (if possible)
 	if (kcp->stream != 0) {
-		// 字节流模式，如果之前的包没装满，则先把之前的包装满
-		if (!iqueue_is_empty(&kcp->snd_queue)) {
-			IKCPSEG *old = iqueue_entry(kcp->snd_queue.prev, IKCPSEG, node);
-			if (old->len < kcp->mss) {
-				int capacity = kcp->mss - old->len;
+		// 字节流模式，尾段按 mss 容量分配，没装满就直接追加到尾段，
+		// 直到 ikcp_flush 把它移入 snd_buf 为止
+		if (!iqueue_is_empty(queue)) {
+			IKCPSEG *old = iqueue_entry(queue->prev, IKCPSEG, node);
+			IUINT32 limit = _imin_(old->cap, kcp->mss);
+			if (old->len < limit) {
+				int capacity = limit - old->len;
 				int extend = (len < capacity) ? len : capacity;
-				seg = ikcp_segment_new(kcp, old->len + extend);
-				assert(seg);
-				if (seg == NULL) {
-					return -2;
-				}
-				iqueue_add_tail(&seg->node, &kcp->snd_queue);
-				memcpy(seg->data, old->data, old->len);
 				if (buffer) {
-					memcpy(seg->data + old->len, buffer, extend);
+					memcpy(old->data + old->len, buffer, extend);
 					buffer += extend;
 				}
-				seg->len = old->len + extend;
-				seg->frg = 0;
+				old->len += extend;
 				len -= extend;
-				iqueue_del_init(&old->node);
-				ikcp_segment_delete(kcp, old);
 				sent = extend;
 			}
 		}
@@ -547,6 +1873,19 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 		}
 	}
 
+	if (kcp->stream == 0 && kcp->coalesce != 0 &&
+		ikcp_varint_size((IUINT32)len) + len <= (int)kcp->mss) {
+		return ikcp_send_coalesced(kcp, prio, buffer, len);
+	}
+
+	if (kcp->stream == 0 && kcp->maxmsg > 0 && len > (int)kcp->mss) {
+		// 对端在协商中通告了能接收的上限之后才按大消息发送
+		if ((IUINT32)len <= kcp->rmt_maxmsg)
+			return ikcp_send_msg(kcp, prio, buffer, len);
+		if ((len + kcp->mss - 1) / kcp->mss >= IKCP_WND_RCV)
+			return ((IUINT32)len > kcp->maxmsg) ? -2 : -5;
+	}
+
 	if (len <= (int)kcp->mss)
 		count = 1;
 	else
@@ -565,7 +1904,8 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 	int i;
 	for (i = 0; i < count; i++) {
 		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
-		seg = ikcp_segment_new(kcp, size);
+		int cap = (kcp->stream == 0) ? size : (int)kcp->mss;
+		seg = ikcp_segment_new(kcp, cap);
 		assert(seg);
 		if (seg == NULL) {
 			return -2;
@@ -574,10 +1914,9 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 			memcpy(seg->data, buffer, size);
 		}
 		seg->len = size;
+		seg->cap = cap;
 		seg->frg = (kcp->stream == 0) ? (count - i - 1) : 0;
-		iqueue_init(&seg->node);
-		iqueue_add_tail(&seg->node, &kcp->snd_queue);
-		kcp->nsnd_que++;
+		ikcp_snd_push(kcp, prio, seg);
 		if (buffer) {
 			buffer += size;
 		}
@@ -588,13 +1927,116 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 	return sent;
 }
 
+int ikcp_send_partial(ikcpcb *kcp, int prio, const char *buffer, int len,
+	IUINT32 ttl, IUINT32 maxxmit)
+{
+	struct IQUEUEHEAD *queue, *p;
+	IUINT32 coalesce = kcp->coalesce;
+	IUINT32 maxmsg = kcp->maxmsg;
+	int hr;
+
+	if (kcp->stream != 0 || prio < 0 || prio >= IKCP_PRIO_COUNT) {
+		return -1;
+	}
+
+	// 按普通消息分片, 新的段都在原队尾之后
+	queue = ikcp_snd_queue(kcp, prio);
+	p = queue->prev;
+	kcp->coalesce = 0;
+	kcp->maxmsg = 0;
+	hr = ikcp_send_prio(kcp, prio, buffer, len);
+	kcp->coalesce = coalesce;
+	kcp->maxmsg = maxmsg;
+
+	if (hr >= 0 && (ttl > 0 || maxxmit > 0)) {
+		for (p = p->next; p != queue; p = p->next) {
+			IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+			seg->ttl = ttl;
+			seg->deadline = kcp->current + _ims(kcp, ttl);
+			seg->maxxmit = maxxmit;
+			kcp->npartial++;
+		}
+	}
+
+	return hr;
+}
+
+
+//---------------------------------------------------------------------
+// RACK: remember the most recently sent segment that has been acked,
+// 'ts' is the send time echoed back by the ack
+//---------------------------------------------------------------------
+static void ikcp_rack_update(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
+{
+	if (_itimediff(kcp->current, ts) < 0)
+		return;
+	if (kcp->rack_rtt == 0 || _itimediff(ts, kcp->rack_ts) > 0 ||
+		(ts == kcp->rack_ts && _itimediff(sn, kcp->rack_sn) > 0)) {
+		kcp->rack_ts = ts;
+		kcp->rack_sn = sn;
+		kcp->rack_rtt = _imax_((IUINT32)_itimediff(kcp->current, ts), 1);
+	}
+}
+
+// a segment sent before the RACK segment and still unacked a reorder
+// window after it would have been acked is lost
+static int ikcp_rack_lost(const ikcpcb *kcp, const IKCPSEG *seg)
+{
+	IINT32 reorder = (IINT32)_imax_((IUINT32)kcp->rx_srtt / 4, 1);
+	if (kcp->rack_rtt == 0)
+		return 0;
+	if (_itimediff(seg->ts, kcp->rack_ts) > 0 ||
+		(seg->ts == kcp->rack_ts && _itimediff(seg->sn, kcp->rack_sn) >= 0))
+		return 0;
+	return _itimediff(kcp->current, seg->ts) >= (IINT32)kcp->rack_rtt + reorder;
+}
+
 
 //---------------------------------------------------------------------
 // parse ack
 //---------------------------------------------------------------------
+// select the k-th smallest of n values, reorders 'v'
+static IUINT32 ikcp_select(IUINT32 *v, int n, int k)
+{
+	int lo = 0, hi = n - 1;
+	while (lo < hi) {
+		IUINT32 pivot = v[(lo + hi) / 2];
+		int i = lo, j = hi;
+		while (i <= j) {
+			while (v[i] < pivot) i++;
+			while (v[j] > pivot) j--;
+			if (i <= j) {
+				IUINT32 t = v[i]; v[i] = v[j]; v[j] = t;
+				i++;
+				j--;
+			}
+		}
+		if (k <= j) hi = j;
+		else if (k >= i) lo = i;
+		else break;
+	}
+	return v[k];
+}
+
+// rto from the current estimates, see ikcp_rtomode
+static void ikcp_update_rto(ikcpcb *kcp)
+{
+	IUINT32 floor = kcp->rx_minrto;
+	IINT32 rto = kcp->rx_srtt + _imax_(kcp->interval, 4 * kcp->rx_rttval);
+	if ((kcp->rtomode & IKCP_RTO_PERCENTILE) && kcp->rtt_count > 0) {
+		IUINT32 v[IKCP_RTT_RECENT];
+		int n = (int)_imin_(kcp->rtt_count, IKCP_RTT_RECENT);
+		memcpy(v, kcp->rtt_recent, n * sizeof(IUINT32));
+		rto = ikcp_select(v, n, (n - 1) * kcp->rto_pct / 100) + kcp->interval;
+	}
+	if ((kcp->rtomode & IKCP_RTO_MINRTT) && kcp->minrtt > 0) {
+		floor = kcp->minrtt + kcp->interval;
+	}
+	kcp->rx_rto = _ibound_(floor, rto, _ims(kcp, IKCP_RTO_MAX));
+}
+
 static void ikcp_update_ack(ikcpcb *kcp, IINT32 rtt)
 {
-	IINT32 rto = 0;
 	if (kcp->rx_srtt == 0) {
 		kcp->rx_srtt = rtt;
 		kcp->rx_rttval = rtt / 2;
@@ -607,8 +2049,27 @@ static void ikcp_update_ack(ikcpcb *kcp, IINT32 rtt)
 		if (kcp->rx_srtt < 1)
 			kcp->rx_srtt = 1;
 	}
-	rto = kcp->rx_srtt + _imax_(kcp->interval, 4 * kcp->rx_rttval);
-	kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX);
+	// 窗口内的最小 rtt, 过期后由新的采样替换
+	if (kcp->minrtt == 0 || (IUINT32)rtt <= kcp->minrtt ||
+		_itimediff(kcp->current, kcp->ts_minrtt) >= (IINT32)_ims(kcp, IKCP_MINRTT_WIN)) {
+		kcp->minrtt = _imax_((IUINT32)rtt, 1);
+		kcp->ts_minrtt = kcp->current;
+	}
+	if (kcp->rtt_recent) {
+		kcp->rtt_recent[kcp->rtt_count++ % IKCP_RTT_RECENT] = (IUINT32)rtt;
+	}
+	ikcp_update_rto(kcp);
+}
+
+// 记录一次 rtt 采样到直方图
+static void ikcp_rtt_sample(ikcpcb *kcp, IUINT32 rtt)
+{
+	int bucket = 0;
+	while (rtt != 0 && bucket < IKCP_RTT_BUCKETS - 1) {
+		rtt >>= 1;
+		bucket++;
+	}
+	kcp->stats.rtt_hist[bucket]++;
 }
 
 static void ikcp_shrink_buf(ikcpcb *kcp)
@@ -622,26 +2083,85 @@ static void ikcp_shrink_buf(ikcpcb *kcp)
 	}
 }
 
-static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
+//---------------------------------------------------------------------
+// spurious retransmission (Eifel): 'ts' echoed by the ack is the send
+// time of the copy that arrived. an older copy than the last one sent
+// means the retransmission was not needed; if it was the original, the
+// window reduction of this recovery episode is undone.
+//---------------------------------------------------------------------
+static void ikcp_check_spurious(ikcpcb *kcp, const IKCPSEG *seg, IUINT32 ts)
 {
-	struct IQUEUEHEAD *p, *next;
+	int episode = kcp->undo_valid && _itimediff(seg->sn, kcp->undo_sn) < 0;
 
-	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
+	if (seg->xmit <= 1 || seg->cmd == IKCP_CMD_SKIP)
 		return;
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (sn == seg->sn) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-			break;
+	if (_itimediff(seg->ts, ts) <= 0) {
+		// 重传的段先到达, 丢包是真实的
+		if (ts != seg->ts_orig && episode)
+			kcp->undo_valid = 0;
+		return;
+	}
+
+	kcp->stats.spurious++;
+
+	if (ts == seg->ts_orig && episode) {
+		IINT32 rtt = _itimediff(kcp->current, ts);
+		kcp->cwnd = _imax_(kcp->cwnd, kcp->undo_cwnd);
+		kcp->ssthresh = _imax_(kcp->ssthresh, kcp->undo_ssthresh);
+		kcp->incr = _imax_(kcp->incr, kcp->undo_incr);
+		kcp->undo_valid = 0;
+		kcp->stats.undos++;
+		// 原始段的 rtt 超过了 rto, 说明是 rtt 突增引起的超时:
+		// 按 RFC 4015 把估计值提到这次采样, 避免接下来再次超时
+		if (rtt >= kcp->rx_rto) {
+			kcp->rx_srtt = _imax_(kcp->rx_srtt, rtt);
+			kcp->rx_rttval = _imax_(kcp->rx_rttval, rtt / 2);
+			ikcp_update_rto(kcp);
 		}
-		if (_itimediff(sn, seg->sn) < 0) {
+	}
+}
+
+// remember the window before the first reduction of a recovery episode
+static void ikcp_undo_save(ikcpcb *kcp)
+{
+	if (kcp->undo_valid && _itimediff(kcp->snd_una, kcp->undo_sn) < 0)
+		return;
+	kcp->undo_cwnd = kcp->cwnd;
+	kcp->undo_ssthresh = kcp->ssthresh;
+	kcp->undo_incr = kcp->incr;
+	kcp->undo_sn = kcp->snd_nxt;
+	kcp->undo_valid = 1;
+}
+
+// returns how many times the acked segment was sent, 0 if not in flight
+static IUINT32 ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
+{
+	struct IQUEUEHEAD *p, *next;
+	IUINT32 xmit = 0;
+
+	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
+		return 0;
+
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		next = p->next;
+		if (sn == seg->sn) {
+			ikcp_check_spurious(kcp, seg, ts);
+			xmit = seg->xmit;
+			iqueue_del(p);
+			kcp->nsnd_prio[seg->prio]--;
+			if (seg->cmd != IKCP_CMD_SKIP && (seg->ttl > 0 || seg->maxxmit > 0))
+				kcp->npartial--;
+			ikcp_segment_delete(kcp, seg);
+			kcp->nsnd_buf--;
+			break;
+		}
+		if (_itimediff(sn, seg->sn) < 0) {
 			break;
 		}
 	}
+	return xmit;
 }
 
 static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
@@ -652,6 +2172,9 @@ static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
 		next = p->next;
 		if (_itimediff(una, seg->sn) > 0) {
 			iqueue_del(p);
+			kcp->nsnd_prio[seg->prio]--;
+			if (seg->cmd != IKCP_CMD_SKIP && (seg->ttl > 0 || seg->maxxmit > 0))
+				kcp->npartial--;
 			ikcp_segment_delete(kcp, seg);
 			kcp->nsnd_buf--;
 		} else {
@@ -761,10 +2284,30 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 	}
 
 	if (repeat == 0) {
+		if (newseg->frg == IKCP_FRG_STREAM) {
+			IKCPSEG *ghost = ikcp_segment_new(kcp, 0);
+			if (ghost != NULL) {
+				*ghost = *newseg;
+				ghost->len = 0;
+			}
+			if (ghost == NULL || ikcp_stream_input(kcp, newseg) != 0) {
+				// 占位段分配失败或者没有这个流: 丢弃这个段, 撤回 ikcp_input
+				// 刚压入的 ACK, 让对端重传
+				if (kcp->ackcount > 0 && kcp->acklist[(kcp->ackcount - 1) * 2] == sn)
+					kcp->ackcount--;
+				if (ghost != NULL)
+					ikcp_segment_delete(kcp, ghost);
+				ikcp_segment_delete(kcp, newseg);
+				return;
+			}
+			newseg = ghost;
+		}
 		iqueue_init(&newseg->node);
 		iqueue_add(&newseg->node, p);
+		ikcp_rcv_hold(kcp, newseg);
 		kcp->nrcv_buf++;
 	} else {
+		kcp->stats.in_dups++;
 		ikcp_segment_delete(kcp, newseg);
 	}
 
@@ -774,18 +2317,7 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 #endif
 
 	// move available data from rcv_buf -> rcv_queue
-	while (!iqueue_is_empty(&kcp->rcv_buf)) {
-		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		} else {
-			break;
-		}
-	}
+	ikcp_move_rcv(kcp);
 
 #if 0
 	ikcp_qprint("queue", &kcp->rcv_queue);
@@ -799,16 +2331,205 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 }
 
 
+//---------------------------------------------------------------------
+// option exchange: an end with an option set sends its options as the
+// data of a IKCP_CMD_WINS until the peer has them, and keeps answering
+// after the options are turned off so the peer learns about it
+//---------------------------------------------------------------------
+static int ikcp_opt_on(const ikcpcb *kcp)
+{
+	return kcp->maxmsg > 0 || kcp->nstreams > 0 || kcp->wscale > 0 ||
+		kcp->opt_state != 0;
+}
+
+// an option changed, announce it again
+static void ikcp_opt_changed(ikcpcb *kcp)
+{
+	// 收到过对端的参数时下次 flush 立即发送, 否则重新开始定时发送
+	if (kcp->opt_state & IKCP_OPT_GOT)
+		kcp->opt_state |= IKCP_OPT_REPLY;
+	kcp->opt_tries = 0;
+}
+
+// option offer from the peer: [progress][maxmsg][nstreams][shift]
+static void ikcp_opt_input(ikcpcb *kcp, const char *data)
+{
+	IUINT8 peer, nstreams, shift;
+	data = ikcp_decode8u(data, &peer);
+	data = ikcp_decode32u(data, &kcp->rmt_maxmsg);
+	data = ikcp_decode8u(data, &nstreams);
+	data = ikcp_decode8u(data, &shift);
+	kcp->rmt_nstreams = nstreams;
+	kcp->rmt_wscale = _imin_(shift, IKCP_WSCALE_MAX);
+	kcp->opt_state |= IKCP_OPT_GOT;
+	// 对端的进度里每一步都说明它收到了本端更早的一步
+	if (peer & IKCP_OPT_GOT)
+		kcp->opt_state |= IKCP_OPT_KNOWN;
+	if (peer & IKCP_OPT_KNOWN)
+		kcp->opt_state |= IKCP_OPT_DECODE;
+	if (peer & IKCP_OPT_DECODE)
+		kcp->opt_state |= IKCP_OPT_PEER;
+	if ((peer & IKCP_OPT_DONE) != IKCP_OPT_DONE)
+		kcp->opt_state |= IKCP_OPT_REPLY;
+	kcp->opt_tries = 0;
+}
+
+
+//---------------------------------------------------------------------
+// path mtu discovery
+//---------------------------------------------------------------------
+static void ikcp_pmtu_set(ikcpcb *kcp, IUINT32 mtu)
+{
+	// buffer 已经按 pmtu_max 分配, 这里只改 mtu/mss, 已经排队的段不受影响
+	kcp->mtu = mtu;
+	kcp->mss = kcp->mtu - IKCP_OVERHEAD - kcp->reserved;
+}
+
+// the peer got a probe of 'size' bytes
+static void ikcp_pmtu_ack(ikcpcb *kcp, IUINT32 size)
+{
+	// 只接受在途探测包的回应, 其它大小 (伪造的, 或者黑洞退回之前的)
+	// 不能说明现在的路径能通过
+	if (kcp->pmtu_state != IKCP_PMTU_PROBING || size != kcp->pmtu_probe)
+		return;
+	if (size > kcp->pmtu_lo) {
+		kcp->pmtu_lo = size;
+		if (kcp->pmtu_hi < size)
+			kcp->pmtu_hi = size;
+		ikcp_pmtu_set(kcp, size);
+	}
+	kcp->pmtu_state = IKCP_PMTU_SEARCH;
+	kcp->pmtu_probe = 0;
+	kcp->pmtu_fails = 0;
+}
+
+// one piece of a segment resent in base sized pieces, returns the whole
+// segment once every piece arrived, NULL otherwise
+static IKCPSEG *ikcp_part_input(ikcpcb *kcp, IUINT32 sn, const char *data,
+	IUINT32 len)
+{
+	struct IQUEUEHEAD *p, *next;
+	struct IKCPPART *part = NULL;
+	IUINT16 total, psize, index;
+	IUINT32 count, offset;
+	IKCPSEG *seg;
+
+	data = ikcp_decode16u(data, &total);
+	data = ikcp_decode16u(data, &psize);
+	data = ikcp_decode16u(data, &index);
+	len -= IKCP_PART_OVERHEAD;
+	if (total == 0 || psize == 0)
+		return NULL;
+	count = ((IUINT32)total + psize - 1) / psize;
+	offset = (IUINT32)index * psize;
+	if (index >= count || len != _imin_(psize, total - offset))
+		return NULL;
+
+	for (p = kcp->rcv_part.next; p != &kcp->rcv_part; p = next) {
+		struct IKCPPART *x = iqueue_entry(p, struct IKCPPART, node);
+		next = p->next;
+		// 已经交付过的段不再需要
+		if (_itimediff(x->sn, kcp->rcv_nxt) < 0) {
+			iqueue_del(&x->node);
+			ikcp_free(x);
+			kcp->nrcv_part--;
+		} else if (x->sn == sn) {
+			part = x;
+		}
+	}
+
+	// 发送端换了分法, 重新开始
+	if (part && (part->total != total || part->psize != psize)) {
+		iqueue_del(&part->node);
+		ikcp_free(part);
+		kcp->nrcv_part--;
+		part = NULL;
+	}
+
+	if (part == NULL) {
+		if (kcp->nrcv_part >= IKCP_PART_LIMIT) {
+			struct IKCPPART *old = iqueue_entry(kcp->rcv_part.next,
+				struct IKCPPART, node);
+			iqueue_del(&old->node);
+			ikcp_free(old);
+			kcp->nrcv_part--;
+		}
+		part = (struct IKCPPART *)ikcp_malloc(sizeof(struct IKCPPART) +
+			total + count);
+		if (part == NULL)
+			return NULL;
+		part->sn = sn;
+		part->total = total;
+		part->psize = psize;
+		part->missing = count;
+		part->present = (unsigned char *)part->data + total;
+		memset(part->present, 0, count);
+		iqueue_add_tail(&part->node, &kcp->rcv_part);
+		kcp->nrcv_part++;
+	}
+
+	if (part->present[index] == 0) {
+		part->present[index] = 1;
+		memcpy(part->data + offset, data, len);
+		part->missing--;
+	}
+
+	if (part->missing > 0)
+		return NULL;
+
+	seg = ikcp_segment_new(kcp, total);
+	if (seg) {
+		seg->len = total;
+		memcpy(seg->data, part->data, total);
+	}
+	iqueue_del(&part->node);
+	ikcp_free(part);
+	kcp->nrcv_part--;
+	return seg;
+}
+
+// segments above the base keep timing out: the path mtu went down
+static void ikcp_pmtu_blackhole(ikcpcb *kcp)
+{
+	kcp->pmtu_hi = kcp->mtu - 1;
+	kcp->pmtu_lo = kcp->pmtu_base;
+	kcp->pmtu_probe = 0;
+	kcp->pmtu_fails = 0;
+	kcp->pmtu_state = IKCP_PMTU_WAIT;
+	kcp->ts_pmtu = kcp->current + kcp->rx_rto;
+	kcp->stats.pmtu_blackholes++;
+	ikcp_pmtu_set(kcp, kcp->pmtu_base);
+}
+
 //---------------------------------------------------------------------
 // input data
 //---------------------------------------------------------------------
 int ikcp_input(ikcpcb *kcp, const char *data, long size)
+{
+	int hr;
+	// 每个下层数据包只计一次, FEC 的数据分片和恢复出的包不再重复计数
+	if (data != NULL && size >= (long)IKCP_OVERHEAD) {
+		kcp->stats.in_pkts++;
+	}
+	if (kcp->fec) {
+		hr = ikcp_fec_input(kcp, data, size);
+	}	else {
+		hr = ikcp_input_segs(kcp, data, size);
+	}
+	if (kcp->ack_nodelay) {
+		ikcp_flush_acks(kcp);
+	}
+	return hr;
+}
+
+static int ikcp_input_segs(ikcpcb *kcp, const char *data, long size)
 {
 	IUINT32 prev_una = kcp->snd_una;
 	IUINT32 maxack = 0, latest_ts = 0;
 	int flag = 0;
 
 	if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
+		ikcp_trace_push(kcp, IKCP_LOG_INPUT, (IUINT32)size, 0, 0);
 		ikcp_log(kcp, IKCP_LOG_INPUT, "[RI] %d bytes", (int)size);
 	}
 
@@ -819,6 +2540,7 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 		IUINT32 ts, sn, len, una, conv;
 		IUINT16 wnd;
 		IUINT8 cmd, frg;
+		IUINT32 xmit = 0;
 		IKCPSEG *seg;
 
 		if (size < (int)IKCP_OVERHEAD) {
@@ -844,19 +2566,39 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 			return -2;
 
 		if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK &&
-			cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS)
+			cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS &&
+			cmd != IKCP_CMD_SKIP && cmd != IKCP_CMD_PROBE &&
+			cmd != IKCP_CMD_PROBEACK && cmd != IKCP_CMD_PART)
 			return -3;
 
-		kcp->rmt_wnd = wnd;
+		if (kcp->opt_state & IKCP_OPT_DECODE) {
+			kcp->rmt_wnd = wnd << kcp->rmt_wscale;
+		}	else {
+			kcp->rmt_wnd = wnd;
+		}
+		if (cmd == IKCP_CMD_ACK) {
+			// 先按 sn 确认: una 通常已经覆盖这个段, 先处理 una 就看不到
+			// 它的发送记录, 无法判断重传是否多余
+			xmit = ikcp_parse_ack(kcp, sn, ts);
+		}
 		ikcp_parse_una(kcp, una);
 		ikcp_shrink_buf(kcp);
 
 		if (cmd == IKCP_CMD_ACK) {
+			kcp->stats.in_acks++;
+			kcp->tlp_out = 0;
+			if (kcp->recovery & IKCP_RECOVERY_RACK) {
+				ikcp_rack_update(kcp, sn, ts);
+			}
 			if (_itimediff(kcp->current, ts) >= 0) {
-				ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
+				// 重传过的段或者已经确认过的段, 采样可能不是这次发送的 rtt
+				if (xmit != 1)
+					kcp->stats.rtt_ambiguous++;
+				if (xmit == 1 || (kcp->rtomode & IKCP_RTO_KARN) == 0) {
+					ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
+					ikcp_rtt_sample(kcp, (IUINT32)_itimediff(kcp->current, ts));
+				}
 			}
-			ikcp_parse_ack(kcp, sn);
-			ikcp_shrink_buf(kcp);
 			if (flag == 0) {
 				flag = 1;
 				maxack = sn;
@@ -875,19 +2617,30 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 				}
 			}
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
+				ikcp_trace_push(kcp, IKCP_LOG_IN_ACK, sn,
+								(IUINT32)_itimediff(kcp->current, ts), kcp->rx_rto);
 				ikcp_log(kcp, IKCP_LOG_IN_ACK,
 						 "input ack: sn=%lu rtt=%ld rto=%ld", (unsigned long)sn,
 						 (long)_itimediff(kcp->current, ts),
 						 (long)kcp->rx_rto);
 			}
-		} else if (cmd == IKCP_CMD_PUSH) {
+		} else if (cmd == IKCP_CMD_PUSH || cmd == IKCP_CMD_SKIP) {
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
+				ikcp_trace_push(kcp, IKCP_LOG_IN_DATA, sn, ts, len);
 				ikcp_log(kcp, IKCP_LOG_IN_DATA,
 						 "input psh: sn=%lu ts=%lu", (unsigned long)sn, (unsigned long)ts);
 			}
+			kcp->stats.in_segs++;
+			kcp->stats.in_bytes += len;
 			if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
 				ikcp_ack_push(kcp, sn, ts);
-				if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
+				if (_itimediff(sn, kcp->rcv_nxt) < 0) {
+					kcp->stats.in_dups++;
+					if (cmd == IKCP_CMD_PUSH && frg == IKCP_FRG_FIN) {
+						// 对端没有收到 FIN 的确认, 重新开始逗留
+						ikcp_close_peer(kcp);
+					}
+				} else {
 					seg = ikcp_segment_new(kcp, len);
 					seg->conv = conv;
 					seg->cmd = cmd;
@@ -904,17 +2657,55 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 
 					ikcp_parse_data(kcp, seg);
 				}
+			} else {
+				kcp->stats.in_drops++;
 			}
 		} else if (cmd == IKCP_CMD_WASK) {
 			// ready to send back IKCP_CMD_WINS in ikcp_flush
 			// tell remote my window size
 			kcp->probe |= IKCP_ASK_TELL;
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_PROBE)) {
+				ikcp_trace_push(kcp, IKCP_LOG_IN_PROBE, 0, 0, 0);
 				ikcp_log(kcp, IKCP_LOG_IN_PROBE, "input probe");
 			}
+		} else if (cmd == IKCP_CMD_PART) {
+			// 整段收齐后和 PUSH 一样处理, 之前不回复 ACK
+			if (len < IKCP_PART_OVERHEAD) {
+				// ignore
+			} else if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0) {
+				kcp->stats.in_drops++;
+			} else if (_itimediff(sn, kcp->rcv_nxt) < 0) {
+				ikcp_ack_push(kcp, sn, ts);
+				kcp->stats.in_dups++;
+			} else {
+				seg = ikcp_part_input(kcp, sn, data, len);
+				if (seg) {
+					ikcp_ack_push(kcp, sn, ts);
+					kcp->stats.in_segs++;
+					kcp->stats.in_bytes += seg->len;
+					seg->conv = conv;
+					seg->cmd = IKCP_CMD_PUSH;
+					seg->frg = frg;
+					seg->wnd = wnd;
+					seg->ts = ts;
+					seg->sn = sn;
+					seg->una = una;
+					ikcp_parse_data(kcp, seg);
+				}
+			}
+		} else if (cmd == IKCP_CMD_PROBE) {
+			// 只回复最近的一个, 探测包每次只有一个在途
+			kcp->pmtu_echo = IKCP_OVERHEAD + len;
+			kcp->pmtu_echo_ts = ts;
+		} else if (cmd == IKCP_CMD_PROBEACK) {
+			ikcp_pmtu_ack(kcp, sn);
 		} else if (cmd == IKCP_CMD_WINS) {
-			// do nothing
+			// 带数据的 WINS 是参数协商, 没有开启任何参数的一端忽略数据
+			if (len >= IKCP_OPT_LEN && ikcp_opt_on(kcp)) {
+				ikcp_opt_input(kcp, data);
+			}
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_WINS)) {
+				ikcp_trace_push(kcp, IKCP_LOG_IN_WINS, wnd, 0, 0);
 				ikcp_log(kcp, IKCP_LOG_IN_WINS,
 						 "input wins: %lu", (unsigned long)(wnd));
 			}
@@ -975,138 +2766,604 @@ static char *ikcp_encode_seg(char *ptr, const IKCPSEG *seg)
 	return ptr;
 }
 
-static int ikcp_wnd_unused(const ikcpcb *kcp)
+
+
+//---------------------------------------------------------------------
+// partial reliability: an expired message that has sequence numbers is
+// turned into zero-length SKIP segments (frg kept) which are delivered
+// reliably, one that has not is simply removed from its send queue.
+//---------------------------------------------------------------------
+static int ikcp_expired(const ikcpcb *kcp, const IKCPSEG *seg)
 {
-	if (kcp->nrcv_que < kcp->rcv_wnd) {
-		return kcp->rcv_wnd - kcp->nrcv_que;
-	}
+	if (seg->cmd == IKCP_CMD_SKIP)
+		return 0;
+	if (seg->ttl > 0 && _itimediff(kcp->current, seg->deadline) >= 0)
+		return 1;
+	if (seg->maxxmit > 0 && seg->xmit >= seg->maxxmit &&
+		_itimediff(kcp->current, seg->resendts) >= 0)
+		return 1;
 	return 0;
 }
 
+static void ikcp_skip_seg(ikcpcb *kcp, IKCPSEG *seg)
+{
+	if (seg->cmd != IKCP_CMD_SKIP) {
+		seg->cmd = IKCP_CMD_SKIP;
+		seg->len = 0;
+		seg->xmit = 0;	// 作为新段立即发出, 不算丢包
+		kcp->stats.out_skips++;
+		kcp->npartial--;
+	}
+}
+
+static void ikcp_expire(ikcpcb *kcp)
+{
+	struct IQUEUEHEAD *p, *next;
+	IUINT32 kill = kcp->snd_una;	// [snd_una, kill) 内的段属于放弃的消息
+	int i;
+
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		if (_itimediff(seg->sn, kill) < 0) {
+			ikcp_skip_seg(kcp, seg);
+		}	else if (ikcp_expired(kcp, seg)) {
+			ikcp_skip_seg(kcp, seg);
+			kill = seg->sn + seg->frg + 1;
+		}
+	}
+
+	for (i = 0; i < IKCP_PRIO_COUNT; i++) {
+		struct IQUEUEHEAD *queue = ikcp_snd_queue(kcp, i);
+		IUINT32 rest = 0;	// 已经部分移入 snd_buf 的消息剩下的分片数
+		if (kcp->snd_lock == (IUINT32)i + 1 && !iqueue_is_empty(queue)) {
+			IKCPSEG *seg = iqueue_entry(queue->next, IKCPSEG, node);
+			if (_itimediff(kill, kcp->snd_nxt) > 0 || ikcp_expired(kcp, seg)) {
+				rest = seg->frg + 1;
+			}
+		}
+		for (p = queue->next; p != queue; p = next) {
+			IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+			next = p->next;
+			if (rest > 0) {
+				ikcp_skip_seg(kcp, seg);
+				rest--;
+			}	else if (ikcp_expired(kcp, seg)) {
+				iqueue_del(&seg->node);
+				kcp->nsnd_que--;
+				kcp->nsnd_prio[seg->prio]--;
+				kcp->npartial--;
+				kcp->stats.out_expired++;
+				ikcp_segment_delete(kcp, seg);
+			}
+		}
+	}
+}
+
 
 //---------------------------------------------------------------------
-// ikcp_flush
+// pick the priority class whose head segment moves into snd_buf next,
+// -1 if nothing may move. a corked segment stays in its queue.
 //---------------------------------------------------------------------
-void ikcp_flush(ikcpcb *kcp)
+static int ikcp_schedule_ready(ikcpcb *kcp, int prio)
 {
-	IUINT32 current = kcp->current;
-	char *buffer = kcp->buffer;
-	char *ptr = buffer;
-	int count, size, i;
-	IUINT32 resent, cwnd;
-	IUINT32 rtomin;
-	struct IQUEUEHEAD *p;
-	int change = 0;
-	int lost = 0;
-	IKCPSEG seg;
+	struct IQUEUEHEAD *queue = ikcp_snd_queue(kcp, prio);
+	const IKCPSEG *corked;
+	if (iqueue_is_empty(queue))
+		return 0;
+	corked = ikcp_corked(kcp, queue);
+	return (corked == NULL || queue->next != &corked->node) ? 1 : 0;
+}
 
-	// 'ikcp_update' haven't been called.
-	if (kcp->updated == 0) {
-		return;
+static int ikcp_schedule(ikcpcb *kcp)
+{
+	int prio, i;
+
+	if (kcp->nsnd_que == 0)
+		return -1;
+
+	// 多段消息的剩余分片必须紧接着发送
+	if (kcp->snd_lock > 0) {
+		prio = (int)kcp->snd_lock - 1;
+		if (!iqueue_is_empty(ikcp_snd_queue(kcp, prio))) {
+			kcp->snd_credit--;
+			return prio;
+		}
+		kcp->snd_lock = 0;
 	}
 
-	seg.conv = kcp->conv;
-	seg.cmd = IKCP_CMD_ACK;
-	seg.frg = 0;
-	seg.wnd = ikcp_wnd_unused(kcp);
-	seg.una = kcp->rcv_nxt;
-	seg.len = 0;
-	seg.sn = 0;
-	seg.ts = 0;
+	if (kcp->snd_weight[0] == 0) {
+		for (prio = 0; prio < IKCP_PRIO_COUNT; prio++) {
+			if (ikcp_schedule_ready(kcp, prio))
+				return prio;
+		}
+		return -1;
+	}
 
-	// flush acknowledges
-	count = kcp->ackcount;
-	for (i = 0; i < count; i++) {
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
+	for (i = 0; i <= IKCP_PRIO_COUNT; i++) {
+		prio = (int)kcp->snd_rr;
+		if (kcp->snd_credit > 0 && ikcp_schedule_ready(kcp, prio)) {
+			kcp->snd_credit--;
+			return prio;
 		}
-		ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-		ptr = ikcp_encode_seg(ptr, &seg);
+		kcp->snd_rr = (kcp->snd_rr + 1) % IKCP_PRIO_COUNT;
+		kcp->snd_credit = (IINT32)kcp->snd_weight[kcp->snd_rr];
 	}
 
-	kcp->ackcount = 0;
+	return -1;
+}
 
-	// probe window size (if remote window size equals zero)
-	if (kcp->rmt_wnd == 0) {
-		if (kcp->probe_wait == 0) {
-			kcp->probe_wait = IKCP_PROBE_INIT;
-			kcp->ts_probe = kcp->current + kcp->probe_wait;
-		} else {
-			if (_itimediff(kcp->current, kcp->ts_probe) >= 0) {
-				if (kcp->probe_wait < IKCP_PROBE_INIT)
-					kcp->probe_wait = IKCP_PROBE_INIT;
-				kcp->probe_wait += kcp->probe_wait / 2;
-				if (kcp->probe_wait > IKCP_PROBE_LIMIT)
-					kcp->probe_wait = IKCP_PROBE_LIMIT;
-				kcp->ts_probe = kcp->current + kcp->probe_wait;
-				kcp->probe |= IKCP_ASK_SEND;
-			}
+// keep the class locked while the message of 'seg' has more segments
+static void ikcp_schedule_lock(ikcpcb *kcp, int prio, const IKCPSEG *seg)
+{
+	struct IQUEUEHEAD *queue = ikcp_snd_queue(kcp, prio);
+	int more = 0;
+	if (seg->frg > 0 && seg->frg < IKCP_FRG_STREAM && kcp->stream == 0) {
+		more = 1;
+	}	else if (seg->frg == IKCP_FRG_MSGHEAD || seg->frg == IKCP_FRG_MSGBODY) {
+		if (!iqueue_is_empty(queue)) {
+			const IKCPSEG *next = iqueue_entry(queue->next, const IKCPSEG, node);
+			more = (next->frg == IKCP_FRG_MSGBODY) ? 1 : 0;
 		}
-	} else {
-		kcp->ts_probe = 0;
-		kcp->probe_wait = 0;
 	}
+	kcp->snd_lock = more ? (IUINT32)prio + 1 : 0;
+}
 
-	// flush window probing commands
-	if (kcp->probe & IKCP_ASK_SEND) {
-		seg.cmd = IKCP_CMD_WASK;
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+
+//---------------------------------------------------------------------
+// encode the pending acks after 'ptr' in kcp->buffer, sending out full
+// packets on the way, 'seg' carries the ack header fields
+//---------------------------------------------------------------------
+// packets without data stay within the base mtu while probing, a side that
+// only sends acks never sees the timeouts that reveal a black hole
+static inline IUINT32 ikcp_ctrl_mtu(const ikcpcb *kcp)
+{
+	return (kcp->pmtu_state != 0)? kcp->pmtu_base : kcp->mtu - kcp->reserved;
+}
+
+static char *ikcp_encode_acks(ikcpcb *kcp, char *ptr, IKCPSEG *seg)
+{
+	char *buffer = kcp->buffer;
+	IUINT32 mtu = ikcp_ctrl_mtu(kcp);
+	int count = kcp->ackcount;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		int size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)mtu) {
 			ikcp_output(kcp, buffer, size);
 			ptr = buffer;
 		}
-		ptr = ikcp_encode_seg(ptr, &seg);
+		ikcp_ack_get(kcp, i, &seg->sn, &seg->ts);
+		ptr = ikcp_encode_seg(ptr, seg);
 	}
 
-	// flush window probing commands
-	if (kcp->probe & IKCP_ASK_TELL) {
-		seg.cmd = IKCP_CMD_WINS;
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+	kcp->stats.out_acks += count;
+	kcp->ackcount = 0;
+
+	return ptr;
+}
+
+// a segment larger than the current mtu, sent as IKCP_CMD_PART pieces that
+// fit the base mtu, the peer acks it once all pieces are in
+static char *ikcp_encode_parts(ikcpcb *kcp, char *ptr, const IKCPSEG *segment,
+	IUINT32 mtu)
+{
+	char *buffer = kcp->buffer;
+	IUINT32 psize = kcp->pmtu_base - kcp->reserved - IKCP_OVERHEAD - IKCP_PART_OVERHEAD;
+	IUINT32 count = (segment->len + psize - 1) / psize;
+	IUINT32 i;
+	IKCPSEG head = *segment;
+
+	head.cmd = IKCP_CMD_PART;
+	for (i = 0; i < count; i++) {
+		IUINT32 offset = i * psize;
+		IUINT32 len = _imin_(psize, segment->len - offset);
+		int size = (int)(ptr - buffer);
+		if (size + (int)(IKCP_OVERHEAD + IKCP_PART_OVERHEAD + len) > (int)mtu) {
 			ikcp_output(kcp, buffer, size);
 			ptr = buffer;
 		}
-		ptr = ikcp_encode_seg(ptr, &seg);
+		head.len = IKCP_PART_OVERHEAD + len;
+		ptr = ikcp_encode_seg(ptr, &head);
+		ptr = ikcp_encode16u(ptr, (IUINT16)segment->len);
+		ptr = ikcp_encode16u(ptr, (IUINT16)psize);
+		ptr = ikcp_encode16u(ptr, (IUINT16)i);
+		memcpy(ptr, segment->data + offset, len);
+		ptr += len;
 	}
 
-	kcp->probe = 0;
+	kcp->stats.out_parts++;
+	return ptr;
+}
 
-	// calculate window size
-	cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
-	if (kcp->nocwnd == 0)
-		cwnd = _imin_(kcp->cwnd, cwnd);
 
-	// move data from snd_queue to snd_buf
-	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
-		IKCPSEG *newseg;
-		if (iqueue_is_empty(&kcp->snd_queue))
-			break;
+//---------------------------------------------------------------------
+// send the pending acks only, without scanning snd_buf
+//---------------------------------------------------------------------
+void ikcp_flush_acks(ikcpcb *kcp)
+{
+	IKCPSEG seg;
+	char *ptr;
 
-		newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
+	// ikcp_flush 正在使用 kcp->buffer (输出回调里直接调用了 ikcp_input)
+	if (kcp->ackcount == 0 || kcp->flushing)
+		return;
 
-		iqueue_del(&newseg->node);
-		iqueue_add_tail(&newseg->node, &kcp->snd_buf);
-		kcp->nsnd_que--;
-		kcp->nsnd_buf++;
+	seg.conv = kcp->conv;
+	seg.cmd = IKCP_CMD_ACK;
+	seg.frg = 0;
+	seg.wnd = ikcp_wnd_adv(kcp);
+	seg.una = kcp->rcv_nxt;
+	seg.len = 0;
 
-		newseg->conv = kcp->conv;
-		newseg->cmd = IKCP_CMD_PUSH;
-		newseg->wnd = seg.wnd;
-		newseg->ts = current;
-		newseg->sn = kcp->snd_nxt++;
-		newseg->una = kcp->rcv_nxt;
-		newseg->resendts = current;
-		newseg->rto = kcp->rx_rto;
-		newseg->fastack = 0;
-		newseg->xmit = 0;
+	kcp->flushing = 1;
+	ptr = ikcp_encode_acks(kcp, kcp->buffer, &seg);
+	if (ptr > kcp->buffer) {
+		ikcp_output(kcp, kcp->buffer, (int)(ptr - kcp->buffer));
+	}
+	kcp->flushing = 0;
+}
+
+
+//---------------------------------------------------------------------
+// path mtu discovery: one binary search step, the probe is sent from
+// kcp->buffer after the data, the peer answers with IKCP_CMD_PROBEACK
+//---------------------------------------------------------------------
+static void ikcp_pmtu_update(ikcpcb *kcp)
+{
+	IUINT32 current = kcp->current;
+	IKCPSEG seg;
+	char *ptr;
+
+	if (kcp->pmtu_state == IKCP_PMTU_PROBING) {
+		if (_itimediff(current, kcp->ts_pmtu) < 0)
+			return;
+		if (++kcp->pmtu_fails >= IKCP_PMTU_PROBES) {
+			kcp->pmtu_hi = kcp->pmtu_probe - 1;
+			kcp->pmtu_fails = 0;
+		}
+		kcp->pmtu_probe = 0;
+		kcp->pmtu_state = IKCP_PMTU_SEARCH;
+	} else if (kcp->pmtu_state == IKCP_PMTU_WAIT) {
+		if (_itimediff(current, kcp->ts_pmtu) < 0)
+			return;
+		// 上次的搜索已经结束, 再试一次上限
+		if (kcp->pmtu_hi < kcp->pmtu_lo + IKCP_PMTU_ACCURACY)
+			kcp->pmtu_hi = kcp->pmtu_max;
+		kcp->pmtu_state = IKCP_PMTU_SEARCH;
+	}
+
+	if (kcp->pmtu_hi < kcp->pmtu_lo + IKCP_PMTU_ACCURACY) {
+		kcp->pmtu_state = IKCP_PMTU_WAIT;
+		kcp->ts_pmtu = current + _ims(kcp, IKCP_PMTU_RAISE);
+		return;
+	}
+
+	seg.conv = kcp->conv;
+	seg.cmd = IKCP_CMD_PROBE;
+	seg.frg = 0;
+	seg.wnd = ikcp_wnd_adv(kcp);
+	seg.ts = current;
+	seg.sn = (kcp->pmtu_lo + kcp->pmtu_hi + 1) / 2;
+	seg.una = kcp->rcv_nxt;
+	seg.len = seg.sn - IKCP_OVERHEAD;
+	ptr = ikcp_encode_seg(kcp->buffer, &seg);
+	memset(ptr, 0, seg.len);
+	ikcp_output(kcp, kcp->buffer, (int)seg.sn);
+	kcp->stats.out_probes++;
+
+	kcp->pmtu_probe = seg.sn;
+	kcp->pmtu_state = IKCP_PMTU_PROBING;
+	kcp->ts_pmtu = current + _imax_((IUINT32)kcp->rx_rto, kcp->interval);
+}
+
+
+
+//---------------------------------------------------------------------
+// window autotuning, once per srtt: grow the windows to twice the
+// segments acked / delivered in the period, shrink them when idle
+//---------------------------------------------------------------------
+static void ikcp_tune(ikcpcb *kcp)
+{
+	IUINT32 current = kcp->current;
+	IUINT32 period = (kcp->rx_srtt > 0)? (IUINT32)kcp->rx_srtt : (IUINT32)kcp->rx_rto;
+	IUINT32 acked = kcp->snd_una - kcp->tune_una;
+	IUINT32 delivered = kcp->rcv_nxt - kcp->tune_rcv;
+	IUINT32 snd = kcp->snd_wnd;
+	IUINT32 rcv = kcp->rcv_wnd;
+	IUINT32 grow;
+
+	if (_itimediff(current, kcp->ts_tune) < (IINT32)_imax_(period, kcp->interval))
+		return;
+
+	if (acked > 0 || delivered > 0) {
+		kcp->ts_active = current;
+	}
+
+	if (kcp->tune_limited && acked * 2 > snd) {
+		snd = _imin_(acked * 2, kcp->tune_max);
+	}
+	if (delivered * 2 > rcv) {
+		rcv = _imin_(delivered * 2, kcp->tune_max);
+	}
+
+	// 空闲的连接不必占着大窗口, 还有数据在缓存里时不缩
+	if (_itimediff(current, kcp->ts_active) >= (IINT32)_ims(kcp, IKCP_TUNE_IDLE) &&
+		kcp->nsnd_buf == 0 && kcp->nrcv_buf == 0) {
+		snd = kcp->tune_snd_min;
+		rcv = kcp->tune_rcv_min;
+	}
+
+	// 增长部分受全局预算限制, 不够时两个窗口按比例少长一些
+	grow = (snd > kcp->snd_wnd ? snd - kcp->snd_wnd : 0) +
+		(rcv > kcp->rcv_wnd ? rcv - kcp->rcv_wnd : 0);
+	if (grow > 0 && ikcp_tune_budget > 0) {
+		IINT64 room = ikcp_tune_budget - ikcp_tune_used;
+		IINT64 need = (IINT64)grow * kcp->mss;
+		if (room < need) {
+			if (room < 0) room = 0;
+			if (snd > kcp->snd_wnd)
+				snd = kcp->snd_wnd + (IUINT32)((snd - kcp->snd_wnd) * room / need);
+			if (rcv > kcp->rcv_wnd)
+				rcv = kcp->rcv_wnd + (IUINT32)((rcv - kcp->rcv_wnd) * room / need);
+		}
+	}
+
+	kcp->snd_wnd = snd;
+	kcp->rcv_wnd = rcv;
+	ikcp_tune_charge(kcp, ((IINT64)snd + rcv) * kcp->mss);
+
+	kcp->ts_tune = current;
+	kcp->tune_una = kcp->snd_una;
+	kcp->tune_rcv = kcp->rcv_nxt;
+	kcp->tune_limited = 0;
+}
+
+
+//---------------------------------------------------------------------
+// graceful close, after the FIN went out: note its ack and end the
+// linger once both sides are done (or ikcp_close stopped waiting)
+//---------------------------------------------------------------------
+static void ikcp_close_update(ikcpcb *kcp)
+{
+	IUINT32 state = kcp->close_state;
+	IUINT32 current = kcp->current;
+
+	if (state & IKCP_CLOSE_DONE)
+		return;
+
+	if (!(state & IKCP_CLOSE_ACKED) && _itimediff(kcp->snd_una, kcp->fin_sn) > 0) {
+		state |= IKCP_CLOSE_ACKED;
+		// ikcp_close 之后最多再等对端的 FIN 一个逗留时间
+		if (kcp->close_full && !(state & IKCP_CLOSE_PEER))
+			kcp->ts_close = current + kcp->close_linger;
+	}
+
+	if ((state & IKCP_CLOSE_ACKED) && ((state & IKCP_CLOSE_PEER) || kcp->close_full) &&
+		_itimediff(current, kcp->ts_close) >= 0) {
+		state |= IKCP_CLOSE_DONE;
+	}
+
+	kcp->close_state = state;
+}
+
+
+//---------------------------------------------------------------------
+// ikcp_flush
+//---------------------------------------------------------------------
+void ikcp_flush(ikcpcb *kcp)
+{
+	IUINT32 current = kcp->current;
+	IUINT32 mtu = kcp->mtu - kcp->reserved;
+	IUINT32 limit = ikcp_ctrl_mtu(kcp);
+	char *buffer = kcp->buffer;
+	char *ptr = buffer;
+	int size;
+	IUINT32 resent, cwnd;
+	IUINT32 rtomin;
+	struct IQUEUEHEAD *p;
+	int change = 0;
+	int lost = 0;
+	int rack = 0;
+	int blackhole = 0;
+	IKCPSEG *probe = NULL;
+	IKCPSEG seg;
+
+	// 'ikcp_update' haven't been called.
+	if (kcp->updated == 0) {
+		return;
+	}
+
+	seg.conv = kcp->conv;
+	seg.cmd = IKCP_CMD_ACK;
+	seg.frg = 0;
+	seg.wnd = ikcp_wnd_adv(kcp);
+	seg.una = kcp->rcv_nxt;
+	seg.len = 0;
+	seg.sn = 0;
+	seg.ts = 0;
+
+	// flush acknowledges
+	kcp->flushing = 1;
+	ptr = ikcp_encode_acks(kcp, ptr, &seg);
+
+	// answer the last path mtu probe
+	if (kcp->pmtu_echo > 0) {
+		seg.cmd = IKCP_CMD_PROBEACK;
+		seg.sn = kcp->pmtu_echo;
+		seg.ts = kcp->pmtu_echo_ts;
+		size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)limit) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ptr = ikcp_encode_seg(ptr, &seg);
+		seg.sn = 0;
+		seg.ts = 0;
+		kcp->pmtu_echo = 0;
+	}
+
+	// probe window size (if remote window size equals zero)
+	if (kcp->rmt_wnd == 0) {
+		if (kcp->probe_wait == 0) {
+			kcp->probe_wait = _ims(kcp, IKCP_PROBE_INIT);
+			kcp->ts_probe = kcp->current + kcp->probe_wait;
+		} else {
+			if (_itimediff(kcp->current, kcp->ts_probe) >= 0) {
+				if (kcp->probe_wait < _ims(kcp, IKCP_PROBE_INIT))
+					kcp->probe_wait = _ims(kcp, IKCP_PROBE_INIT);
+				kcp->probe_wait += kcp->probe_wait / 2;
+				if (kcp->probe_wait > _ims(kcp, IKCP_PROBE_LIMIT))
+					kcp->probe_wait = _ims(kcp, IKCP_PROBE_LIMIT);
+				kcp->ts_probe = kcp->current + kcp->probe_wait;
+				kcp->probe |= IKCP_ASK_SEND;
+			}
+		}
+	} else {
+		kcp->ts_probe = 0;
+		kcp->probe_wait = 0;
+	}
+
+	// flush window probing commands
+	if (kcp->probe & IKCP_ASK_SEND) {
+		seg.cmd = IKCP_CMD_WASK;
+		kcp->stats.out_wasks++;
+		size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)limit) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ptr = ikcp_encode_seg(ptr, &seg);
+	}
+
+	// flush window probing commands
+	if (kcp->probe & IKCP_ASK_TELL) {
+		seg.cmd = IKCP_CMD_WINS;
+		kcp->stats.out_wins++;
+		size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)limit) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ptr = ikcp_encode_seg(ptr, &seg);
+	}
+
+	kcp->probe = 0;
+
+	// negotiate options, resent every rto until the peer answers
+	if (kcp->opt_tries < IKCP_OPT_TRIES && ikcp_opt_on(kcp)) {
+		IUINT32 state = kcp->opt_state;
+		if ((state & IKCP_OPT_REPLY) || ((state & IKCP_OPT_DONE) != IKCP_OPT_DONE &&
+			(kcp->opt_tries == 0 || _itimediff(current, kcp->ts_opt) >= 0))) {
+			seg.cmd = IKCP_CMD_WINS;
+			seg.len = IKCP_OPT_LEN;
+			kcp->stats.out_wins++;
+			size = (int)(ptr - buffer);
+			if (size + (int)(IKCP_OVERHEAD + IKCP_OPT_LEN) > (int)limit) {
+				ikcp_output(kcp, buffer, size);
+				ptr = buffer;
+			}
+			ptr = ikcp_encode_seg(ptr, &seg);
+			ptr = ikcp_encode8u(ptr, (unsigned char)(state & 15));
+			ptr = ikcp_encode32u(ptr, kcp->maxmsg);
+			ptr = ikcp_encode8u(ptr, (unsigned char)kcp->nstreams);
+			ptr = ikcp_encode8u(ptr, (unsigned char)kcp->wscale);
+			seg.len = 0;
+			kcp->opt_state &= ~IKCP_OPT_REPLY;
+			kcp->opt_tries++;
+			kcp->ts_opt = current + kcp->rx_rto;
+		}
+	}
+
+	// abandon expired partially reliable messages
+	if (kcp->npartial > 0) {
+		ikcp_expire(kcp);
+	}
+
+	// calculate window size
+	cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
+	if (kcp->nocwnd == 0)
+		cwnd = _imin_(kcp->cwnd, cwnd);
+
+	// move data from snd_queue to snd_buf
+	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
+		IKCPSEG *newseg;
+		int prio = ikcp_schedule(kcp);
+		if (prio < 0)
+			break;
+
+		newseg = iqueue_entry(ikcp_snd_queue(kcp, prio)->next, IKCPSEG, node);
+
+		iqueue_del(&newseg->node);
+		ikcp_schedule_lock(kcp, prio, newseg);
+		iqueue_add_tail(&newseg->node, &kcp->snd_buf);
+		kcp->nsnd_que--;
+		kcp->nsnd_buf++;
+
+		newseg->conv = kcp->conv;
+		newseg->wnd = seg.wnd;
+		newseg->ts = current;
+		newseg->sn = kcp->snd_nxt++;
+		newseg->una = kcp->rcv_nxt;
+		newseg->resendts = current;
+		newseg->rto = kcp->rx_rto;
+		newseg->fastack = 0;
+		newseg->xmit = 0;
+	}
+
+	// 数据都已移入 snd_buf 后, FIN 占用下一个 sn
+	if ((kcp->close_state & (IKCP_CLOSE_SENT | IKCP_CLOSE_FIN)) == IKCP_CLOSE_SENT &&
+		kcp->nsnd_que == 0 && _itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
+		IKCPSEG *fin = ikcp_segment_new(kcp, 0);
+		if (fin != NULL) {
+			fin->conv = kcp->conv;
+			fin->cmd = IKCP_CMD_PUSH;
+			fin->frg = IKCP_FRG_FIN;
+			fin->wnd = seg.wnd;
+			fin->ts = current;
+			fin->sn = kcp->snd_nxt++;
+			fin->una = kcp->rcv_nxt;
+			fin->len = 0;
+			fin->cap = 0;
+			fin->resendts = current;
+			fin->rto = kcp->rx_rto;
+			fin->fastack = 0;
+			fin->xmit = 0;
+			fin->prio = IKCP_PRIO_DEFAULT;
+			fin->ttl = 0;
+			fin->maxxmit = 0;
+			iqueue_add_tail(&fin->node, &kcp->snd_buf);
+			kcp->nsnd_buf++;
+			kcp->fin_sn = fin->sn;
+			kcp->ts_close = current;
+			kcp->close_state |= IKCP_CLOSE_FIN;
+		}
+	}
+
+	// 还有数据排队但在途已达 snd_wnd, 加大 snd_wnd 才能发得更快
+	if (kcp->nsnd_que > 0 && kcp->snd_nxt - kcp->snd_una >= kcp->snd_wnd) {
+		kcp->tune_limited = 1;
 	}
 
 	// calculate resent
 	resent = (kcp->fastresend > 0) ? (IUINT32)kcp->fastresend : 0xffffffff;
 	rtomin = (kcp->nodelay == 0) ? (kcp->rx_rto >> 3) : 0;
 
+	// tail loss probe: the last segment in flight is still unacked a
+	// probe timeout after it was sent, resend it before its RTO fires.
+	// the timeout is 2*srtt, or srtt plus a reorder window and the ack
+	// delay if shorter, since the RTO here is often below 2*srtt
+	if ((kcp->recovery & IKCP_RECOVERY_TLP) && kcp->tlp_out == 0 &&
+		kcp->rx_srtt > 0 && !iqueue_is_empty(&kcp->snd_buf)) {
+		IKCPSEG *tail = iqueue_entry(kcp->snd_buf.prev, IKCPSEG, node);
+		IUINT32 srtt = (IUINT32)kcp->rx_srtt;
+		IINT32 pto = (IINT32)_imin_(2 * srtt, srtt + srtt / 4 + kcp->interval);
+		if (tail->xmit > 0 && _itimediff(current, tail->ts) >= pto &&
+			_itimediff(tail->resendts, current) > 0) {
+			probe = tail;
+		}
+	}
+
 	// flush data segments
 	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
 		IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
@@ -1114,6 +3371,7 @@ void ikcp_flush(ikcpcb *kcp)
 		if (segment->xmit == 0) {
 			needsend = 1;
 			segment->xmit++;
+			segment->ts_orig = current;
 			segment->rto = kcp->rx_rto;
 			segment->resendts = current + segment->rto + rtomin;
 		} else if (_itimediff(current, segment->resendts) >= 0) {
@@ -1127,7 +3385,14 @@ void ikcp_flush(ikcpcb *kcp)
 				segment->rto += step / 2;
 			}
 			segment->resendts = current + segment->rto;
+			kcp->stats.retrans_rto++;
 			lost = 1;
+			// 比下限大、又没超过当前 mtu 的段一直超时, 可能是路径 MTU 变小了
+			if (kcp->pmtu_state != 0 && segment->xmit == IKCP_PMTU_BLACKHOLE &&
+				IKCP_OVERHEAD + segment->len > kcp->pmtu_base - kcp->reserved &&
+				IKCP_OVERHEAD + segment->len <= mtu) {
+				blackhole = 1;
+			}
 		} else if (segment->fastack >= resent) {
 			if ((int)segment->xmit <= kcp->fastlimit ||
 				kcp->fastlimit <= 0) {
@@ -1135,8 +3400,22 @@ void ikcp_flush(ikcpcb *kcp)
 				segment->xmit++;
 				segment->fastack = 0;
 				segment->resendts = current + segment->rto;
+				kcp->stats.retrans_fast++;
 				change++;
 			}
+		} else if ((kcp->recovery & IKCP_RECOVERY_RACK) &&
+				   ikcp_rack_lost(kcp, segment)) {
+			needsend = 1;
+			segment->xmit++;
+			segment->fastack = 0;
+			segment->resendts = current + segment->rto;
+			kcp->stats.retrans_rack++;
+			rack++;
+		} else if (segment == probe) {
+			needsend = 1;
+			segment->xmit++;
+			kcp->tlp_out = 1;
+			kcp->stats.retrans_tlp++;
 		}
 
 		if (needsend) {
@@ -1148,19 +3427,37 @@ void ikcp_flush(ikcpcb *kcp)
 			size = (int)(ptr - buffer);
 			need = IKCP_OVERHEAD + segment->len;
 
-			if (size + need > (int)kcp->mtu) {
-				ikcp_output(kcp, buffer, size);
-				ptr = buffer;
+			if (need > (int)mtu && kcp->pmtu_state != 0) {
+				// 按更大的 mtu 建立的段, 路径 MTU 变小后只能分片发送
+				ptr = ikcp_encode_parts(kcp, ptr, segment, mtu);
+			}	else {
+				if (size + need > (int)mtu) {
+					ikcp_output(kcp, buffer, size);
+					ptr = buffer;
+				}
+
+				ptr = ikcp_encode_seg(ptr, segment);
+
+				if (segment->len > 0) {
+					memcpy(ptr, segment->data, segment->len);
+					ptr += segment->len;
+				}
 			}
 
-			ptr = ikcp_encode_seg(ptr, segment);
+			kcp->stats.out_segs++;
+			kcp->stats.out_bytes += segment->len;
 
-			if (segment->len > 0) {
-				memcpy(ptr, segment->data, segment->len);
-				ptr += segment->len;
+			if (ikcp_canlog(kcp, IKCP_LOG_OUT_DATA)) {
+				ikcp_trace_push(kcp, IKCP_LOG_OUT_DATA, segment->sn,
+								segment->xmit, segment->rto);
+				ikcp_log(kcp, IKCP_LOG_OUT_DATA, "output psh: sn=%lu xmit=%lu rto=%lu",
+						 (unsigned long)segment->sn, (unsigned long)segment->xmit,
+						 (unsigned long)segment->rto);
 			}
 
 			if (segment->xmit >= kcp->dead_link) {
+				if (kcp->state != (IUINT32)-1)
+					kcp->stats.dead_links++;
 				kcp->state = (IUINT32)-1;
 			}
 		}
@@ -1172,6 +3469,22 @@ void ikcp_flush(ikcpcb *kcp)
 		ikcp_output(kcp, buffer, size);
 	}
 
+	if (kcp->pmtu_state != 0) {
+		if (blackhole)
+			ikcp_pmtu_blackhole(kcp);
+		ikcp_pmtu_update(kcp);
+	}
+
+	// 分组超过一个 interval 仍未凑满, 先发出校验包
+	if (kcp->fec && kcp->fec->snd_index > 0 &&
+		_itimediff(current, kcp->fec->snd_ts) >= (IINT32)kcp->interval) {
+		ikcp_fec_close_group(kcp);
+	}
+
+	if (change || rack || lost) {
+		ikcp_undo_save(kcp);
+	}
+
 	// update ssthresh
 	if (change) {
 		IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
@@ -1182,6 +3495,16 @@ void ikcp_flush(ikcpcb *kcp)
 		kcp->incr = kcp->cwnd * kcp->mss;
 	}
 
+	// RACK 判定的丢失和快速重传一样只减半窗口
+	if (rack && change == 0) {
+		IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+		kcp->ssthresh = inflight / 2;
+		if (kcp->ssthresh < IKCP_THRESH_MIN)
+			kcp->ssthresh = IKCP_THRESH_MIN;
+		kcp->cwnd = kcp->ssthresh;
+		kcp->incr = kcp->cwnd * kcp->mss;
+	}
+
 	if (lost) {
 		kcp->ssthresh = cwnd / 2;
 		if (kcp->ssthresh < IKCP_THRESH_MIN)
@@ -1194,6 +3517,16 @@ void ikcp_flush(ikcpcb *kcp)
 		kcp->cwnd = 1;
 		kcp->incr = kcp->mss;
 	}
+
+	kcp->flushing = 0;
+
+	if (kcp->tune_max > 0) {
+		ikcp_tune(kcp);
+	}
+
+	if (kcp->close_state & IKCP_CLOSE_FIN) {
+		ikcp_close_update(kcp);
+	}
 }
 
 
@@ -1205,6 +3538,7 @@ void ikcp_flush(ikcpcb *kcp)
 void ikcp_update(ikcpcb *kcp, IUINT32 current)
 {
 	IINT32 slap;
+	IINT32 limit = (IINT32)_ims(kcp, 10000);
 
 	kcp->current = current;
 
@@ -1215,7 +3549,7 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
 
 	slap = _itimediff(kcp->current, kcp->ts_flush);
 
-	if (slap >= 10000 || slap < -10000) {
+	if (slap >= limit || slap < -limit) {
 		kcp->ts_flush = kcp->current;
 		slap = 0;
 	}
@@ -1245,14 +3579,15 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 	IINT32 tm_flush = 0x7fffffff;
 	IINT32 tm_packet = 0x7fffffff;
 	IUINT32 minimal = 0;
+	IINT32 limit = (IINT32)_ims(kcp, 10000);
 	struct IQUEUEHEAD *p;
 
 	if (kcp->updated == 0) {
 		return current;
 	}
 
-	if (_itimediff(current, ts_flush) >= 10000 ||
-		_itimediff(current, ts_flush) < -10000) {
+	if (_itimediff(current, ts_flush) >= limit ||
+		_itimediff(current, ts_flush) < -limit) {
 		ts_flush = current;
 	}
 
@@ -1283,25 +3618,242 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 int ikcp_setmtu(ikcpcb *kcp, int mtu)
 {
 	char *buffer;
+	struct IKCPFEC *fec = NULL;
 	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD)
 		return -1;
-	buffer = (char *)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
+	// 路径 MTU 探测可能把 mtu 升到 pmtu_max, 缓冲区按大的分配
+	buffer = (char *)ikcp_malloc((_imax_(mtu, kcp->pmtu_max) + IKCP_OVERHEAD) * 3);
 	if (buffer == NULL)
 		return -2;
+	if (kcp->fec) {
+		// 分片缓冲区大小随 mtu 变化, 重新建立 FEC 状态
+		fec = ikcp_fec_new(kcp->fec->mode, kcp->fec->datashards,
+						   kcp->fec->parityshards, mtu);
+		if (fec == NULL) {
+			ikcp_free(buffer);
+			return -2;
+		}
+		ikcp_fec_free(kcp->fec);
+		kcp->fec = fec;
+	}
 	kcp->mtu = mtu;
-	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
+	kcp->mss = kcp->mtu - IKCP_OVERHEAD - kcp->reserved;
 	ikcp_free(kcp->buffer);
 	kcp->buffer = buffer;
 	return 0;
 }
 
+int ikcp_fec(ikcpcb *kcp, int mode, int datashards, int parityshards)
+{
+	struct IKCPFEC *fec = NULL;
+	if (mode == IKCP_FEC_XOR) {
+		parityshards = 1;
+	} else if (mode != IKCP_FEC_RS && mode != 0) {
+		return -1;
+	}
+	if (mode != 0) {
+		if (kcp->pmtu_state != 0)
+			return -1;
+		if (datashards < 1 || datashards > IKCP_FEC_MAX ||
+			parityshards < 1 || parityshards > IKCP_FEC_MAX)
+			return -1;
+		fec = ikcp_fec_new(mode, datashards, parityshards, (int)kcp->mtu);
+		if (fec == NULL)
+			return -2;
+	}
+	if (kcp->fec) {
+		ikcp_fec_free(kcp->fec);
+	}
+	kcp->fec = fec;
+	kcp->reserved = (fec != NULL) ? IKCP_FEC_OVERHEAD : 0;
+	kcp->mss = kcp->mtu - IKCP_OVERHEAD - kcp->reserved;
+	return 0;
+}
+
+int ikcp_recovery(ikcpcb *kcp, int flags)
+{
+	if (flags & ~(IKCP_RECOVERY_RACK | IKCP_RECOVERY_TLP))
+		return -1;
+	kcp->recovery = (IUINT32)flags;
+	kcp->rack_rtt = 0;
+	kcp->tlp_out = 0;
+	return 0;
+}
+
+int ikcp_rtomode(ikcpcb *kcp, int flags, int percentile)
+{
+	if (flags & ~(IKCP_RTO_KARN | IKCP_RTO_MINRTT | IKCP_RTO_PERCENTILE))
+		return -1;
+	if ((flags & IKCP_RTO_PERCENTILE) && (percentile < 50 || percentile > 100))
+		return -1;
+	if ((flags & IKCP_RTO_PERCENTILE) && kcp->rtt_recent == NULL) {
+		kcp->rtt_recent = (IUINT32*)ikcp_malloc(sizeof(IUINT32) * IKCP_RTT_RECENT);
+		if (kcp->rtt_recent == NULL)
+			return -2;
+		kcp->rtt_count = 0;
+	}
+	if ((flags & IKCP_RTO_PERCENTILE) == 0 && kcp->rtt_recent) {
+		ikcp_free(kcp->rtt_recent);
+		kcp->rtt_recent = NULL;
+		kcp->rtt_count = 0;
+	}
+	kcp->rtomode = (IUINT32)flags;
+	if (flags & IKCP_RTO_PERCENTILE)
+		kcp->rto_pct = (IUINT32)percentile;
+	if (kcp->rx_srtt > 0)
+		ikcp_update_rto(kcp);
+	return 0;
+}
+
+int ikcp_ack_nodelay(ikcpcb *kcp, int enable)
+{
+	kcp->ack_nodelay = enable ? 1 : 0;
+	return 0;
+}
+
+int ikcp_wndscale(ikcpcb *kcp, int shift)
+{
+	if (shift < 0 || shift > (int)IKCP_WSCALE_MAX)
+		return -1;
+	// 协商开始后不能再改, 对端已经按原来的位数解码
+	if (kcp->opt_state != 0 && (IUINT32)shift != kcp->wscale)
+		return -2;
+	kcp->wscale = (IUINT32)shift;
+	kcp->opt_tries = 0;
+	return 0;
+}
+
+int ikcp_rcvbuf(ikcpcb *kcp, int bytes)
+{
+	IUINT32 least = IKCP_WND_RCV * (sizeof(IKCPSEG) + kcp->mss);
+	if (bytes < 0)
+		return -1;
+	kcp->rcv_bytes = (bytes == 0)? 0 : _imax_((IUINT32)bytes, least);
+	return 0;
+}
+
+int ikcp_autotune(ikcpcb *kcp, int maxwnd)
+{
+	if (maxwnd < 0)
+		return -1;
+	if (maxwnd == 0) {
+		if (kcp->tune_max > 0) {
+			kcp->snd_wnd = kcp->tune_snd_min;
+			kcp->rcv_wnd = kcp->tune_rcv_min;
+			ikcp_tune_charge(kcp, 0);
+		}
+		kcp->tune_max = 0;
+		return 0;
+	}
+	if (kcp->tune_max == 0) {
+		kcp->tune_snd_min = kcp->snd_wnd;
+		kcp->tune_rcv_min = kcp->rcv_wnd;
+		kcp->ts_tune = kcp->current;
+		kcp->ts_active = kcp->current;
+		kcp->tune_una = kcp->snd_una;
+		kcp->tune_rcv = kcp->rcv_nxt;
+		kcp->tune_limited = 0;
+	}
+	kcp->tune_max = _imax_((IUINT32)maxwnd,
+		_imax_(kcp->tune_snd_min, kcp->tune_rcv_min));
+	return 0;
+}
+
+void ikcp_autotune_budget(IINT64 bytes)
+{
+	ikcp_tune_budget = (bytes > 0)? bytes : 0;
+}
+
+IINT64 ikcp_autotune_used(void)
+{
+	return ikcp_tune_used;
+}
+
+int ikcp_pmtud(ikcpcb *kcp, int minmtu, int maxmtu)
+{
+	int hr;
+	if (maxmtu == 0) {
+		kcp->pmtu_state = 0;
+		kcp->pmtu_max = 0;
+		kcp->pmtu_probe = 0;
+		return 0;
+	}
+	if (kcp->fec || minmtu < 50 || maxmtu < minmtu || maxmtu > 0xffff)
+		return -1;
+	kcp->pmtu_max = (IUINT32)maxmtu;
+	hr = ikcp_setmtu(kcp, minmtu);
+	if (hr < 0) {
+		kcp->pmtu_max = 0;
+		return hr;
+	}
+	kcp->pmtu_base = (IUINT32)minmtu;
+	kcp->pmtu_lo = (IUINT32)minmtu;
+	kcp->pmtu_hi = (IUINT32)maxmtu;
+	kcp->pmtu_probe = 0;
+	kcp->pmtu_fails = 0;
+	kcp->pmtu_state = IKCP_PMTU_SEARCH;
+	return 0;
+}
+
+int ikcp_shutdown(ikcpcb *kcp)
+{
+	if (kcp->close_state & IKCP_CLOSE_SENT)
+		return -1;
+	kcp->close_state |= IKCP_CLOSE_SENT;
+	if (kcp->close_full == 0)
+		kcp->close_linger = _ims(kcp, IKCP_CLOSE_LINGER);
+	// 塞住的合并段也要发出, FIN 排在它后面
+	kcp->cork = 0;
+	return 0;
+}
+
+int ikcp_close(ikcpcb *kcp, int linger)
+{
+	if (kcp->close_full)
+		return -1;
+	kcp->close_full = 1;
+	kcp->close_linger = (linger < 0) ? _ims(kcp, IKCP_CLOSE_LINGER) : (IUINT32)linger;
+	if ((kcp->close_state & (IKCP_CLOSE_ACKED | IKCP_CLOSE_PEER)) == IKCP_CLOSE_ACKED)
+		kcp->ts_close = kcp->current + kcp->close_linger;
+	ikcp_shutdown(kcp);
+	return 0;
+}
+
+int ikcp_closestate(const ikcpcb *kcp)
+{
+	return (int)(kcp->close_state & 15);
+}
+
 int ikcp_interval(ikcpcb *kcp, int interval)
 {
-	if (interval > 5000)
-		interval = 5000;
-	else if (interval < 10)
-		interval = 10;
-	kcp->interval = interval;
+	kcp->interval = ikcp_bound_interval(kcp, interval);
+	return 0;
+}
+
+int ikcp_timebase(ikcpcb *kcp, int unit)
+{
+	IUINT32 tick = (IUINT32)unit;
+	IUINT32 old = kcp->tick;
+	if (unit != IKCP_TIME_MS && unit != IKCP_TIME_US)
+		return -1;
+	if (tick == old)
+		return 0;
+	// 已有的时间量按新旧时基比例换算, 时间戳本身由下一次 ikcp_update 重新同步
+#define IKCP_RESCALE(x) ((x) = (tick > old) ? (x) * (tick / old) : (x) / (old / tick))
+	IKCP_RESCALE(kcp->interval);
+	IKCP_RESCALE(kcp->rx_rto);
+	IKCP_RESCALE(kcp->rx_minrto);
+	IKCP_RESCALE(kcp->rx_srtt);
+	IKCP_RESCALE(kcp->rx_rttval);
+	IKCP_RESCALE(kcp->probe_wait);
+	IKCP_RESCALE(kcp->rack_rtt);
+	IKCP_RESCALE(kcp->minrtt);
+#undef IKCP_RESCALE
+	kcp->tick = tick;
+	kcp->rtt_count = 0;
+	kcp->interval = ikcp_bound_interval(kcp, kcp->interval);
+	kcp->updated = 0;
+	kcp->ts_probe = 0;
 	return 0;
 }
 
@@ -1310,17 +3862,13 @@ int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
 	if (nodelay >= 0) {
 		kcp->nodelay = nodelay;
 		if (nodelay) {
-			kcp->rx_minrto = IKCP_RTO_NDL;
+			kcp->rx_minrto = _ims(kcp, IKCP_RTO_NDL);
 		} else {
-			kcp->rx_minrto = IKCP_RTO_MIN;
+			kcp->rx_minrto = _ims(kcp, IKCP_RTO_MIN);
 		}
 	}
 	if (interval >= 0) {
-		if (interval > 5000)
-			interval = 5000;
-		else if (interval < 10)
-			interval = 10;
-		kcp->interval = interval;
+		kcp->interval = ikcp_bound_interval(kcp, interval);
 	}
 	if (resend >= 0) {
 		kcp->fastresend = resend;
@@ -1332,6 +3880,218 @@ int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
 }
 
 
+int ikcp_streams(ikcpcb *kcp, int count)
+{
+	struct IKCPSTREAM **streams = NULL;
+	int i;
+	if (count < 0 || count > IKCP_STREAM_MAX)
+		return -1;
+	if (count > 0) {
+		streams = (struct IKCPSTREAM **)ikcp_malloc(sizeof(streams[0]) * (count + 1));
+		if (streams == NULL)
+			return -2;
+		for (i = 0; i <= count; i++) {
+			streams[i] = (i <= (int)kcp->nstreams && i > 0) ? kcp->streams[i] : NULL;
+		}
+	}
+	for (i = count + 1; i <= (int)kcp->nstreams; i++) {
+		if (kcp->streams[i]) {
+			ikcp_stream_free(kcp, kcp->streams[i]);
+		}
+	}
+	if (kcp->streams) {
+		ikcp_free(kcp->streams);
+	}
+	kcp->streams = streams;
+	if ((IUINT32)count != kcp->nstreams) {
+		ikcp_opt_changed(kcp);
+	}
+	kcp->nstreams = (IUINT32)count;
+	return 0;
+}
+
+int ikcp_send_stream(ikcpcb *kcp, int sid, const char *buffer, int len)
+{
+	struct IKCPSTREAM *st;
+	int mss = (int)kcp->mss - (int)IKCP_STREAM_OVERHEAD;
+	int count, i, sent = 0;
+
+	if (sid == 0)
+		return ikcp_send(kcp, buffer, len);
+
+	st = ikcp_stream_get(kcp, sid);
+	if (st == NULL || len < 0 || mss <= 0)
+		return -1;
+	if (kcp->close_state & IKCP_CLOSE_SENT)
+		return -4;
+	// 对端在协商中通告了这个流之后才能发送, 否则它不会确认这些段
+	if (sid > (int)kcp->rmt_nstreams)
+		return -5;
+
+	count = (len <= mss) ? 1 : (len + mss - 1) / mss;
+	if (count >= (int)IKCP_WND_RCV)
+		return -2;
+
+	for (i = 0; i < count; i++) {
+		int size = len > mss ? mss : len;
+		IKCPSEG *seg = ikcp_segment_new(kcp, size + IKCP_STREAM_OVERHEAD);
+		char *ptr;
+		if (seg == NULL) {
+			return -2;
+		}
+		ptr = ikcp_encode8u(seg->data, (unsigned char)sid);
+		ptr = ikcp_encode8u(ptr, (unsigned char)(count - i - 1));
+		ptr = ikcp_encode32u(ptr, st->snd_nxt++);
+		if (buffer && size > 0) {
+			memcpy(ptr, buffer, size);
+			buffer += size;
+		}
+		seg->len = size + IKCP_STREAM_OVERHEAD;
+		seg->cap = seg->len;
+		seg->frg = IKCP_FRG_STREAM;
+		ikcp_snd_push(kcp, IKCP_PRIO_DEFAULT, seg);
+		len -= size;
+		sent += size;
+	}
+
+	return sent;
+}
+
+int ikcp_peeksize_stream(const ikcpcb *kcp, int sid)
+{
+	const struct IKCPSTREAM *st;
+	struct IQUEUEHEAD *p;
+	IKCPSEG *seg;
+	int length = 0;
+
+	if (sid == 0)
+		return ikcp_peeksize(kcp);
+	if (sid < 1 || sid > (int)kcp->nstreams || kcp->streams[sid] == NULL)
+		return -1;
+
+	st = kcp->streams[sid];
+	if (iqueue_is_empty(&st->rcv_queue))
+		return -1;
+
+	seg = iqueue_entry(st->rcv_queue.next, IKCPSEG, node);
+	if (seg->frg == 0)
+		return seg->len;
+
+	if (st->nrcv_que < seg->frg + 1)
+		return -1;
+
+	for (p = st->rcv_queue.next; p != &st->rcv_queue; p = p->next) {
+		seg = iqueue_entry(p, IKCPSEG, node);
+		length += seg->len;
+		if (seg->frg == 0)
+			break;
+	}
+
+	return length;
+}
+
+int ikcp_recv_stream(ikcpcb *kcp, int sid, char *buffer, int len)
+{
+	struct IKCPSTREAM *st;
+	struct IQUEUEHEAD *p;
+	int ispeek = (len < 0) ? 1 : 0;
+	int peeksize;
+	int recover = 0;
+
+	if (sid == 0)
+		return ikcp_recv(kcp, buffer, len);
+	if (sid < 1 || sid > (int)kcp->nstreams || kcp->streams[sid] == NULL)
+		return -1;
+
+	st = kcp->streams[sid];
+	if (iqueue_is_empty(&st->rcv_queue))
+		return (kcp->close_state & IKCP_CLOSE_PEER) ? -4 : -1;
+
+	if (len < 0)
+		len = -len;
+
+	peeksize = ikcp_peeksize_stream(kcp, sid);
+
+	if (peeksize < 0)
+		return -2;
+
+	if (peeksize > len)
+		return -3;
+
+	if (ikcp_wnd_adv(kcp) == 0)
+		recover = 1;
+
+	// merge fragment
+	for (len = 0, p = st->rcv_queue.next; p != &st->rcv_queue;) {
+		int fragment;
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		p = p->next;
+
+		if (buffer) {
+			memcpy(buffer, seg->data, seg->len);
+			buffer += seg->len;
+		}
+
+		len += seg->len;
+		fragment = seg->frg;
+
+		if (ispeek == 0) {
+			iqueue_del(&seg->node);
+			ikcp_rcv_delete(kcp, seg);
+			st->nrcv_que--;
+			kcp->nrcv_stream--;
+		}
+
+		if (fragment == 0)
+			break;
+	}
+
+	assert(len == peeksize);
+
+	// fast recover
+	if (recover && ikcp_wnd_adv(kcp) > 0) {
+		kcp->probe |= IKCP_ASK_TELL;
+	}
+
+	return len;
+}
+
+int ikcp_setmaxmsg(ikcpcb *kcp, int maxmsg)
+{
+	if (maxmsg < 0)
+		return -1;
+	if ((IUINT32)maxmsg != kcp->maxmsg) {
+		ikcp_opt_changed(kcp);
+	}
+	kcp->maxmsg = (IUINT32)maxmsg;
+	if (maxmsg == 0 && kcp->rcv_msg) {
+		ikcp_drop_msg(kcp);
+	}
+	return 0;
+}
+
+int ikcp_coalesce(ikcpcb *kcp, int enable, int maxdelay)
+{
+	if (maxdelay < 0)
+		return -1;
+	kcp->coalesce = enable ? 1 : 0;
+	kcp->cork_delay = (IUINT32)maxdelay;
+	return 0;
+}
+
+void ikcp_cork(ikcpcb *kcp, int cork)
+{
+	int i;
+	kcp->cork = cork ? 1 : 0;
+	if (cork) {
+		for (i = 0; i < IKCP_PRIO_COUNT; i++) {
+			ikcp_cork_arm(kcp, ikcp_snd_queue(kcp, i));
+		}
+	}	else if (kcp->nsnd_que > 0) {
+		ikcp_flush(kcp);
+	}
+}
+
 int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd)
 {
 	if (kcp) {
@@ -1341,6 +4101,12 @@ int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd)
 		if (rcvwnd > 0) { // must >= max fragment size
 			kcp->rcv_wnd = _imax_(rcvwnd, IKCP_WND_RCV);
 		}
+		// 自动调整时设置的是下限
+		if (kcp->tune_max > 0) {
+			kcp->tune_snd_min = kcp->snd_wnd;
+			kcp->tune_rcv_min = kcp->rcv_wnd;
+			kcp->tune_max = _imax_(kcp->tune_max, _imax_(kcp->snd_wnd, kcp->rcv_wnd));
+		}
 	}
 	return 0;
 }
@@ -1350,6 +4116,83 @@ int ikcp_waitsnd(const ikcpcb *kcp)
 	return kcp->nsnd_buf + kcp->nsnd_que;
 }
 
+int ikcp_waitsnd_prio(const ikcpcb *kcp, int prio)
+{
+	if (prio < 0 || prio >= IKCP_PRIO_COUNT)
+		return -1;
+	return (int)kcp->nsnd_prio[prio];
+}
+
+int ikcp_scheduler(ikcpcb *kcp, const int *weights)
+{
+	int i;
+	for (i = 0; weights && i < IKCP_PRIO_COUNT; i++) {
+		if (weights[i] < 1)
+			return -1;
+	}
+	for (i = 0; i < IKCP_PRIO_COUNT; i++) {
+		kcp->snd_weight[i] = weights ? (IUINT32)weights[i] : 0;
+	}
+	kcp->snd_rr = 0;
+	kcp->snd_credit = (IINT32)kcp->snd_weight[0];
+	return 0;
+}
+
+
+int ikcp_trace(ikcpcb *kcp, int capacity)
+{
+	struct IKCPTRACE *trace = NULL;
+	IUINT32 size = 1;
+	if (capacity > 0) {
+		while (size < (IUINT32)capacity)
+			size <<= 1;
+		trace = (struct IKCPTRACE *)ikcp_malloc(size * sizeof(struct IKCPTRACE));
+		if (trace == NULL)
+			return -2;
+	}
+	if (kcp->trace) {
+		ikcp_free(kcp->trace);
+	}
+	kcp->trace = trace;
+	kcp->trace_mask = size - 1;
+	kcp->trace_wpos = 0;
+	kcp->trace_rpos = 0;
+	return 0;
+}
+
+int ikcp_trace_read(ikcpcb *kcp, char *buffer, int len)
+{
+	char *ptr = buffer;
+	if (kcp->trace == NULL)
+		return 0;
+	// 写入超过一圈时, 被覆盖的旧记录直接跳过
+	if (kcp->trace_wpos - kcp->trace_rpos > kcp->trace_mask + 1)
+		kcp->trace_rpos = kcp->trace_wpos - (kcp->trace_mask + 1);
+	while (kcp->trace_rpos != kcp->trace_wpos && len >= (int)IKCP_TRACE_SIZE) {
+		const struct IKCPTRACE *rec = &kcp->trace[kcp->trace_rpos & kcp->trace_mask];
+		ptr = ikcp_encode32u(ptr, rec->ts);
+		ptr = ikcp_encode32u(ptr, rec->event);
+		ptr = ikcp_encode32u(ptr, rec->arg[0]);
+		ptr = ikcp_encode32u(ptr, rec->arg[1]);
+		ptr = ikcp_encode32u(ptr, rec->arg[2]);
+		len -= IKCP_TRACE_SIZE;
+		kcp->trace_rpos++;
+	}
+	return (int)(ptr - buffer);
+}
+
+void ikcp_get_stats(const ikcpcb *kcp, ikcpstats *stats)
+{
+	*stats = kcp->stats;
+	stats->srtt = kcp->rx_srtt;
+	stats->rttvar = kcp->rx_rttval;
+	stats->rto = kcp->rx_rto;
+	stats->cwnd = kcp->cwnd;
+	stats->ssthresh = kcp->ssthresh;
+	stats->minrtt = kcp->minrtt;
+	stats->mtu = kcp->mtu;
+}
+
 
 // read conv
 IUINT32 ikcp_getconv(const void *ptr)
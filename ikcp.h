@@ -301,20 +301,94 @@ struct IKCPSEG {
 	IUINT32 rto; // Retransmission Timeout, 下次超时重传的间隔时间, 会随着超时次数增加, 增加速率取决于是不是快速模式
 	IUINT32 fastack; // 数据包被跳过次数, 快速重传功能需要
 	IUINT32 xmit; // 该数据包发送次数, transmit 的缩写, ,次数太多判断网络断开
+	IUINT32 prio; // 发送优先级
+	IUINT32 ttl; // 部分可靠消息的存活时间, 0 表示一直重传到确认为止
+	IUINT32 deadline; // 部分可靠消息的过期时间, ttl 为 0 时无效
+	IUINT32 maxxmit; // 部分可靠消息的最多发送次数, 0 表示不限
+	IUINT32 ts_orig; // 首次发送的时间, ACK 回显它说明重传是多余的
+	IUINT32 cap; // data 的容量, 流模式下 snd_queue 的尾段按 mss 分配, 后续写入原地追加
 	/*-----------------以上成员不会实际发送到网络中，主要是超时重传和快速重传计算的辅助数据-----------------*/
 
 	char data[1]; // 数据包携带的数据，大小根据ikcp_segment_new的参数决定
 };
 
+//---------------------------------------------------------------------
+// IKCPSTATS
+// 连接统计, 计数器只做自增, 热路径上没有格式化开销
+//---------------------------------------------------------------------
+#define IKCP_RTT_BUCKETS 16 // rtt 直方图桶数, 第 k 个桶统计 [2^(k-1), 2^k) 个时钟单位
+
+struct IKCPSTATS {
+	IUINT64 out_pkts; // 输出的下层数据包数
+	IUINT64 out_segs; // 发送的数据段数(含重传)
+	IUINT64 out_bytes; // 发送的数据段负载字节数(含重传)
+	IUINT64 in_pkts; // 输入的下层数据包数
+	IUINT64 in_segs; // 收到的数据段数
+	IUINT64 in_bytes; // 收到的数据段负载字节数
+	IUINT64 retrans_rto; // 超时重传的数据段数
+	IUINT64 retrans_fast; // 快速重传的数据段数
+	IUINT64 in_dups; // 收到的重复数据段数
+	IUINT64 in_drops; // 超出接收窗口被丢弃的数据段数
+	IUINT64 out_acks; // 发送的 ACK 数
+	IUINT64 in_acks; // 收到的 ACK 数
+	IUINT64 out_wasks; // 发送的窗口探测(WASK)数
+	IUINT64 out_wins; // 发送的窗口通告(WINS)数
+	IUINT64 dead_links; // 进入 deadlink 状态的次数
+	IUINT64 retrans_rack; // RACK 判定丢失后重传的数据段数
+	IUINT64 retrans_tlp; // 尾部探测重传的数据段数
+	IUINT64 spurious; // 事后发现多余的重传次数(原始发送的段先到达)
+	IUINT64 undos; // 因重传多余而撤销拥塞窗口缩小的次数
+	IUINT64 rtt_ambiguous; // 来自重传过的段(或已确认的段)的 rtt 采样数
+	IUINT64 out_skips; // 过期后改为 SKIP 的在途数据段数
+	IUINT64 out_expired; // 过期后直接丢弃的未发送数据段数
+	IUINT64 in_skips; // 因对端放弃而跳过的数据段数
+	IUINT64 out_probes; // 发送的路径 MTU 探测包数
+	IUINT64 pmtu_blackholes; // 发现黑洞退回探测下限的次数
+	IUINT64 out_parts; // 超过当前 mtu 而分片发送的数据段数
+
+	// 以下为 ikcp_get_stats 调用时的瞬时值
+	IINT32 srtt;
+	IINT32 rttvar;
+	IINT32 rto;
+	IUINT32 cwnd;
+	IUINT32 ssthresh;
+	IUINT32 minrtt; // 窗口内的最小 rtt, 0 表示还没有采样
+	IUINT32 mtu; // 当前 mtu, 路径 MTU 探测会改变它
+
+	IUINT64 rtt_hist[IKCP_RTT_BUCKETS]; // rtt 采样直方图
+};
+
+typedef struct IKCPSTATS ikcpstats;
+
+//---------------------------------------------------------------------
+// IKCPTRACE
+// 二进制跟踪记录, 由 ikcp_trace_read 按小端 20 字节导出, 离线解码
+//---------------------------------------------------------------------
+#define IKCP_TRACE_SIZE 20 // 一条导出记录的字节数
+
+struct IKCPTRACE {
+	IUINT32 ts; // 事件发生时的 kcp->current
+	IUINT32 event; // 事件 id, 取值同 IKCP_LOG_* 掩码
+	IUINT32 arg[3]; // 事件参数, 含义见 example/trace_decode
+};
+
 //---------------------------------------------------------------------
 // IKCPCB
 // 一个 IKCPCB 对应一个 KCP 连接
 //---------------------------------------------------------------------
 
+struct IKCPFEC;
+struct IKCPSTREAM;
+
+// send priority classes, 0 is the most urgent
+#define IKCP_PRIO_COUNT 4
+#define IKCP_PRIO_DEFAULT 1 // used by ikcp_send and ikcp_send_stream
+
 struct IKCPCB {
 	IUINT32 conv; // 会话ID
 	IUINT32 mtu; // 最大传输单元(字节)
-	IUINT32 mss; // 一个KCP传输单元的"数据部分"最大长度(字节), mss + kcp head = mtu
+	IUINT32 mss; // 一个KCP传输单元的"数据部分"最大长度(字节), mss + kcp head + reserved = mtu
+	IUINT32 reserved; // 每个下层数据包为封装层(FEC 头)预留的字节数
 	IUINT32 state; // 连接状态 (-1时表示deadlink)
 
 	IUINT32 snd_una; // (send unacknowledged), 已经发送但未被确认的包的下一个序列号
@@ -336,8 +410,9 @@ struct IKCPCB {
 	IUINT32 cwnd; // congestion window size, 拥塞窗口大小
 	IUINT32 probe; // probe window size, 探测窗口大小
 
-	IUINT32 current; // 当前时间戳
+	IUINT32 current; // 当前时间戳 (单位由 tick 决定)
 	IUINT32 interval; // 内部flush刷新间隔
+	IUINT32 tick; // 时间基准: 每毫秒的时钟单位数, 1 为毫秒(默认), 1000 为微秒
 	IUINT32 ts_flush; // 下一次刷新输出的时间戳
 	IUINT32 xmit; // 该KCP连接超时重传次数
 
@@ -352,7 +427,14 @@ struct IKCPCB {
 	IUINT32 probe_wait; // 探测窗口大小的间隔时间，每次探测对面窗口为0（失败）, 探测时间*1.5
 	IUINT32 dead_link; // 断开连接的重传次数阈值
 	IUINT32 incr; // k*mss , 拥塞窗口等于floor(k)
-	struct IQUEUEHEAD snd_queue; // 发送队列
+	struct IQUEUEHEAD snd_queue; // 发送队列, 默认优先级 IKCP_PRIO_DEFAULT
+	struct IQUEUEHEAD snd_prio[IKCP_PRIO_COUNT]; // 其他优先级的发送队列, 默认优先级的一项不用
+	IUINT32 nsnd_prio[IKCP_PRIO_COUNT]; // 各优先级排队和在途的数据段数
+	IUINT32 snd_weight[IKCP_PRIO_COUNT]; // 加权调度时各优先级每轮的段数, 全 0 为严格优先级
+	IUINT32 snd_rr; // 加权调度当前轮到的优先级
+	IINT32 snd_credit; // 当前优先级本轮剩余的段数
+	IUINT32 snd_lock; // 多段消息未移完时锁定的优先级 + 1, 保证分片在 sn 上连续
+	IUINT32 npartial; // 发送队列和 snd_buf 中尚未过期的部分可靠数据段数
 	struct IQUEUEHEAD rcv_queue; // 接收队列
 	struct IQUEUEHEAD snd_buf; // 发送缓存, 还没收到 ACK 的包都在这里边
 	struct IQUEUEHEAD rcv_buf; // 接收缓存, 将收到的数据暂存, 然后将其中连续的数据放到rcv_queue供上层读取
@@ -364,15 +446,114 @@ struct IKCPCB {
 	char *buffer; // 数据缓冲区
 	int fastresend; // 快速重传的失序阈值, 发送方收到 fastresend 个冗余ACK就触发快速重传
 	int fastlimit; // 快速重传的次数限制
+	IUINT32 recovery; // 基于时间的丢包检测, IKCP_RECOVERY_* 的组合
+	IUINT32 rack_ts; // 已确认的段中最近一次发送的时间
+	IUINT32 rack_sn; // 上述段的 sn, 同一时间发送的段按 sn 区分先后
+	IUINT32 rack_rtt; // 上述段的 rtt, 0 表示还没有确认过任何段
+	IUINT32 tlp_out; // 尾部探测已经发出, 收到 ACK 之前不再探测
+	IUINT32 undo_cwnd; // 本轮丢包恢复前的 cwnd, 重传被证明多余时恢复
+	IUINT32 undo_ssthresh; // 本轮丢包恢复前的 ssthresh
+	IUINT32 undo_incr; // 本轮丢包恢复前的 incr
+	IUINT32 undo_sn; // 本轮恢复开始时的 snd_nxt, snd_una 越过它即结束
+	IUINT32 undo_valid; // 1: 可以撤销, 有重传被证明确实必要后置 0
+	IUINT32 rtomode; // RTO 估计方式, IKCP_RTO_* 的组合
+	IUINT32 rto_pct; // IKCP_RTO_PERCENTILE 使用的百分位
+	IUINT32 minrtt; // 最近 IKCP_MINRTT_WIN 内的最小 rtt, 0 表示还没有采样
+	IUINT32 ts_minrtt; // minrtt 的采样时间
+	IUINT32 *rtt_recent; // 最近 IKCP_RTT_RECENT 个 rtt 采样的环, 按需分配
+	IUINT32 rtt_count; // 写入 rtt_recent 的采样总数
+	IUINT32 ack_nodelay; // ikcp_input 处理完一个包后立即发出 ACK
+	IUINT32 flushing; // 正在 ikcp_flush 中使用 buffer, 期间不单独发送 ACK
+	IUINT32 wscale; // 本端通告窗口的缩放位数, 0 表示不协商
+	IUINT32 rmt_wscale; // 对端通告窗口的缩放位数
+	IUINT32 rcv_bytes; // 按字节计的接收窗口, 0 表示只按段数计
+	IUINT32 rcv_held; // 接收端持有的段占用的内存(含段头), 用于按字节计的窗口
+	IUINT32 tune_max; // 自动调整窗口的上限(段数), 0 表示关闭
+	IUINT32 tune_snd_min; // 自动调整时 snd_wnd 的下限, 空闲时缩回这里
+	IUINT32 tune_rcv_min; // 自动调整时 rcv_wnd 的下限
+	IUINT32 ts_tune; // 当前测量周期的开始时间
+	IUINT32 tune_una; // 周期开始时的 snd_una
+	IUINT32 tune_rcv; // 周期开始时的 rcv_nxt
+	IUINT32 tune_limited; // 本周期内发送受 snd_wnd 限制
+	IUINT32 ts_active; // 最近一次有数据被确认或交付的时间
+	IINT64 tune_bytes; // 本连接计入全局预算的字节数
+	IUINT32 pmtu_state; // 路径 MTU 探测的状态, 0 表示关闭
+	IUINT32 pmtu_base; // 探测的下限, 认为一定能通过, 发现黑洞时退回这里
+	IUINT32 pmtu_max; // 探测的上限
+	IUINT32 pmtu_lo; // 已确认能通过的最大 MTU
+	IUINT32 pmtu_hi; // 还没有被排除的最大 MTU
+	IUINT32 pmtu_probe; // 在途探测包的大小
+	IUINT32 pmtu_fails; // 当前大小连续没有回应的探测次数
+	IUINT32 ts_pmtu; // 探测超时或者下一次搜索的时间
+	IUINT32 pmtu_echo; // 收到的探测包大小, 下次 flush 回复, 0 表示没有
+	IUINT32 pmtu_echo_ts; // 上述探测包的发送时间, 原样带回
+	struct IQUEUEHEAD rcv_part; // 正在重组的分片重传段, 见 IKCP_CMD_PART
+	IUINT32 nrcv_part; // rcv_part 的长度
+	IUINT32 close_state; // 关闭状态, IKCP_CLOSE_* 的组合, 0 表示没有关闭
+	IUINT32 close_full; // 调用了 ikcp_close, 对端不关闭时逗留结束也算关闭
+	IUINT32 close_linger; // 关闭后的逗留时间(时钟单位)
+	IUINT32 fin_sn; // 本端 FIN 段的 sn
+	IUINT32 ts_close; // 逗留结束的时间
 	int nocwnd; // 0: 有拥塞控制, 1: 没有拥塞控制
 	int stream; // 流模式
+	IUINT32 maxmsg; // 大消息模式下单条消息的最大字节数, 0 表示关闭
+	struct IKCPSEG *rcv_msg; // 正在重组的大消息, 已收到的数据按顺序追加
+	IUINT32 rcv_msglen; // 正在重组的大消息的总长度
+	IUINT32 rcv_msgcap; // rcv_msg 已分配的容量, 随数据到达倍增到总长度
+	IUINT32 rmt_maxmsg; // 对端在协商中通告的大消息上限, 0 表示对端不接收大消息或还没有通告
+	IUINT32 opt_state; // 参数协商的进度, IKCP_OPT_* 的组合
+	IUINT32 opt_tries; // 没有收到回应的协商次数
+	IUINT32 ts_opt; // 下一次发送协商的时间戳
+	IUINT32 coalesce; // 是否把小消息合并到同一个数据段中发送
+	IUINT32 cork; // 塞住: 未装满的合并段留在 snd_queue 中等待更多消息
+	IUINT32 cork_delay; // 塞住时合并段最长的等待时间, 0 表示直到取消塞住
+	IUINT32 rcv_offset; // rcv_queue 首个合并段中已经读取的字节数
+	IUINT32 rcv_skip; // 被对端放弃的消息还要丢弃的后续分片数
+	struct IKCPSTREAM **streams; // 流 1..nstreams 的状态, 按需分配
+	IUINT32 nstreams; // 启用的附加流个数, 0 表示只有流 0
+	IUINT32 rmt_nstreams; // 对端在协商中通告的附加流个数, 超过的 sid 不能发送
+	IUINT32 nrcv_stream; // 各附加流中缓存的数据段总数, 计入接收窗口
 	int logmask;
 	int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user); // 回调函数，数据发送到下层协议
 	void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
+	struct IKCPFEC *fec; // 前向纠错状态, NULL 表示未开启
+	struct IKCPSTATS stats; // 连接统计, 通过 ikcp_get_stats 读取
+	struct IKCPTRACE *trace; // 跟踪记录环形缓冲, NULL 表示未开启
+	IUINT32 trace_mask; // 环形缓冲容量 - 1 (容量为 2 的幂)
+	IUINT32 trace_wpos; // 写位置(单调递增)
+	IUINT32 trace_rpos; // 读位置(单调递增)
 };
 
 typedef struct IKCPCB ikcpcb;
 
+// time base, passed to ikcp_timebase: clock units per millisecond
+#define IKCP_TIME_MS 1
+#define IKCP_TIME_US 1000
+
+// forward error correction mode, passed to ikcp_fec
+#define IKCP_FEC_XOR 1 // single parity shard, plain xor
+#define IKCP_FEC_RS 2 // Reed-Solomon over GF(256), up to IKCP_FEC_MAX parity shards
+#define IKCP_FEC_MAX 64 // max data / parity shards per group
+
+// time based loss recovery, passed to ikcp_recovery
+#define IKCP_RECOVERY_RACK 1 // lost if a later sent segment was acked a reorder window ago
+#define IKCP_RECOVERY_TLP 2 // probe with the last segment after 2*srtt without acks
+
+// close state, returned by ikcp_closestate
+#define IKCP_CLOSE_SENT 1 // shut down here, the FIN follows the data still queued
+#define IKCP_CLOSE_ACKED 2 // the peer acked the FIN and with it all data before
+#define IKCP_CLOSE_PEER 4 // the peer shut down, no more data will arrive
+#define IKCP_CLOSE_DONE 8 // closed, the ikcpcb may be released
+
+// rto estimator options, passed to ikcp_rtomode
+#define IKCP_RTO_KARN 1 // no rtt samples from retransmitted segments
+#define IKCP_RTO_MINRTT 2 // floor the rto at minrtt + interval instead of rx_minrto
+#define IKCP_RTO_PERCENTILE 4 // rto from a percentile of the last IKCP_RTT_RECENT samples
+#define IKCP_RTT_RECENT 64
+
+// max stream id, passed to ikcp_streams
+#define IKCP_STREAM_MAX 255
+
 #define IKCP_LOG_OUTPUT 1
 #define IKCP_LOG_INPUT 2
 #define IKCP_LOG_SEND 4
@@ -406,15 +587,18 @@ void ikcp_release(ikcpcb *kcp);
 void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
 											   ikcpcb *kcp, void *user));
 
-// user/upper level recv: returns size, returns below zero for EAGAIN
+// user/upper level recv: returns size, returns below zero for EAGAIN,
+// -4 once the peer shut down and everything before its FIN was read
 int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 
-// user/upper level send, returns below zero for error
+// user/upper level send, returns below zero for error, -4 after shutdown,
+// -5 for a large message the peer has not agreed to (see ikcp_setmaxmsg)
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len);
 
 // update state (call it repeatedly, every 10ms-100ms), or you can ask
 // ikcp_check when to call it again (without ikcp_input/_send calling).
-// 'current' - current timestamp in millisec.
+// 'current' - current timestamp in millisec (or in the unit chosen by
+// ikcp_timebase).
 void ikcp_update(ikcpcb *kcp, IUINT32 current);
 
 // Determine when should you invoke ikcp_update:
@@ -438,6 +622,86 @@ int ikcp_peeksize(const ikcpcb *kcp);
 // change MTU size, default is 1400
 int ikcp_setmtu(ikcpcb *kcp, int mtu);
 
+// forward error correction between ikcp_flush and the output callback,
+// both ends must use the same parameters. every 'datashards' datagrams
+// are followed by 'parityshards' parity datagrams (one for IKCP_FEC_XOR),
+// lost datagrams are rebuilt in ikcp_input. a group still open after one
+// interval is closed early. mode 0 disables, each datagram carries a
+// 14-byte header so the mss shrinks accordingly. with gcc/clang on x86
+// the GF(256) arithmetic uses AVX2 or SSSE3 when the cpu has them, other
+// compilers need /arch:AVX2 (or the like) to vectorize it.
+int ikcp_fec(ikcpcb *kcp, int mode, int datashards, int parityshards);
+
+// large message mode. a message that needs more than one segment is sent
+// as a head segment carrying its total length followed by body segments,
+// so it is no longer limited to IKCP_WND_RCV fragments and may be up to
+// 'maxmsg' bytes. the receiver appends each segment to a buffer growing
+// as the data arrives, the message only takes one rcv_queue slot. both
+// ends announce their limit in an option exchange (IKCP_CMD_WINS with
+// data, resent every rto until answered), until the peer's limit is known
+// (or above it) messages are fragmented as usual and ikcp_send returns -5
+// for one needing IKCP_WND_RCV fragments or more. 0 disables (default).
+int ikcp_setmaxmsg(ikcpcb *kcp, int maxmsg);
+
+// coalescing mode, the receiver always decodes it so only the sender has
+// to enable it. every message that fits in one segment is appended to the
+// tail segment of snd_queue with a varint length prefix instead of taking
+// a segment (header, sn and ack) of its own, ikcp_recv still returns one
+// message per call. 'maxdelay' bounds how long a corked segment may wait,
+// in clock units, 0 for no bound.
+int ikcp_coalesce(ikcpcb *kcp, int enable, int maxdelay);
+
+// cork: keep a partially filled coalesced segment in snd_queue so later
+// messages can join it, until it is full, 'maxdelay' expires or it is
+// uncorked. uncorking flushes whatever is pending right away.
+void ikcp_cork(ikcpcb *kcp, int cork);
+
+// enable stream ids 1..count inside this conv (0 disables, up to
+// IKCP_STREAM_MAX). stream 0 is what ikcp_send/ikcp_recv use. every
+// stream is ordered and reassembled on its own, so a lost segment only
+// delays the stream it belongs to, while all streams share one sequence
+// space, send window and cwnd. both ends announce their count in the
+// option exchange (see ikcp_setmaxmsg), segments for a stream id the
+// receiver does not have are not acknowledged.
+int ikcp_streams(ikcpcb *kcp, int count);
+
+// send a message on stream 'sid', each segment carries 6 more bytes of
+// header than stream 0. returns below zero for error, -5 while the peer
+// has not announced 'sid' (yet)
+int ikcp_send_stream(ikcpcb *kcp, int sid, const char *buffer, int len);
+
+// receive a message from stream 'sid', same return values as ikcp_recv
+int ikcp_recv_stream(ikcpcb *kcp, int sid, char *buffer, int len);
+
+// size of the next message on stream 'sid', below zero if none
+int ikcp_peeksize_stream(const ikcpcb *kcp, int sid);
+
+// send a message in priority class 'prio' (0 .. IKCP_PRIO_COUNT - 1, 0 is
+// the most urgent), ikcp_send uses IKCP_PRIO_DEFAULT. each class has its
+// own send queue, ikcp_flush fills the window from them with the
+// scheduler chosen by ikcp_scheduler. a message split in fragments always
+// takes consecutive sequence numbers, so the peer needs no change. in
+// stream mode the classes interleave at segment granularity.
+int ikcp_send_prio(ikcpcb *kcp, int prio, const char *buffer, int len);
+
+// choose how ikcp_flush drains the priority classes: NULL for strict
+// priority (default), or IKCP_PRIO_COUNT weights for a weighted round
+// robin where class i moves up to weights[i] segments per round.
+int ikcp_scheduler(ikcpcb *kcp, const int *weights);
+
+// segments of class 'prio' waiting in the send queue or in flight
+int ikcp_waitsnd_prio(const ikcpcb *kcp, int prio);
+
+// partially reliable send: the message is abandoned once 'ttl' ms have
+// passed since this call or a segment of it has been sent 'maxxmit'
+// times (0 disables either limit). an abandoned message is dropped
+// from the send queue, or if already in flight, replaced by a SKIP
+// so the peer moves past it and discards the fragments it has. not
+// available in stream mode; coalescing and large-message mode are
+// bypassed, the message is fragmented like a plain ikcp_send.
+int ikcp_send_partial(ikcpcb *kcp, int prio, const char *buffer, int len,
+	IUINT32 ttl, IUINT32 maxxmit);
+
 // set maximum window size: sndwnd=32, rcvwnd=32 by default
 int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd);
 
@@ -446,14 +710,125 @@ int ikcp_waitsnd(const ikcpcb *kcp);
 
 // fastest: ikcp_nodelay(kcp, 1, 20, 2, 1)
 // nodelay: 0:disable(default), 1:enable
-// interval: internal update timer interval in millisec, default is 100ms
+// interval: internal update timer interval in clock units, default is 100ms
 // resend: 0:disable fast resend(default), 1:enable fast resend
 // nc: 0:normal congestion control(default), 1:disable congestion control
 int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc);
 
+// time based loss recovery, IKCP_RECOVERY_RACK | IKCP_RECOVERY_TLP or 0
+// (default). RACK retransmits a segment once a segment sent after it has
+// been acked and srtt/4 more has passed, without counting duplicate acks;
+// TLP resends the last segment in flight once it is unacked for about
+// 2*srtt, so a lost tail is repaired before the RTO. both work alongside the
+// 'resend' threshold of ikcp_nodelay.
+int ikcp_recovery(ikcpcb *kcp, int flags);
+
+// rto estimator, a combination of IKCP_RTO_* or 0 for the classic
+// srtt + 4*rttval bounded by rx_minrto. with IKCP_RTO_PERCENTILE the rto
+// is the 'percentile' (50-100) of recent samples plus interval, which
+// follows heavy-tailed jitter better than the variance. the windowed
+// minimum rtt is always tracked; srtt, minrtt and rto are reported by
+// ikcp_get_stats.
+int ikcp_rtomode(ikcpcb *kcp, int flags, int percentile);
+
+// send the acks queued by ikcp_input now instead of at the next
+// ikcp_flush, without touching the data segments. cheap enough to call
+// after every batch of ikcp_input.
+void ikcp_flush_acks(ikcpcb *kcp);
+
+// ack nodelay: 1 to have each ikcp_input call end with ikcp_flush_acks,
+// which takes up to 'interval' of ack delay out of the peer's rtt
+int ikcp_ack_nodelay(ikcpcb *kcp, int enable);
+
+// receive window scaling: 'shift' (1-14) is offered to the peer in the
+// option exchange, once both ends agreed the 16-bit wnd field is
+// advertised in units of 2^shift segments, so rcv_wnd may go beyond 65535.
+// peers without scaling ignore the offer and the window stays unscaled,
+// clamped to 65535. 0 (default) disables it.
+int ikcp_wndscale(ikcpcb *kcp, int shift);
+
+// byte based receive window: the advertised window is also limited to what
+// fits into 'bytes' of memory beside the segments already held in rcv_buf
+// and rcv_queue (a full mss per incoming segment is assumed), so many small
+// segments do not pin the memory a window of full ones would. raised to
+// hold at least IKCP_WND_RCV full segments, 0 (default) disables it.
+int ikcp_rcvbuf(ikcpcb *kcp, int bytes);
+
+// window autotuning: every srtt the windows grow to twice what was acked
+// (snd_wnd, only while sending was held back by it) or delivered (rcv_wnd)
+// in that period, up to 'maxwnd' segments and the global budget below.
+// after IKCP_TUNE_IDLE without progress they shrink back to the values
+// set by ikcp_wndsize. 0 disables it and restores those values.
+int ikcp_autotune(ikcpcb *kcp, int maxwnd);
+
+// packetization layer path mtu discovery: the mtu is set to 'minmtu',
+// which must get through, then padded probes that take no sequence number
+// binary search up to 'maxmtu'. each confirmed size raises mtu/mss right
+// away; segments already queued keep their size. when a segment above
+// 'minmtu' keeps timing out the mtu falls back to 'minmtu' and the search
+// restarts below the failed size, segments built for the larger mtu are
+// then sent in 'minmtu' pieces and reassembled by the peer. packets with
+// only acks and window commands never exceed 'minmtu'. after the search ends larger sizes are
+// retried every IKCP_PMTU_RAISE. peers answer probes whether or not they
+// enabled it, an older peer rejects them and the mtu stays at 'minmtu'.
+// not available together with ikcp_fec. maxmtu = 0 stops probing.
+int ikcp_pmtud(ikcpcb *kcp, int minmtu, int maxmtu);
+
+// half close: later sends fail with -4, the data already queued is sent
+// and followed by a FIN segment on the last sn, so the peer gets it after
+// everything else. receiving goes on until the peer shuts down as well.
+// the peer has to know the FIN segment, an older one takes it for a
+// broken fragment. returns -1 if already shut down.
+int ikcp_shutdown(ikcpcb *kcp);
+
+// full close: ikcp_shutdown, then IKCP_CLOSE_DONE once the FIN is acked
+// and the peer's FIN arrived, or 'linger' after the ack without it. the
+// side that sent its FIN first also stays 'linger' after the peer's FIN to
+// ack it again if the ack got lost. 'linger' is in clock units, below zero
+// for IKCP_CLOSE_LINGER. keep calling ikcp_update until DONE.
+int ikcp_close(ikcpcb *kcp, int linger);
+
+// IKCP_CLOSE_* flags, 0 while open
+int ikcp_closestate(const ikcpcb *kcp);
+
+// process wide budget for the windows grown by ikcp_autotune, counted as
+// (snd_wnd + rcv_wnd) * mss over all autotuned connections, 0 (default) is
+// unlimited. not locked: connections driven from several threads need
+// their own serialization around ikcp_update/ikcp_flush.
+void ikcp_autotune_budget(IINT64 bytes);
+
+// bytes currently counted against the autotune budget
+IINT64 ikcp_autotune_used(void);
+
+// set internal update timer interval in clock units, 1ms-5000ms
+int ikcp_interval(ikcpcb *kcp, int interval);
+
+// select the clock unit: IKCP_TIME_MS (default) or IKCP_TIME_US, call it
+// before the first ikcp_update. every timestamp passed to ikcp_update/
+// ikcp_check and every interval, rto and rtt field is expressed in this
+// unit afterwards, values already configured are rescaled. timestamps
+// stay 32-bit and wrap around (about 71 minutes in microseconds), the
+// peer only echoes them back, so the wire format is unchanged and both
+// ends may use different units.
+int ikcp_timebase(ikcpcb *kcp, int unit);
+
 
 void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...);
 
+// enable a binary trace ring of 'capacity' records (rounded up to a power
+// of two), 0 to disable. events selected by kcp->logmask are recorded
+// without any formatting, the oldest records are overwritten when full.
+int ikcp_trace(ikcpcb *kcp, int capacity);
+
+// drain recorded events into 'buffer' as IKCP_TRACE_SIZE little-endian
+// records, returns bytes written. write them to a file and decode it
+// offline with example/trace_decode.
+int ikcp_trace_read(ikcpcb *kcp, char *buffer, int len);
+
+// copy cumulative counters, current srtt/rttvar/rto/cwnd and the rtt
+// histogram into 'stats'
+void ikcp_get_stats(const ikcpcb *kcp, ikcpstats *stats);
+
 // setup allocator
 void ikcp_allocator(void *(*new_malloc)(size_t), void (*new_free)(void *));
 
@@ -0,0 +1,368 @@
+//=====================================================================
+//
+// microbench.cpp - kcp 接口微基准
+//
+// 说明：
+// 对 ikcp_input / ikcp_flush / ikcp_send / ikcp_recv / ikcp_check 分别
+// 构造固定的场景反复调用，只统计被测调用本身的耗时和内存分配次数，
+// 准备数据和清理的开销不计入。内存分配通过 ikcp_allocator 挂钩计数。
+//
+// 用法：
+// kcp_microbench [name...]    只运行名字中包含任一参数的用例
+//
+// 数字只有在优化编译下才有意义：cmake -DCMAKE_BUILD_TYPE=Release
+//
+//=====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "ikcp.c"
+
+
+/* get clock in nanosecond, monotonic */
+static inline IINT64 inanotime(void)
+{
+	#if defined(__unix)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((IINT64)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	#else
+	static IINT64 freq = 0;
+	IINT64 qpc;
+	if (freq == 0) {
+		QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
+		if (freq == 0) freq = 1;
+	}
+	QueryPerformanceCounter((LARGE_INTEGER*)&qpc);
+	return (qpc / freq) * 1000000000 + (qpc % freq) * 1000000000 / freq;
+	#endif
+}
+
+
+//---------------------------------------------------------------------
+// 分配计数：只在计时区间内计数
+//---------------------------------------------------------------------
+static int counting = 0;
+static IINT64 allocs = 0;
+
+static void *counting_malloc(size_t size)
+{
+	if (counting) allocs++;
+	return malloc(size);
+}
+
+static void counting_free(void *ptr)
+{
+	free(ptr);
+}
+
+
+//---------------------------------------------------------------------
+// 计时器：start/stop 包住被测调用，可以在一个用例里多次累计
+//---------------------------------------------------------------------
+struct Bench
+{
+	const char *name;
+	IINT64 elapsed;		// 累计纳秒
+	IINT64 ops;			// 累计操作数
+	IINT64 allocs;		// 累计分配次数
+	IINT64 start_ts;
+	IINT64 start_allocs;
+
+	Bench(const char *name): name(name), elapsed(0), ops(0), allocs(0) {}
+
+	void start() {
+		start_allocs = ::allocs;
+		counting = 1;
+		start_ts = inanotime();
+	}
+
+	void stop(int n = 1) {
+		IINT64 ts = inanotime();
+		counting = 0;
+		elapsed += ts - start_ts;
+		allocs += ::allocs - start_allocs;
+		ops += n;
+	}
+
+	void report() const {
+		double ns = (ops > 0)? (double)elapsed / ops : 0;
+		double ap = (ops > 0)? (double)allocs / ops : 0;
+		printf("%-24s %10lld ops %12.1f ns/op %8.2f allocs/op\n", name,
+			(long long)ops, ns, ap);
+	}
+};
+
+
+//---------------------------------------------------------------------
+// 公共设置
+//---------------------------------------------------------------------
+static IUINT32 current = 0;
+static volatile IUINT32 sink = 0;	// 防止被测调用的结果被优化掉
+
+// 记录输出的数据包，稍后再交给对端
+struct Capture
+{
+	char data[256][1500];
+	int size[256];
+	int count;
+};
+
+static int capture_output(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+	Capture *capture = (Capture*)user;
+	if (capture->count < 256) {
+		memcpy(capture->data[capture->count], buf, len);
+		capture->size[capture->count++] = len;
+	}
+	return 0;
+}
+
+static int discard_output(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+	return 0;
+}
+
+// 把输出的数据包依次交给另一个 kcp
+static int forward_output(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+	ikcp_input((ikcpcb*)user, buf, len);
+	return 0;
+}
+
+static ikcpcb *bench_create(int wnd)
+{
+	ikcpcb *kcp = ikcp_create(0x11223344, NULL);
+	kcp->output = discard_output;
+	ikcp_wndsize(kcp, wnd, wnd);
+	ikcp_nodelay(kcp, 1, 10, 0, 1);
+	kcp->rmt_wnd = wnd;
+	ikcp_update(kcp, current);
+	return kcp;
+}
+
+// 写一个 ACK 段头，与 ikcp_encode_seg 的格式相同
+static char *encode_ack(char *ptr, IUINT32 sn, IUINT32 una, IUINT32 ts)
+{
+	ptr = ikcp_encode32u(ptr, 0x11223344);
+	ptr = ikcp_encode8u(ptr, (IUINT8)IKCP_CMD_ACK);
+	ptr = ikcp_encode8u(ptr, 0);
+	ptr = ikcp_encode16u(ptr, 1024);
+	ptr = ikcp_encode32u(ptr, ts);
+	ptr = ikcp_encode32u(ptr, sn);
+	ptr = ikcp_encode32u(ptr, una);
+	ptr = ikcp_encode32u(ptr, 0);
+	return ptr;
+}
+
+
+//---------------------------------------------------------------------
+// 用例
+//---------------------------------------------------------------------
+
+// 解析一个包含 50 个 ACK 的数据包，每个 ACK 确认一个在途段
+static void bench_input_ack50(Bench &b, int rounds)
+{
+	ikcpcb *kcp = bench_create(1024);
+	char data[64];
+	char packet[50 * 24];
+	memset(data, 0, sizeof(data));
+	for (int r = 0; r < rounds; r++) {
+		IUINT32 base = kcp->snd_nxt;
+		for (int i = 0; i < 50; i++) ikcp_send(kcp, data, sizeof(data));
+		ikcp_flush(kcp);
+		char *ptr = packet;
+		for (int i = 0; i < 50; i++) {
+			ptr = encode_ack(ptr, base + i, base, current);
+		}
+		b.start();
+		ikcp_input(kcp, packet, (int)(ptr - packet));
+		b.stop();
+	}
+	ikcp_release(kcp);
+}
+
+// 1024 个段在途、没有到期的重传和待发的 ACK，flush 应当什么都不做
+static void bench_flush_idle(Bench &b, int rounds)
+{
+	ikcpcb *kcp = bench_create(2048);
+	char data[64];
+	memset(data, 0, sizeof(data));
+	kcp->rx_rto = kcp->rx_minrto = 60000;
+	for (int i = 0; i < 1024; i++) ikcp_send(kcp, data, sizeof(data));
+	ikcp_flush(kcp);
+	for (int r = 0; r < rounds; r++) {
+		b.start();
+		ikcp_flush(kcp);
+		b.stop();
+	}
+	ikcp_release(kcp);
+}
+
+// 100KB 消息：发送端分片，接收端输入全部分片后重组
+static void bench_fragment_100k(Bench &send, Bench &input, Bench &recv,
+	int rounds)
+{
+	static char message[100 * 1024];
+	static char buffer[100 * 1024];
+	static Capture capture;
+	ikcpcb *kcp1 = bench_create(256);
+	ikcpcb *kcp2 = bench_create(256);
+	for (int i = 0; i < (int)sizeof(message); i++) message[i] = (char)i;
+	kcp1->output = capture_output;
+	kcp1->user = &capture;
+	kcp2->output = forward_output;
+	kcp2->user = kcp1;
+
+	for (int r = 0; r < rounds; r++) {
+		send.start();
+		ikcp_send(kcp1, message, sizeof(message));
+		send.stop();
+
+		capture.count = 0;
+		ikcp_flush(kcp1);
+
+		input.start();
+		for (int i = 0; i < capture.count; i++) {
+			ikcp_input(kcp2, capture.data[i], capture.size[i]);
+		}
+		input.stop();
+
+		recv.start();
+		int hr = ikcp_recv(kcp2, buffer, sizeof(buffer));
+		recv.stop();
+		if (hr != (int)sizeof(message) || memcmp(buffer, message, hr) != 0) {
+			printf("ERROR: reassembled %d bytes\n", hr);
+			exit(1);
+		}
+
+		// ACK 回送给发送端，清空 snd_buf
+		ikcp_flush(kcp2);
+	}
+
+	ikcp_release(kcp1);
+	ikcp_release(kcp2);
+}
+
+// snd_buf 很深时的 ikcp_check
+static void bench_check(Bench &b, int depth, int rounds)
+{
+	ikcpcb *kcp = bench_create(depth * 2);
+	char data[64];
+	memset(data, 0, sizeof(data));
+	kcp->rx_rto = kcp->rx_minrto = 60000;
+	for (int i = 0; i < depth; i++) ikcp_send(kcp, data, sizeof(data));
+	ikcp_flush(kcp);
+	for (int r = 0; r < rounds; r++) {
+		b.start();
+		sink += ikcp_check(kcp, current + 1);
+		b.stop();
+	}
+	ikcp_release(kcp);
+}
+
+// 流模式下的 100 字节小写入，每轮写满 100 个 mss，再整体丢弃
+static void bench_stream_write(Bench &b, int rounds)
+{
+	char data[100];
+	memset(data, 0, sizeof(data));
+	for (int r = 0; r < rounds; r++) {
+		ikcpcb *kcp = bench_create(128);
+		int writes = (int)kcp->mss * 100 / (int)sizeof(data);
+		kcp->stream = 1;
+		b.start();
+		for (int i = 0; i < writes; i++) {
+			ikcp_send(kcp, data, sizeof(data));
+		}
+		b.stop(writes);
+		ikcp_release(kcp);
+	}
+}
+
+// 小消息 send + flush 到对端 + recv 的完整往返，接收端 ACK 回送
+static void bench_small_roundtrip(Bench &b, int rounds)
+{
+	ikcpcb *kcp1 = bench_create(128);
+	ikcpcb *kcp2 = bench_create(128);
+	char data[64];
+	char buffer[64];
+	memset(data, 0, sizeof(data));
+	kcp1->output = forward_output;
+	kcp1->user = kcp2;
+	kcp2->output = forward_output;
+	kcp2->user = kcp1;
+	for (int r = 0; r < rounds; r++) {
+		b.start();
+		ikcp_send(kcp1, data, sizeof(data));
+		ikcp_flush(kcp1);
+		ikcp_recv(kcp2, buffer, sizeof(buffer));
+		ikcp_flush(kcp2);
+		b.stop();
+	}
+	ikcp_release(kcp1);
+	ikcp_release(kcp2);
+}
+
+
+//---------------------------------------------------------------------
+// main
+//---------------------------------------------------------------------
+static bool selected(int argc, char *argv[], const char *name)
+{
+	if (argc <= 1) return true;
+	for (int i = 1; i < argc; i++) {
+		if (strstr(name, argv[i]) != NULL) return true;
+	}
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	ikcp_allocator(counting_malloc, counting_free);
+
+	if (selected(argc, argv, "input_ack50")) {
+		Bench b("input_ack50");
+		bench_input_ack50(b, 20000);
+		b.report();
+	}
+	if (selected(argc, argv, "flush_idle1024")) {
+		Bench b("flush_idle1024");
+		bench_flush_idle(b, 20000);
+		b.report();
+	}
+	if (selected(argc, argv, "send_100k") ||
+		selected(argc, argv, "input_100k") ||
+		selected(argc, argv, "recv_100k")) {
+		Bench send("send_100k"), input("input_100k"), recv("recv_100k");
+		bench_fragment_100k(send, input, recv, 2000);
+		send.report();
+		input.report();
+		recv.report();
+	}
+	if (selected(argc, argv, "check_snd_buf1024")) {
+		Bench b("check_snd_buf1024");
+		bench_check(b, 1024, 20000);
+		b.report();
+	}
+	if (selected(argc, argv, "check_snd_buf8192")) {
+		Bench b("check_snd_buf8192");
+		bench_check(b, 8192, 5000);
+		b.report();
+	}
+	if (selected(argc, argv, "stream_write100")) {
+		Bench b("stream_write100");
+		bench_stream_write(b, 200);
+		b.report();
+	}
+	if (selected(argc, argv, "small_roundtrip")) {
+		Bench b("small_roundtrip");
+		bench_small_roundtrip(b, 200000);
+		b.report();
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,774 @@
+//=====================================================================
+//
+// sim.cpp - kcp 虚拟时钟模拟
+//
+// 说明：
+// 和 test.cpp 相同的回射场景，但不再 isleep/iclock：时钟每一步直接跳到
+// 下一个事件（包到达、ikcp_check 给出的更新时间、下一次发送），
+// 随机数使用固定种子，所以结果可以精确复现，单次运行只需要几毫秒。
+// 场景的数据没有在时限内按顺序收齐时输出 FAILED，并以非零值退出 (ctest)。
+//
+// 用法：
+// kcp_sim               各模式对比
+// kcp_sim sweep         参数扫描，每个组合输出一行 CSV
+// kcp_sim profiles      在各种链路损伤模型下对比各模式
+// kcp_sim streams       批量数据与实时消息共用一个连接，对比单流和多流
+// kcp_sim recovery      请求/应答的尾延迟，对比 RACK 与尾部探测的开关
+// kcp_sim pmtud         不同路径 MTU 下的批量传输，对比固定 mtu 和路径 MTU 探测
+// kcp_sim multiflow [flows] [modes] [rate] [seconds]
+//                       多条流共享一个瓶颈，modes 为逗号分隔的模式列表，
+//                       各流轮流使用；rate 为瓶颈带宽（字节/ms）
+//
+//=====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "test.h"
+#include "ikcp.c"
+
+
+// 一次模拟的参数
+struct SimConfig
+{
+	int mode;			// 0: default, 1: normal, 2: fast, 3: fast+fec
+	int lostrate;		// 往返丢包率百分比
+	int rttmin;
+	int rttmax;
+	int wnd;			// 收发窗口
+	int interval;		// kcp 内部时钟
+	int count;			// 回射的消息数
+	int profile;		// 链路模型下标，-1 表示使用 lostrate/rttmin/rttmax
+	IUINT32 limit;		// 虚拟时间上限 (ms)，到时还没有收齐就放弃
+	IUINT64 seed;
+};
+
+// 一次模拟的结果
+struct SimResult
+{
+	IUINT32 elapsed;	// 虚拟时间 (ms)
+	int avgrtt;
+	int maxrtt;
+	int tx;				// 端点 0 发出的下层包数
+	int steps;			// 时钟跳跃次数
+	int delivered;		// 按顺序收回的消息数
+};
+
+static const char *mode_names[4] = { "default", "normal", "fast", "fast+fec" };
+
+// 链路模型：0 -> 1 为上行，1 -> 0 为下行
+struct SimProfile
+{
+	const char *name;
+	LinkProfile up;
+	LinkProfile down;
+};
+
+static std::vector<SimProfile> sim_profiles()
+{
+	std::vector<SimProfile> profiles;
+	SimProfile p;
+
+	// 突发丢包：平均约 3% 丢包，但集中出现
+	p.name = "burst";
+	p.up = LinkProfile(0, 30, 60);
+	p.up.ge_p = 0.01;
+	p.up.ge_r = 0.25;
+	p.up.ge_bad = 0.8;
+	p.down = p.up;
+	profiles.push_back(p);
+
+	// wifi：正态抖动、少量乱序和重复
+	p.name = "wifi";
+	p.up = LinkProfile(2, 10, 70);
+	p.up.jitter = LinkProfile::JITTER_NORMAL;
+	p.up.reorder = 0.05;
+	p.up.duplicate = 0.01;
+	p.down = p.up;
+	profiles.push_back(p);
+
+	// 蜂窝：长尾延迟，上下行带宽不对称，上行队列较浅
+	p.name = "cellular";
+	p.up = LinkProfile(1, 40, 60);
+	p.up.jitter = LinkProfile::JITTER_PARETO;
+	p.up.rate = 64;
+	p.up.burst = 3000;
+	p.up.queue = 16000;
+	p.down = p.up;
+	p.down.rate = 1250;
+	p.down.burst = 15000;
+	p.down.queue = 64000;
+	profiles.push_back(p);
+
+	// 瓶颈：1Mbps，RED 队列
+	p.name = "bottleneck";
+	p.up = LinkProfile(0, 30, 30);
+	p.up.rate = 125;
+	p.up.burst = 1500;
+	p.up.queue = 32000;
+	p.up.redmin = 8000;
+	p.up.redmax = 24000;
+	p.up.redprob = 0.1;
+	p.down = p.up;
+	profiles.push_back(p);
+
+	return profiles;
+}
+
+struct SimPeer
+{
+	LatencySimulator *vnet;
+	int id;
+};
+
+// 模拟网络：模拟发送一个 udp包
+static int peer_output(const char *buf, int len, ikcpcb *kcp, void *user)
+{
+	SimPeer *peer = (SimPeer*)user;
+	peer->vnet->send(peer->id, buf, len);
+	return 0;
+}
+
+static void sim_setup(ikcpcb *kcp, const SimConfig &cfg)
+{
+	ikcp_wndsize(kcp, cfg.wnd, cfg.wnd);
+	if (cfg.mode == 0) {
+		ikcp_nodelay(kcp, 0, cfg.interval, 0, 0);
+	}	else if (cfg.mode == 1) {
+		ikcp_nodelay(kcp, 0, cfg.interval, 0, 1);
+	}	else {
+		ikcp_nodelay(kcp, 2, cfg.interval, 2, 1);
+		if (cfg.mode == 3) {
+			ikcp_fec(kcp, IKCP_FEC_RS, 4, 2);
+		}
+	}
+}
+
+static inline void sim_next(IUINT32 current, IUINT32 ts, IUINT32 *next)
+{
+	if ((IINT32)(ts - *next) < 0) *next = ts;
+	if ((IINT32)(*next - current) <= 0) *next = current + 1;
+}
+
+// 场景的不变量不成立时记下失败，main 以非零值退出，供 ctest 检查
+static int sim_failures = 0;
+
+static void sim_expect(bool ok, const char *fmt, ...)
+{
+	if (!ok) {
+		va_list ap;
+		va_start(ap, fmt);
+		printf("FAILED: ");
+		vprintf(fmt, ap);
+		printf("\n");
+		va_end(ap);
+		sim_failures++;
+	}
+}
+
+// 两个端点上的一个场景：configure 在开始前配置端点 id 的 kcp；tick 在每一步
+// 送达到期的包之后调用，在其中收发数据，并把场景自己的下一个事件写入 *wake，
+// 返回 false 时模拟结束
+struct SimScenario
+{
+	virtual ~SimScenario() {}
+	virtual void configure(ikcpcb *kcp, int id) = 0;
+	virtual bool tick(IUINT32 current, ikcpcb *kcp1, ikcpcb *kcp2, IUINT32 *wake) = 0;
+};
+
+// 模拟驱动：端点 0 和 1 通过 vnet 相连，全部时间来自虚拟时钟，每一步之后
+// 时钟跳到最近的事件。返回结束时的虚拟时间
+static IUINT32 sim_run(LatencySimulator &vnet, SimScenario &scenario, int *steps)
+{
+	IUINT32 current = 0;
+	vnet.setclock(&current);
+
+	SimPeer p1 = { &vnet, 0 };
+	SimPeer p2 = { &vnet, 1 };
+	ikcpcb *kcp1 = ikcp_create(0x11223344, &p1);
+	ikcpcb *kcp2 = ikcp_create(0x11223344, &p2);
+	kcp1->output = peer_output;
+	kcp2->output = peer_output;
+	scenario.configure(kcp1, 0);
+	scenario.configure(kcp2, 1);
+
+	char buffer[4000];
+	int hr;
+
+	for (*steps = 0; ; (*steps)++) {
+		// 送达所有到期的包
+		while ((hr = vnet.recv(1, buffer, sizeof(buffer))) >= 0) {
+			ikcp_input(kcp2, buffer, hr);
+		}
+		while ((hr = vnet.recv(0, buffer, sizeof(buffer))) >= 0) {
+			ikcp_input(kcp1, buffer, hr);
+		}
+
+		IUINT32 ts, wake = current + 1000;
+		if (!scenario.tick(current, kcp1, kcp2, &wake)) break;
+
+		ikcp_update(kcp1, current);
+		ikcp_update(kcp2, current);
+
+		// 时钟跳到最近的事件
+		sim_next(current, ikcp_check(kcp1, current), &wake);
+		sim_next(current, ikcp_check(kcp2, current), &wake);
+		if (vnet.next_delivery(0, &ts)) sim_next(current, ts, &wake);
+		if (vnet.next_delivery(1, &ts)) sim_next(current, ts, &wake);
+		current = wake;
+	}
+
+	ikcp_release(kcp1);
+	ikcp_release(kcp2);
+	vnet.setclock(NULL);
+	return current;
+}
+
+// 回射：端点 0 每隔 20ms 发送一个带序号和时间戳的消息，端点 1 原样返回
+struct EchoScenario : SimScenario
+{
+	const SimConfig &cfg;
+	IUINT32 slap, index, next;
+	IINT64 sumrtt;
+	int maxrtt;
+
+	EchoScenario(const SimConfig &c): cfg(c), slap(20), index(0), next(0),
+		sumrtt(0), maxrtt(0) {}
+
+	void configure(ikcpcb *kcp, int id) {
+		sim_setup(kcp, cfg);
+		if (id == 0 && cfg.mode >= 2) {
+			kcp->rx_minrto = 10;
+			kcp->fastresend = 1;
+		}
+	}
+
+	bool tick(IUINT32 current, ikcpcb *kcp1, ikcpcb *kcp2, IUINT32 *wake) {
+		char buffer[16];
+		int hr;
+
+		if (next >= (IUINT32)cfg.count || (IINT32)(current - cfg.limit) >= 0)
+			return false;
+
+		// kcp2接收到任何包都返回回去
+		while ((hr = ikcp_recv(kcp2, buffer, 10)) >= 0) {
+			ikcp_send(kcp2, buffer, hr);
+		}
+
+		// kcp1收到kcp2的回射数据
+		while ((hr = ikcp_recv(kcp1, buffer, 10)) >= 0) {
+			IUINT32 sn = *(IUINT32*)(buffer + 0);
+			IUINT32 ts = *(IUINT32*)(buffer + 4);
+			IUINT32 rtt = current - ts;
+			if (sn != next) {
+				printf("ERROR sn %d<->%d\n", (int)sn, (int)next);
+				exit(1);
+			}
+			next++;
+			sumrtt += rtt;
+			if (rtt > (IUINT32)maxrtt) maxrtt = rtt;
+		}
+
+		// 每隔 20ms，kcp1发送数据
+		for (; (IINT32)(current - slap) >= 0; slap += 20) {
+			((IUINT32*)buffer)[0] = index++;
+			((IUINT32*)buffer)[1] = current;
+			ikcp_send(kcp1, buffer, 8);
+		}
+
+		*wake = slap;
+		return true;
+	}
+};
+
+// 运行一次回射测试
+SimResult simulate(const SimConfig &cfg)
+{
+	LatencySimulator vnet(cfg.lostrate, cfg.rttmin, cfg.rttmax, 1000, cfg.seed);
+	if (cfg.profile >= 0) {
+		std::vector<SimProfile> profiles = sim_profiles();
+		vnet.setprofile(0, profiles[cfg.profile].up);
+		vnet.setprofile(1, profiles[cfg.profile].down);
+	}
+
+	EchoScenario echo(cfg);
+	SimResult result;
+	result.elapsed = sim_run(vnet, echo, &result.steps);
+	result.delivered = (int)echo.next;
+	result.avgrtt = (int)(echo.sumrtt / (echo.next > 0? echo.next : 1));
+	result.maxrtt = echo.maxrtt;
+	result.tx = vnet.tx1;
+	return result;
+}
+
+static SimConfig default_config(int mode)
+{
+	SimConfig cfg;
+	cfg.mode = mode;
+	cfg.lostrate = 10;
+	cfg.rttmin = 60;
+	cfg.rttmax = 125;
+	cfg.wnd = 128;
+	cfg.interval = 10;
+	cfg.count = 1000;
+	cfg.profile = -1;
+	cfg.limit = 600000;
+	cfg.seed = 1;
+	return cfg;
+}
+
+// 参数扫描：丢包率 x rtt x 模式 x 窗口 x interval x 种子
+static void sweep()
+{
+	static const int losts[] = { 0, 2, 5, 10, 20, 30 };
+	static const int rtts[][2] = { { 10, 20 }, { 60, 125 }, { 200, 300 } };
+	static const int wnds[] = { 32, 128, 512 };
+	static const int intervals[] = { 5, 10, 20, 40 };
+	int total = 0;
+
+	printf("mode,lostrate,rttmin,rttmax,wnd,interval,seed,elapsed,avgrtt,maxrtt,tx\n");
+	for (size_t a = 0; a < sizeof(losts) / sizeof(losts[0]); a++)
+	for (size_t b = 0; b < sizeof(rtts) / sizeof(rtts[0]); b++)
+	for (int mode = 0; mode < 4; mode++)
+	for (size_t c = 0; c < sizeof(wnds) / sizeof(wnds[0]); c++)
+	for (size_t d = 0; d < sizeof(intervals) / sizeof(intervals[0]); d++)
+	for (IUINT64 seed = 1; seed <= 4; seed++) {
+		SimConfig cfg = default_config(mode);
+		cfg.lostrate = losts[a];
+		cfg.rttmin = rtts[b][0];
+		cfg.rttmax = rtts[b][1];
+		cfg.wnd = wnds[c];
+		cfg.interval = intervals[d];
+		cfg.seed = seed;
+		SimResult r = simulate(cfg);
+		printf("%s,%d,%d,%d,%d,%d,%d,%u,%d,%d,%d\n", mode_names[mode],
+			cfg.lostrate, cfg.rttmin, cfg.rttmax, cfg.wnd, cfg.interval,
+			(int)cfg.seed, (unsigned)r.elapsed, r.avgrtt, r.maxrtt, r.tx);
+		total++;
+	}
+	fprintf(stderr, "%d runs\n", total);
+}
+
+// 各链路模型下对比各模式
+static void profiles()
+{
+	std::vector<SimProfile> profiles = sim_profiles();
+	for (size_t i = 0; i < profiles.size(); i++) {
+		for (int mode = 0; mode < 4; mode++) {
+			SimConfig cfg = default_config(mode);
+			cfg.profile = (int)i;
+			SimResult r = simulate(cfg);
+			printf("%-10s %-8s avgrtt=%d maxrtt=%d tx=%d\n", profiles[i].name,
+				mode_names[mode], r.avgrtt, r.maxrtt, r.tx);
+			sim_expect(r.delivered >= cfg.count, "%s %s: %d of %d echoed",
+				profiles[i].name, mode_names[mode], r.delivered, cfg.count);
+		}
+	}
+}
+
+// 同一个连接上，端点 0 持续发送批量数据，同时每 20ms 发一条实时消息。
+// separate 为 0 时两者都走流 0，否则批量数据走流 1、实时消息走流 2。
+// 30 秒后停止发送，再等在途的消息收齐
+struct StreamScenario : SimScenario
+{
+	int bulk, realtime;
+	std::vector<IUINT32> latency;
+	IUINT32 slap, index, rtnext, bulksent, bulknext;
+	int disorder;
+
+	StreamScenario(int separate): bulk(separate? 1 : 0),
+		realtime(separate? 2 : 0), slap(20), index(0), rtnext(0),
+		bulksent(0), bulknext(0), disorder(0) {}
+
+	void configure(ikcpcb *kcp, int id) {
+		ikcp_wndsize(kcp, 256, 256);
+		ikcp_nodelay(kcp, 2, 10, 2, 1);
+		ikcp_streams(kcp, 2);
+	}
+
+	bool tick(IUINT32 current, ikcpcb *kcp1, ikcpcb *kcp2, IUINT32 *wake) {
+		static char buffer[4000];
+		IUINT32 *head = (IUINT32*)buffer;
+		int hr;
+
+		// 实时消息以 0xffffffff 开头，后面是发送时间和序号；批量数据以序号开头
+		for (int sid = 0; sid <= 2; sid++) {
+			while ((hr = ikcp_recv_stream(kcp2, sid, buffer, sizeof(buffer))) >= 0) {
+				if (head[0] == 0xffffffff) {
+					latency.push_back(current - head[1]);
+					if (head[2] != rtnext) disorder++;
+					rtnext = head[2] + 1;
+				}	else {
+					if (head[0] != bulknext) disorder++;
+					bulknext = head[0] + 1;
+				}
+			}
+		}
+
+		if ((IINT32)(current - 30000) >= 0) {
+			bool pending = rtnext != index || bulknext != bulksent;
+			return pending && (IINT32)(current - 40000) < 0;
+		}
+
+		// 流的个数协商完成之前附加流还不能发送，跳过这一条
+		for (; (IINT32)(current - slap) >= 0; slap += 20) {
+			head[0] = 0xffffffff;
+			head[1] = current;
+			head[2] = index;
+			if (ikcp_send_stream(kcp1, realtime, buffer, 12) >= 0) index++;
+		}
+
+		// snd_queue 只保留少量批量数据，实时消息不必在发送端排队，
+		// 延迟差异只来自接收端的队头阻塞
+		memset(buffer, 0, 2000);
+		while (kcp1->nsnd_que < 4) {
+			head[0] = bulksent;
+			if (ikcp_send_stream(kcp1, bulk, buffer, 2000) < 0) break;
+			bulksent++;
+		}
+
+		*wake = slap;
+		return true;
+	}
+};
+
+// 返回实时消息的平均和 p99 延迟
+static void stream_latency(int separate, int lostrate, int *avg, int *p99)
+{
+	LatencySimulator vnet(lostrate, 60, 125, 100000, 1);
+	StreamScenario sc(separate);
+	int steps;
+	sim_run(vnet, sc, &steps);
+	sim_expect(sc.disorder == 0, "streams lostrate=%d: %d messages out of order",
+		lostrate, sc.disorder);
+	sim_expect(sc.rtnext == sc.index && sc.bulknext == sc.bulksent,
+		"streams lostrate=%d: realtime %d/%d bulk %d/%d delivered", lostrate,
+		(int)sc.rtnext, (int)sc.index, (int)sc.bulknext, (int)sc.bulksent);
+
+	std::vector<IUINT32> &latency = sc.latency;
+	std::sort(latency.begin(), latency.end());
+	IINT64 sum = 0;
+	for (size_t i = 0; i < latency.size(); i++) sum += latency[i];
+	*avg = latency.empty()? 0 : (int)(sum / (IINT64)latency.size());
+	*p99 = latency.empty()? 0 : (int)latency[latency.size() * 99 / 100];
+}
+
+static void streams()
+{
+	static const int losts[] = { 0, 2, 5, 10 };
+	for (size_t i = 0; i < sizeof(losts) / sizeof(losts[0]); i++) {
+		int avg1, p991, avg2, p992;
+		stream_latency(0, losts[i], &avg1, &p991);
+		stream_latency(1, losts[i], &avg2, &p992);
+		printf("lostrate=%d%% realtime latency: shared avg=%d p99=%d, "
+			"separate avg=%d p99=%d\n", losts[i], avg1, p991, avg2, p992);
+	}
+}
+
+// 请求/应答：每 200ms 发出一个 3 段的请求，对端收齐后回送 3 段的应答，
+// 统计请求发出到应答收齐的时间。丢失的往往是一串段的最后一个，
+// 后面没有 ACK 可以触发快速重传。300 秒后停止发送，再等应答收齐
+struct RequestScenario : SimScenario
+{
+	int recovery;
+	std::vector<IUINT32> latency;
+	IUINT32 slap, index, next;
+	int disorder;
+
+	RequestScenario(int r): recovery(r), slap(200), index(0), next(0),
+		disorder(0) {}
+
+	void configure(ikcpcb *kcp, int id) {
+		ikcp_wndsize(kcp, 128, 128);
+		ikcp_nodelay(kcp, 0, 10, 2, 1);
+		ikcp_recovery(kcp, recovery);
+	}
+
+	bool tick(IUINT32 current, ikcpcb *kcp1, ikcpcb *kcp2, IUINT32 *wake) {
+		static char buffer[8000];
+		IUINT32 *head = (IUINT32*)buffer;
+		int hr;
+
+		while ((hr = ikcp_recv(kcp2, buffer, sizeof(buffer))) > 0) {
+			ikcp_send(kcp2, buffer, hr);
+			ikcp_flush(kcp2);
+		}
+		while ((hr = ikcp_recv(kcp1, buffer, sizeof(buffer))) > 0) {
+			latency.push_back(current - head[0]);
+			if (head[1] != next) disorder++;
+			next = head[1] + 1;
+		}
+
+		if ((IINT32)(current - 300000) >= 0) {
+			return next != index && (IINT32)(current - 360000) < 0;
+		}
+
+		for (; (IINT32)(current - slap) >= 0; slap += 200) {
+			memset(buffer, 0, 3 * kcp1->mss);
+			head[0] = current;
+			head[1] = index++;
+			ikcp_send(kcp1, buffer, 3 * kcp1->mss);
+			ikcp_flush(kcp1);
+		}
+
+		*wake = slap;
+		return true;
+	}
+};
+
+static void request_latency(int recovery, int lostrate, int *p50, int *p99)
+{
+	LatencySimulator vnet(lostrate, 60, 125, 1000, 1);
+	RequestScenario sc(recovery);
+	int steps;
+	sim_run(vnet, sc, &steps);
+	sim_expect(sc.disorder == 0, "recovery=%d lostrate=%d: %d replies out of order",
+		recovery, lostrate, sc.disorder);
+	sim_expect(sc.next == sc.index, "recovery=%d lostrate=%d: %d of %d answered",
+		recovery, lostrate, (int)sc.next, (int)sc.index);
+
+	std::vector<IUINT32> &latency = sc.latency;
+	std::sort(latency.begin(), latency.end());
+	*p50 = latency.empty()? 0 : (int)latency[latency.size() / 2];
+	*p99 = latency.empty()? 0 : (int)latency[latency.size() * 99 / 100];
+}
+
+static void recovery()
+{
+	static const int losts[] = { 2, 5, 10 };
+	static const char *names[4] = { "off", "rack", "tlp", "rack+tlp" };
+	for (size_t i = 0; i < sizeof(losts) / sizeof(losts[0]); i++) {
+		printf("lostrate=%d%%", losts[i]);
+		for (int r = 0; r < 4; r++) {
+			int p50, p99;
+			request_latency(r, losts[i], &p50, &p99);
+			printf("  %s p50=%d p99=%d", names[r], p50, p99);
+		}
+		printf("\n");
+	}
+}
+
+// 批量传输 2MB：mtu 为 0 时两端都开启路径 MTU 探测 (576-1500)，否则固定为 mtu。
+// 接收端的 ACK 包同样受路径 MTU 限制。shrink 不为 0 时，500ms 后路径 MTU
+// 变为 shrink，按原 mtu 发出的段成为黑洞。数据按偏移填充，接收端逐字节检查
+struct PmtuScenario : SimScenario
+{
+	LatencySimulator &vnet;
+	LinkProfile profile;
+	int shrink, mtu;
+	int total, sent, received, corrupt;
+	int final, probes;
+
+	PmtuScenario(LatencySimulator &v, int pathmtu, int s, int m): vnet(v),
+		profile(1, 30, 40), shrink(s), mtu(m), total(2 * 1024 * 1024),
+		sent(0), received(0), corrupt(0), final(0), probes(0) {
+		profile.mtu = pathmtu;
+		vnet.setprofile(0, profile);
+		vnet.setprofile(1, profile);
+	}
+
+	void configure(ikcpcb *kcp, int id) {
+		ikcp_wndsize(kcp, 256, 256);
+		ikcp_nodelay(kcp, 1, 10, 2, 1);
+		if (mtu > 0) ikcp_setmtu(kcp, mtu);
+		else ikcp_pmtud(kcp, 576, 1500);
+	}
+
+	bool tick(IUINT32 current, ikcpcb *kcp1, ikcpcb *kcp2, IUINT32 *wake) {
+		static char buffer[2000];
+		int hr;
+
+		if (received >= total || (IINT32)(current - 60000) >= 0) {
+			final = (int)kcp1->mtu;
+			probes = (int)kcp1->stats.out_probes;
+			return false;
+		}
+		if (shrink > 0 && current >= 500 && profile.mtu != shrink) {
+			profile.mtu = shrink;
+			vnet.setprofile(0, profile);
+			vnet.setprofile(1, profile);
+		}
+		while ((hr = ikcp_recv(kcp2, buffer, sizeof(buffer))) > 0) {
+			for (int i = 0; i < hr; i++) {
+				if (buffer[i] != (char)((received + i) % 251)) corrupt++;
+			}
+			received += hr;
+		}
+		while (sent < total && ikcp_waitsnd(kcp1) < 512) {
+			int size = (int)kcp1->mss;
+			for (int i = 0; i < size; i++) buffer[i] = (char)((sent + i) % 251);
+			ikcp_send(kcp1, buffer, size);
+			sent += size;
+		}
+
+		*wake = current + 100;
+		return true;
+	}
+};
+
+// 返回用时，超过 60 秒没有传完返回 -1
+static int pmtu_transfer(int pathmtu, int shrink, int mtu, int *pkts, int *final,
+	int *probes)
+{
+	LatencySimulator vnet(2, 60, 80, 1000, 1);
+	PmtuScenario sc(vnet, pathmtu, shrink, mtu);
+	int steps;
+	IUINT32 elapsed = sim_run(vnet, sc, &steps);
+	sim_expect(sc.corrupt == 0, "pmtud path=%d mtu=%d: %d bytes corrupted",
+		pathmtu, mtu, sc.corrupt);
+
+	*pkts = vnet.tx1;
+	*final = sc.final;
+	*probes = sc.probes;
+	return (sc.received >= sc.total)? (int)elapsed : -1;
+}
+
+static void pmtud()
+{
+	static const int paths[] = { 576, 1280, 1500, 1500 };
+	static const int shrinks[] = { 0, 0, 0, 1000 };
+	static const int mtus[] = { 576, 1400, 0 };
+	for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		int path = (shrinks[i] > 0)? shrinks[i] : paths[i];
+		if (shrinks[i] > 0) printf("path mtu=%d->%d", paths[i], shrinks[i]);
+		else printf("path mtu=%d", paths[i]);
+		for (size_t k = 0; k < sizeof(mtus) / sizeof(mtus[0]); k++) {
+			int pkts, final, probes;
+			int elapsed = pmtu_transfer(paths[i], shrinks[i], mtus[k], &pkts,
+				&final, &probes);
+			if (mtus[k] > 0) printf("  mtu %d:", mtus[k]);
+			else printf("  pmtud:");
+			if (elapsed < 0) printf(" stalled");
+			else printf(" %dms pkts=%d", elapsed, pkts);
+			if (mtus[k] == 0) printf(" found=%d probes=%d", final, probes);
+			// 固定的 mtu 超过路径 MTU 时停滞是预期的
+			if (mtus[k] <= path) {
+				sim_expect(elapsed >= 0 && final <= path,
+					"pmtud path=%d mtu=%d: elapsed=%d found=%d", path, mtus[k],
+					elapsed, final);
+			}
+		}
+		printf("\n");
+	}
+}
+
+// 多流共享瓶颈：输出每种模式的吞吐份额、Jain 公平性指数和排队延迟
+static void multiflow(int nflows, const char *modelist, int rate, int seconds)
+{
+	std::vector<int> modes;
+	for (const char *p = modelist; *p; ) {
+		modes.push_back(atoi(p) & 3);
+		while (*p && *p != ',') p++;
+		if (*p == ',') p++;
+	}
+	if (modes.empty()) modes.push_back(0);
+	for (size_t i = 0; i < modes.size(); i++) {
+		if (modes[i] > 2) modes[i] = 2;		// 多流模拟不使用 fec
+	}
+
+	// 队列按 100ms 的带宽时延积配置
+	MultiFlowSimulator sim(rate, rate * 100, 1);
+	Rng rng(7);
+	for (int i = 0; i < nflows; i++) {
+		int rtt = 20 + rng.uniform(80);
+		sim.addflow(modes[i % modes.size()], rtt, 128, 10);
+	}
+
+	IUINT32 ts = iclock();
+	IUINT32 warmup = 2000000;
+	IUINT32 until = warmup + (IUINT32)seconds * 1000000;
+	sim.run(warmup);
+	std::vector<IINT64> base(nflows);
+	for (int i = 0; i < nflows; i++) base[i] = sim.flow(i).rxbytes;
+	size_t qbase = sim.sojourn().size();
+	sim.run(until);
+	ts = iclock() - ts;
+
+	double sum = 0, sum2 = 0;
+	double share[3] = { 0, 0, 0 };
+	int members[3] = { 0, 0, 0 };
+	for (int i = 0; i < nflows; i++) {
+		double x = (double)(sim.flow(i).rxbytes - base[i]);
+		sum += x;
+		sum2 += x * x;
+		share[sim.flow(i).mode] += x;
+		members[sim.flow(i).mode]++;
+	}
+	double jain = (sum2 > 0)? sum * sum / (nflows * sum2) : 0;
+	double goodput = sum / seconds / 1000.0;
+
+	std::vector<IUINT32> delays(sim.sojourn().begin() + qbase, sim.sojourn().end());
+	std::sort(delays.begin(), delays.end());
+	double qavg = 0;
+	for (size_t i = 0; i < delays.size(); i++) qavg += delays[i];
+	if (delays.size() > 0) qavg /= delays.size();
+	IUINT32 p50 = delays.empty()? 0 : delays[delays.size() / 2];
+	IUINT32 p99 = delays.empty()? 0 : delays[delays.size() * 99 / 100];
+
+	printf("flows=%d rate=%dB/ms seconds=%d wall=%dms pool=%d\n", nflows, rate,
+		seconds, (int)ts, (int)sim.poolsize());
+	printf("goodput=%.1fB/ms utilization=%.1f%% jain=%.4f drops=%lld\n",
+		goodput, goodput * 100.0 / rate, jain, (long long)sim.dropped());
+	printf("queue delay avg=%.2fms p50=%.2fms p99=%.2fms\n", qavg / 1000.0,
+		p50 / 1000.0, p99 / 1000.0);
+	for (int m = 0; m < 3; m++) {
+		if (members[m] == 0) continue;
+		printf("%-8s flows=%d share=%.1f%% perflow=%.2fB/ms\n", mode_names[m],
+			members[m], sum > 0? share[m] * 100.0 / sum : 0,
+			share[m] / members[m] / seconds / 1000.0);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "streams") == 0) {
+		streams();
+		return sim_failures > 0? 1 : 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "recovery") == 0) {
+		recovery();
+		return sim_failures > 0? 1 : 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "pmtud") == 0) {
+		pmtud();
+		return sim_failures > 0? 1 : 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "multiflow") == 0) {
+		int nflows = (argc > 2)? atoi(argv[2]) : 16;
+		const char *modes = (argc > 3)? argv[3] : "0,2";
+		int rate = (argc > 4)? atoi(argv[4]) : 12500;
+		int seconds = (argc > 5)? atoi(argv[5]) : 10;
+		if (nflows < 1) nflows = 1;
+		if (rate < 1) rate = 1;
+		if (seconds < 1) seconds = 1;
+		multiflow(nflows, modes, rate, seconds);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "profiles") == 0) {
+		profiles();
+		return sim_failures > 0? 1 : 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "sweep") == 0) {
+		IUINT32 ts = iclock();
+		sweep();
+		fprintf(stderr, "wall time %dms\n", (int)(iclock() - ts));
+		return 0;
+	}
+	for (int mode = 0; mode < 4; mode++) {
+		IUINT32 ts = iclock();
+		SimConfig cfg = default_config(mode);
+		SimResult r = simulate(cfg);
+		ts = iclock() - ts;
+		printf("%s mode result (%dms virtual, %dms wall, %d steps):\n",
+			mode_names[mode], (int)r.elapsed, (int)ts, r.steps);
+		printf("avgrtt=%d maxrtt=%d tx=%d\n", r.avgrtt, r.maxrtt, r.tx);
+		sim_expect(r.delivered >= cfg.count, "%s: %d of %d echoed within %dms",
+			mode_names[mode], r.delivered, cfg.count, (int)cfg.limit);
+	}
+	return sim_failures > 0? 1 : 0;
+}
+
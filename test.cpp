@@ -64,7 +64,7 @@ void test(int mode)
 		// 普通模式，关闭流控等
 		ikcp_nodelay(kcp1, 0, 10, 0, 1);
 		ikcp_nodelay(kcp2, 0, 10, 0, 1);
-	}	else {
+	}	else if (mode == 2) {
 		// 启动快速模式
 		// 第二个参数 nodelay-启用以后若干常规加速将启动
 		// 第三个参数 interval为内部处理时钟，默认设置为 10ms
@@ -74,6 +74,14 @@ void test(int mode)
 		ikcp_nodelay(kcp2, 2, 10, 2, 1);
 		kcp1->rx_minrto = 10;
 		kcp1->fastresend = 1;
+	}	else {
+		// 快速模式 + 前向纠错：每 4 个数据包附带 2 个 Reed-Solomon 校验包
+		ikcp_nodelay(kcp1, 2, 10, 2, 1);
+		ikcp_nodelay(kcp2, 2, 10, 2, 1);
+		kcp1->rx_minrto = 10;
+		kcp1->fastresend = 1;
+		ikcp_fec(kcp1, IKCP_FEC_RS, 4, 2);
+		ikcp_fec(kcp2, IKCP_FEC_RS, 4, 2);
 	}
 
 
@@ -152,7 +160,7 @@ void test(int mode)
 	ikcp_release(kcp1);
 	ikcp_release(kcp2);
 
-	const char *names[3] = { "default", "normal", "fast" };
+	const char *names[4] = { "default", "normal", "fast", "fast+fec" };
 	printf("%s mode result (%dms):\n", names[mode], (int)ts1);
 	printf("avgrtt=%d maxrtt=%d tx=%d\n", (int)(sumrtt / count), (int)maxrtt, (int)vnet->tx1);
 	printf("press enter to next ...\n");
@@ -164,6 +172,7 @@ int main()
 	test(0);	// 默认模式，类似 TCP：正常模式，无快速重传，常规流控
 	test(1);	// 普通模式，关闭流控等
 	test(2);	// 快速模式，所有开关都打开，且关闭流控
+	test(3);	// 快速模式 + 前向纠错
 	return 0;
 }
 
@@ -176,6 +185,9 @@ avgrtt=156 maxrtt=571
 
 fast mode result (20207ms):
 avgrtt=138 maxrtt=392
+
+fast+fec mode result (20120ms):
+avgrtt=105 maxrtt=160
 */
 
 
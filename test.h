@@ -6,6 +6,7 @@
 #include <time.h>
 #include <ctype.h>
 #include <string.h>
+#include <math.h>
 
 #include "ikcp.h"
 
@@ -82,6 +83,8 @@ static inline void isleep(unsigned long millisecond)
 #ifdef __cplusplus
 #include <list>
 #include <vector>
+#include <deque>
+#include <queue>
 
 // 带延迟的数据包
 class DelayPacket
@@ -113,12 +116,45 @@ protected:
 	IUINT32 _ts;
 };
 
+// 可复现的伪随机数发生器 (xorshift64*)，同一个种子产生同样的序列
+class Rng
+{
+public:
+	Rng(IUINT64 seed = 1) { reseed(seed); }
+
+	void reseed(IUINT64 seed) {
+		// splitmix64 打散种子，避免 0 和相近种子产生相关序列
+		IUINT64 z = seed + 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		state = z ^ (z >> 31);
+		if (state == 0) state = 0x2545f4914f6cdd1dULL;
+	}
+
+	IUINT32 next() {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return (IUINT32)((state * 0x2545f4914f6cdd1dULL) >> 32);
+	}
+
+	// [0, n) 内的整数
+	int uniform(int n) { return (n <= 0)? 0 : (int)(next() % (IUINT32)n); }
+
+	// [0, 1) 内的实数
+	double real() { return next() / 4294967296.0; }
+
+protected:
+	IUINT64 state;
+};
+
 // 均匀分布的随机数
 class Random
 {
 public:
-	Random(int size) {
+	Random(int size, Rng *rng) {
 		this->size = 0;
+		this->rng = rng;
 		seeds.resize(size);
 	}
 
@@ -131,7 +167,7 @@ public:
 			}
 			size = (int)seeds.size();
 		}
-		i = rand() % size;
+		i = rng->uniform(size);
 		x = seeds[i];
 		seeds[i] = seeds[--size];
 		return x;
@@ -139,9 +175,47 @@ public:
 
 protected:
 	int size;
+	Rng *rng;
 	std::vector<int> seeds;
 };
 
+// 单向链路的损伤参数
+struct LinkProfile
+{
+	int lostrate;		// 均匀丢包率百分比
+	double ge_p;		// Gilbert-Elliott：好状态 -> 坏状态的概率（每包）
+	double ge_r;		// Gilbert-Elliott：坏状态 -> 好状态的概率（每包）
+	double ge_good;		// 好状态下的丢包概率
+	double ge_bad;		// 坏状态下的丢包概率
+	int delaymin;		// 单程延迟下限 (ms)
+	int delaymax;		// 单程延迟上限 (ms)
+	int jitter;			// 延迟分布：JITTER_UNIFORM / JITTER_NORMAL / JITTER_PARETO
+	double reorder;		// 不受先进先出约束、可被后发包超越的概率
+	double duplicate;	// 重复投递的概率
+	int rate;			// 瓶颈带宽 (字节/ms)，0 表示不限
+	int burst;			// 令牌桶深度 (字节)
+	int queue;			// 瓶颈队列长度 (字节)，超出后尾部丢弃
+	int redmin;			// RED 最小阈值 (字节)，0 表示只用尾部丢弃
+	int redmax;			// RED 最大阈值 (字节)
+	double redprob;		// 平均队列达到 redmax 时的丢包概率
+	int mtu;			// 路径 MTU (字节)，更大的包被丢弃，0 表示不限
+
+	enum { JITTER_UNIFORM = 0, JITTER_NORMAL = 1, JITTER_PARETO = 2 };
+
+	LinkProfile(int lostrate = 0, int delaymin = 0, int delaymax = 0) {
+		this->lostrate = lostrate;
+		ge_p = ge_r = ge_good = ge_bad = 0;
+		this->delaymin = delaymin;
+		this->delaymax = delaymax;
+		jitter = JITTER_UNIFORM;
+		reorder = duplicate = 0;
+		rate = burst = queue = 0;
+		redmin = redmax = 0;
+		redprob = 0;
+		mtu = 0;
+	}
+};
+
 // 网络延迟模拟器
 class LatencySimulator
 {
@@ -154,93 +228,532 @@ public:
 	// lostrate: 往返一周丢包率的百分比，默认 10%
 	// rttmin：rtt最小值，默认 60
 	// rttmax：rtt最大值，默认 125
-	LatencySimulator(int lostrate = 10, int rttmin = 60, int rttmax = 125, int nmax = 1000): 
-		r12(100), r21(100) {
-		current = iclock();		
-		this->lostrate = lostrate / 2;	// 上面数据是往返丢包率，单程除以2
-		this->rttmin = rttmin / 2;
-		this->rttmax = rttmax / 2;
+	// seed：随机数种子，相同种子和相同的输入序列得到相同的结果
+	LatencySimulator(int lostrate = 10, int rttmin = 60, int rttmax = 125, int nmax = 1000,
+		IUINT64 seed = 1): rng(seed), r12(100, &rng), r21(100, &rng) {
+		vclock = NULL;
+		current = now();
+		// 上面数据是往返丢包率和 rtt，单程除以2
+		LinkProfile profile(lostrate / 2, rttmin / 2, rttmax / 2);
 		this->nmax = nmax;
 		tx1 = tx2 = 0;
+		for (int i = 0; i < 2; i++) {
+			links[i].random = (i == 0)? &r12 : &r21;
+			setprofile(i, profile);
+		}
+	}
+
+	// 设置 peer 发出方向的链路参数，两个方向可以不同
+	void setprofile(int peer, const LinkProfile &profile) {
+		Link &link = links[peer];
+		link.profile = profile;
+		link.bad = false;
+		link.tokens = profile.burst;
+		link.refill = now();
+		link.avgqueue = 0;
+		link.lost = link.dropped = link.duplicated = link.toobig = 0;
 	}
 
 	// 清除数据
 	void clear() {
-		DelayTunnel::iterator it;
-		for (it = p12.begin(); it != p12.end(); it++) {
-			delete *it;
-		}
-		for (it = p21.begin(); it != p21.end(); it++) {
-			delete *it;
+		for (int i = 0; i < 2; i++) {
+			DelayTunnel::iterator it;
+			for (it = links[i].tunnel.begin(); it != links[i].tunnel.end(); it++) {
+				delete *it;
+			}
+			links[i].tunnel.clear();
 		}
-		p12.clear();
-		p21.clear();
+	}
+
+	// 使用虚拟时钟：之后所有时间戳都读取 *clock，不再调用 iclock()
+	void setclock(const IUINT32 *clock) {
+		vclock = clock;
+		current = now();
+		links[0].refill = links[1].refill = current;
+	}
+
+	// 发往 peer 的下一个包的到达时间，没有待送达的包时返回 false
+	bool next_delivery(int peer, IUINT32 *ts) const {
+		const DelayTunnel &tunnel = links[1 - peer].tunnel;
+		if (tunnel.empty()) return false;
+		*ts = tunnel.front()->ts();
+		return true;
 	}
 
 	// 发送数据
 	// peer - 端点0/1，从0发送，从1接收；从1发送从0接收
 	void send(int peer, const void *data, int size) {
-		if (peer == 0) {
-			tx1++;
-			if (r12.random() < lostrate) return;
-			if ((int)p12.size() >= nmax) return;
-		}	else {
-			tx2++;
-			if (r21.random() < lostrate) return;
-			if ((int)p21.size() >= nmax) return;
+		Link &link = links[peer];
+		if (peer == 0) tx1++;
+		else tx2++;
+		current = now();
+		if (link.profile.mtu > 0 && size > link.profile.mtu) {
+			link.toobig++;
+			return;
 		}
-		DelayPacket *pkt = new DelayPacket(size, data);
-		current = iclock();
-		IUINT32 delay = rttmin;
-		if (rttmax > rttmin) delay += rand() % (rttmax - rttmin);
-		pkt->setts(current + delay);
-		if (peer == 0) {
-			p12.push_back(pkt);
-		}	else {
-			p21.push_back(pkt);
+		if (lose(link)) {
+			link.lost++;
+			return;
+		}
+		IINT32 wait = 0;
+		if (!enqueue(link, size, &wait)) {
+			link.dropped++;
+			return;
+		}
+		deliver(link, data, size, wait);
+		if (link.profile.duplicate > 0 && rng.real() < link.profile.duplicate) {
+			link.duplicated++;
+			deliver(link, data, size, wait);
 		}
 	}
 
 	// 接收数据
 	int recv(int peer, void *data, int maxsize) {
-		DelayTunnel::iterator it;
-		if (peer == 0) {
-			it = p21.begin();
-			if (p21.size() == 0) return -1;
-		}	else {
-			it = p12.begin();
-			if (p12.size() == 0) return -1;
-		}
-		DelayPacket *pkt = *it;
-		current = iclock();
-		if (current < pkt->ts()) return -2;
+		DelayTunnel &tunnel = links[1 - peer].tunnel;
+		if (tunnel.size() == 0) return -1;
+		DelayPacket *pkt = tunnel.front();
+		current = now();
+		if ((IINT32)(current - pkt->ts()) < 0) return -2;
 		if (maxsize < pkt->size()) return -3;
-		if (peer == 0) {
-			p21.erase(it);
-		}	else {
-			p12.erase(it);
-		}
+		tunnel.pop_front();
 		maxsize = pkt->size();
 		memcpy(data, pkt->ptr(), maxsize);
 		delete pkt;
 		return maxsize;
 	}
 
+	// peer 发出方向上：随机丢包数、瓶颈队列丢包数、重复投递数、超过 MTU 的包数
+	int lost(int peer) const { return links[peer].lost; }
+	int dropped(int peer) const { return links[peer].dropped; }
+	int duplicated(int peer) const { return links[peer].duplicated; }
+	int toobig(int peer) const { return links[peer].toobig; }
+
 public:
 	int tx1;
 	int tx2;
 
 protected:
+	typedef std::list<DelayPacket*> DelayTunnel;
+
+	struct Link {
+		LinkProfile profile;
+		DelayTunnel tunnel;
+		Random *random;
+		bool bad;			// Gilbert-Elliott 当前是否处于坏状态
+		double tokens;		// 令牌桶余额，为负表示排队中的字节数
+		IUINT32 refill;		// 上次补充令牌的时间
+		double avgqueue;	// RED 平均队列长度
+		int lost;
+		int dropped;
+		int duplicated;
+		int toobig;			// 超过路径 MTU 被丢弃的包数
+	};
+
+	IUINT32 now() const { return vclock? *vclock : iclock(); }
+
+	// 随机丢包：均匀丢包 + Gilbert-Elliott 突发丢包
+	bool lose(Link &link) {
+		const LinkProfile &profile = link.profile;
+		if (link.random->random() < profile.lostrate) return true;
+		if (profile.ge_p > 0 || profile.ge_bad > 0) {
+			if (link.bad) {
+				if (rng.real() < profile.ge_r) link.bad = false;
+			}	else {
+				if (rng.real() < profile.ge_p) link.bad = true;
+			}
+			double p = link.bad? profile.ge_bad : profile.ge_good;
+			if (p > 0 && rng.real() < p) return true;
+		}
+		return false;
+	}
+
+	// 令牌桶瓶颈：返回 false 表示被队列丢弃，wait 为排队时间
+	bool enqueue(Link &link, int size, IINT32 *wait) {
+		const LinkProfile &profile = link.profile;
+		if ((int)link.tunnel.size() >= nmax) return false;
+		if (profile.rate <= 0) return true;
+		link.tokens += (double)(IINT32)(current - link.refill) * profile.rate;
+		if (link.tokens > profile.burst) link.tokens = profile.burst;
+		link.refill = current;
+		double backlog = (link.tokens < 0)? -link.tokens : 0;
+		if (profile.queue > 0 && backlog + size > profile.queue) return false;
+		if (profile.redmax > profile.redmin && profile.redmin > 0) {
+			link.avgqueue = link.avgqueue * 0.998 + backlog * 0.002;
+			if (link.avgqueue >= profile.redmax) return false;
+			if (link.avgqueue > profile.redmin) {
+				double p = profile.redprob * (link.avgqueue - profile.redmin) /
+					(profile.redmax - profile.redmin);
+				if (rng.real() < p) return false;
+			}
+		}
+		link.tokens -= size;
+		if (link.tokens < 0) *wait = (IINT32)(-link.tokens / profile.rate);
+		return true;
+	}
+
+	// 传播延迟
+	IINT32 delay(const LinkProfile &profile) {
+		int span = profile.delaymax - profile.delaymin;
+		if (span <= 0) return profile.delaymin;
+		double x;
+		switch (profile.jitter) {
+		case LinkProfile::JITTER_NORMAL:
+			// 中心在区间中点，标准差为区间的 1/4，截断到 [delaymin, +inf)
+			x = 0;
+			for (int i = 0; i < 12; i++) x += rng.real();
+			x = span * 0.5 + (x - 6.0) * span * 0.25;
+			if (x < 0) x = 0;
+			break;
+		case LinkProfile::JITTER_PARETO:
+			// 长尾：大多数接近 delaymin，尾部可以超过 delaymax
+			x = span * 0.25 * (1.0 / sqrt(1.0 - rng.real()) - 1.0);
+			break;
+		default:
+			return profile.delaymin + rng.uniform(span);
+		}
+		return profile.delaymin + (IINT32)x;
+	}
+
+	// 按到达时间放入隧道：默认先进先出（不会超越前面的包），
+	// 以 reorder 概率按自己的到达时间插入，允许乱序
+	void deliver(Link &link, const void *data, int size, IINT32 wait) {
+		DelayPacket *pkt = new DelayPacket(size, data);
+		IUINT32 ts = current + wait + delay(link.profile);
+		DelayTunnel &tunnel = link.tunnel;
+		bool reorder = link.profile.reorder > 0 && rng.real() < link.profile.reorder;
+		if (!reorder) {
+			if (!tunnel.empty() && (IINT32)(tunnel.back()->ts() - ts) > 0) {
+				ts = tunnel.back()->ts();
+			}
+			pkt->setts(ts);
+			tunnel.push_back(pkt);
+			return;
+		}
+		pkt->setts(ts);
+		DelayTunnel::iterator it = tunnel.end();
+		while (it != tunnel.begin()) {
+			DelayTunnel::iterator prev = it;
+			--prev;
+			if ((IINT32)((*prev)->ts() - ts) <= 0) break;
+			it = prev;
+		}
+		tunnel.insert(it, pkt);
+	}
+
+protected:
+	const IUINT32 *vclock;
 	IUINT32 current;
-	int lostrate;
-	int rttmin;
-	int rttmax;
 	int nmax;
-	typedef std::list<DelayPacket*> DelayTunnel;
-	DelayTunnel p12;
-	DelayTunnel p21;
+	Rng rng;
 	Random r12;
 	Random r21;
+	Link links[2];
+};
+
+// 多流模拟用的数据包，从 PacketPool 中分配和回收
+struct SimPacket
+{
+	SimPacket *next;
+	IUINT32 enqueue;	// 进入瓶颈队列的时间
+	int flow;
+	int side;			// 目的端点 0/1
+	int size;
+	char data[2048];
+};
+
+// 数据包缓冲池：按块分配，释放的包放回空闲链表复用
+class PacketPool
+{
+public:
+	PacketPool(): freelist(NULL) {}
+
+	virtual ~PacketPool() {
+		for (size_t i = 0; i < chunks.size(); i++) delete[] chunks[i];
+	}
+
+	SimPacket *alloc() {
+		if (freelist == NULL) {
+			SimPacket *chunk = new SimPacket[256];
+			chunks.push_back(chunk);
+			for (int i = 0; i < 256; i++) {
+				chunk[i].next = freelist;
+				freelist = &chunk[i];
+			}
+		}
+		SimPacket *pkt = freelist;
+		freelist = pkt->next;
+		pkt->next = NULL;
+		return pkt;
+	}
+
+	void release(SimPacket *pkt) {
+		pkt->next = freelist;
+		freelist = pkt;
+	}
+
+	size_t capacity() const { return chunks.size() * 256; }
+
+protected:
+	SimPacket *freelist;
+	std::vector<SimPacket*> chunks;
+};
+
+// 事件调度器：最小堆，时间相同的事件按加入顺序执行，保证可复现
+struct SimEvent
+{
+	IUINT32 ts;
+	IUINT32 seq;
+	int type;
+	int flow;
+	int side;
+	SimPacket *pkt;
+};
+
+class EventQueue
+{
+public:
+	EventQueue(): seq(0) {}
+
+	void push(IUINT32 ts, int type, int flow, int side, SimPacket *pkt = NULL) {
+		SimEvent ev;
+		ev.ts = ts;
+		ev.seq = seq++;
+		ev.type = type;
+		ev.flow = flow;
+		ev.side = side;
+		ev.pkt = pkt;
+		heap.push(ev);
+	}
+
+	bool empty() const { return heap.empty(); }
+	const SimEvent &top() const { return heap.top(); }
+	void pop() { heap.pop(); }
+
+protected:
+	struct Later {
+		bool operator()(const SimEvent &a, const SimEvent &b) const {
+			IINT32 diff = (IINT32)(a.ts - b.ts);
+			if (diff != 0) return diff > 0;
+			return (IINT32)(a.seq - b.seq) > 0;
+		}
+	};
+	IUINT32 seq;
+	std::priority_queue<SimEvent, std::vector<SimEvent>, Later> heap;
+};
+
+// 多流共享瓶颈模拟器：每条流的端点 0 向端点 1 发送大块数据，
+// 数据方向经过同一个先进先出、尾部丢弃的瓶颈队列，ACK 方向不拥塞。
+// 时钟单位为微秒，kcp 使用 IKCP_TIME_US 时基。
+class MultiFlowSimulator
+{
+public:
+	// 单条流的配置和统计
+	struct Flow {
+		int mode;			// 0: default, 1: normal, 2: fast
+		IUINT32 delay;		// 单程传播延迟 (us)
+		ikcpcb *kcp[2];
+		IUINT32 wake[2];	// 已调度的 update 时间
+		IINT64 rxbytes;		// 端点 1 收到的应用数据
+		IINT64 drops;		// 在瓶颈处被丢弃的包
+		MultiFlowSimulator *sim;
+		int index;
+	};
+
+	// rate：瓶颈带宽（字节/ms），queue：队列长度（字节）
+	MultiFlowSimulator(int rate, int queue, IUINT64 seed = 1):
+		rng(seed), rate(rate), limit(queue) {
+		current = 0;
+		backlog = 0;
+		busy = false;
+		drops = 0;
+		delivered = 0;
+		msgsize = 1024;
+	}
+
+	virtual ~MultiFlowSimulator() {
+		for (size_t i = 0; i < flows.size(); i++) {
+			ikcp_release(flows[i]->kcp[0]);
+			ikcp_release(flows[i]->kcp[1]);
+			delete flows[i];
+		}
+	}
+
+	// 增加一条流，rtt 为基础往返时间 (ms)
+	int addflow(int mode, int rtt, int wnd, int interval) {
+		Flow *flow = new Flow;
+		flow->mode = mode;
+		flow->delay = (IUINT32)rtt * 500;
+		flow->rxbytes = 0;
+		flow->drops = 0;
+		flow->sim = this;
+		flow->index = (int)flows.size();
+		for (int side = 0; side < 2; side++) {
+			ikcpcb *kcp = ikcp_create(0x11223344, flow);
+			kcp->output = (side == 0)? output_data : output_ack;
+			ikcp_timebase(kcp, IKCP_TIME_US);
+			ikcp_wndsize(kcp, wnd, wnd);
+			if (mode == 0) {
+				ikcp_nodelay(kcp, 0, interval * 1000, 0, 0);
+			}	else if (mode == 1) {
+				ikcp_nodelay(kcp, 0, interval * 1000, 0, 1);
+			}	else {
+				ikcp_nodelay(kcp, 2, interval * 1000, 2, 1);
+			}
+			flow->kcp[side] = kcp;
+			// 错开各流的起始时间，避免所有流在同一时刻 flush
+			flow->wake[side] = current + rng.uniform(interval * 1000);
+			events.push(flow->wake[side], EV_UPDATE, flow->index, side);
+		}
+		flows.push_back(flow);
+		return flow->index;
+	}
+
+	// 运行到 until (us)
+	void run(IUINT32 until) {
+		while (!events.empty() && (IINT32)(events.top().ts - until) <= 0) {
+			SimEvent ev = events.top();
+			events.pop();
+			current = ev.ts;
+			switch (ev.type) {
+			case EV_UPDATE: on_update(ev); break;
+			case EV_DEPART: on_depart(); break;
+			case EV_DELIVER: on_deliver(ev); break;
+			}
+		}
+		current = until;
+	}
+
+	IUINT32 now() const { return current; }
+	int size() const { return (int)flows.size(); }
+	const Flow &flow(int i) const { return *flows[i]; }
+
+	// 瓶颈队列统计
+	IINT64 dropped() const { return drops; }
+	IINT64 forwarded() const { return delivered; }
+	const std::vector<IUINT32> &sojourn() const { return delays; }
+	size_t poolsize() const { return pool.capacity(); }
+
+	// 应用消息大小
+	int msgsize;
+
+protected:
+	enum { EV_UPDATE = 0, EV_DEPART = 1, EV_DELIVER = 2 };
+
+	// 端点 0 的输出：进入瓶颈队列
+	static int output_data(const char *buf, int len, ikcpcb *kcp, void *user) {
+		Flow *flow = (Flow*)user;
+		flow->sim->enqueue(flow, buf, len);
+		return 0;
+	}
+
+	// 端点 1 的输出：ACK 方向只有传播延迟
+	static int output_ack(const char *buf, int len, ikcpcb *kcp, void *user) {
+		Flow *flow = (Flow*)user;
+		MultiFlowSimulator *sim = flow->sim;
+		SimPacket *pkt = sim->packet(flow, 0, buf, len);
+		sim->events.push(sim->current + flow->delay, EV_DELIVER, flow->index, 0, pkt);
+		return 0;
+	}
+
+	SimPacket *packet(Flow *flow, int side, const char *buf, int len) {
+		SimPacket *pkt = pool.alloc();
+		pkt->flow = flow->index;
+		pkt->side = side;
+		pkt->size = len;
+		pkt->enqueue = current;
+		memcpy(pkt->data, buf, len);
+		return pkt;
+	}
+
+	void enqueue(Flow *flow, const char *buf, int len) {
+		if (backlog + len > limit) {
+			flow->drops++;
+			drops++;
+			return;
+		}
+		SimPacket *pkt = packet(flow, 1, buf, len);
+		queue.push_back(pkt);
+		backlog += len;
+		if (!busy) transmit();
+	}
+
+	// 队头包开始发送，发送完成时产生 EV_DEPART
+	void transmit() {
+		SimPacket *pkt = queue.front();
+		IUINT32 service = (IUINT32)(((IINT64)pkt->size * 1000 + rate - 1) / rate);
+		busy = true;
+		events.push(current + service, EV_DEPART, pkt->flow, 1);
+	}
+
+	void on_depart() {
+		SimPacket *pkt = queue.front();
+		queue.pop_front();
+		backlog -= pkt->size;
+		delays.push_back(current - pkt->enqueue);
+		delivered++;
+		events.push(current + flows[pkt->flow]->delay, EV_DELIVER, pkt->flow, 1, pkt);
+		busy = false;
+		if (!queue.empty()) transmit();
+	}
+
+	void on_deliver(const SimEvent &ev) {
+		Flow *flow = flows[ev.flow];
+		ikcp_input(flow->kcp[ev.side], ev.pkt->data, ev.pkt->size);
+		pool.release(ev.pkt);
+		service(flow);
+		schedule(flow, ev.side);
+	}
+
+	void on_update(const SimEvent &ev) {
+		Flow *flow = flows[ev.flow];
+		if (ev.ts != flow->wake[ev.side]) return;	// 已被更早的事件取代
+		ikcp_update(flow->kcp[ev.side], current);
+		service(flow);
+		flow->wake[ev.side] = current - 1;
+		schedule(flow, ev.side);
+	}
+
+	// 应用层：发送端保持队列不空，接收端读走全部数据
+	void service(Flow *flow) {
+		static char buffer[1 << 16];
+		ikcpcb *snd = flow->kcp[0];
+		while (ikcp_waitsnd(snd) < (int)snd->snd_wnd * 2) {
+			if (ikcp_send(snd, buffer, msgsize) < 0) break;
+		}
+		int hr;
+		while ((hr = ikcp_recv(flow->kcp[1], buffer, sizeof(buffer))) > 0) {
+			flow->rxbytes += hr;
+		}
+	}
+
+	// 按 ikcp_check 重新安排 update，只在比已调度的时间更早时加入新事件。
+	// 已到期的重传要等到 ts_flush 才会由 ikcp_update 发出，此时跳到 ts_flush
+	void schedule(Flow *flow, int side) {
+		ikcpcb *kcp = flow->kcp[side];
+		IUINT32 ts = ikcp_check(kcp, current);
+		if ((IINT32)(ts - current) <= 0 && kcp->updated) ts = kcp->ts_flush;
+		if ((IINT32)(ts - current) <= 0) ts = current + 1;
+		IINT32 diff = (IINT32)(ts - flow->wake[side]);
+		if (diff < 0 || (IINT32)(flow->wake[side] - current) < 0) {
+			flow->wake[side] = ts;
+			events.push(ts, EV_UPDATE, flow->index, side);
+		}
+	}
+
+protected:
+	Rng rng;
+	int rate;
+	int limit;
+	int backlog;
+	bool busy;
+	IUINT32 current;
+	IINT64 drops;
+	IINT64 delivered;
+	PacketPool pool;
+	EventQueue events;
+	std::deque<SimPacket*> queue;
+	std::vector<Flow*> flows;
+	std::vector<IUINT32> delays;
 };
 
 #endif